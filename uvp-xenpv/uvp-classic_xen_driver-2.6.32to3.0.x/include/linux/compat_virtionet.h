@@ -96,4 +96,11 @@ static void __exit __driver##_exit(void) \
 module_exit(__driver##_exit);
 #endif /* module_driver */
 
+/* Byte queue limits only exist from 3.3 on; account nothing before. */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,3,0))
+#define netdev_tx_sent_queue(txq, bytes) do { } while (0)
+#define netdev_tx_completed_queue(txq, pkts, bytes) do { } while (0)
+#define netdev_tx_reset_queue(txq) do { } while (0)
+#endif /* netdev_tx_sent_queue */
+
 #endif /* __COMPAT_VIRTIONET_H__ */
\ No newline at end of file
@@ -40,14 +40,21 @@ static unsigned int iff_live_addr_change = 1;
 static int napi_weight = 64;
 module_param(napi_weight, int, 0444);
 
-static bool csum = true, gso = true;
+static bool csum = true, gso = true, napi_tx = true;
 module_param(csum, bool, 0444);
 module_param(gso, bool, 0444);
+module_param(napi_tx, bool, 0444);
 
 /* FIXME: MTU in config. */
 #define MAX_PACKET_LEN (ETH_HLEN + VLAN_HLEN + ETH_DATA_LEN)
 #define GOOD_COPY_LEN	128
 
+/* Weight of the mergeable packet length average, see virtnet_rx_avg_add(). */
+#define RECEIVE_AVG_WEIGHT 64
+
+/* Minimum alignment for mergeable packet buffers. */
+#define MERGEABLE_BUFFER_ALIGN max_t(unsigned long, L1_CACHE_BYTES, 256)
+
 #ifndef VIRTIO_F_ANY_LAYOUT
 #define VIRTIO_F_ANY_LAYOUT		27
 #endif
@@ -69,6 +76,9 @@ struct send_queue {
 	/* Virtqueue associated with this send _queue */
 	struct virtqueue *vq;
 
+	/* Reclaims sent skbs, only registered in napi_tx mode */
+	struct napi_struct napi;
+
 	/* TX: fragments + linear part + virtio header */
 	struct scatterlist sg[MAX_SKB_FRAGS + 2];
 
@@ -76,6 +86,15 @@ struct send_queue {
 	char name[40];
 };
 
+/* Per receive queue counters, only updated from its NAPI poll. */
+struct virtnet_rq_stats {
+	unsigned long packets;
+	unsigned long gro_merged;	/* coalesced into a held GRO packet */
+	unsigned long gro_held;		/* held by GRO as a new packet */
+	unsigned long merged_bufs;	/* extra mergeable buffers per packet */
+	unsigned long frag_recycled;	/* mergeable buffer pages reused */
+};
+
 /* Internal representation of a receive virtqueue */
 struct receive_queue {
 	/* Virtqueue associated with this receive_queue */
@@ -83,12 +102,21 @@ struct receive_queue {
 
 	struct napi_struct napi;
 
+	struct virtnet_rq_stats stats;
+
 	/* Number of input buffers, and max we've ever had. */
 	unsigned int num, max;
 
 	/* Chain pages by the private ptr. */
 	struct page *pages;
 
+	/* Page mergeable buffers are carved from, and its first free byte. */
+	struct page *frag_page;
+	unsigned int frag_offset;
+
+	/* Average packet length, sizes the mergeable buffers. */
+	unsigned long mrg_avg_pkt_len;
+
 	/* RX: fragments + linear part + virtio header */
 	struct scatterlist sg[MAX_SKB_FRAGS + 2];
 
@@ -219,15 +247,75 @@ static struct page *get_a_page(struct receive_queue *rq, gfp_t gfp_mask)
 	return p;
 }
 
+/*
+ * Mergeable buffers are handed to the virtqueue as a context word: the
+ * buffer address, aligned to MERGEABLE_BUFFER_ALIGN, with the number of
+ * alignment units it spans (less one) in the low bits.
+ */
+static unsigned long mergeable_buf_to_ctx(void *buf, unsigned int truesize)
+{
+	unsigned int size = truesize / MERGEABLE_BUFFER_ALIGN;
+
+	return (unsigned long)buf | (size - 1);
+}
+
+static void *mergeable_ctx_to_buf_address(unsigned long mrg_ctx)
+{
+	return (void *)(mrg_ctx & -MERGEABLE_BUFFER_ALIGN);
+}
+
+static unsigned int mergeable_ctx_to_buf_truesize(unsigned long mrg_ctx)
+{
+	unsigned int size = mrg_ctx & (MERGEABLE_BUFFER_ALIGN - 1);
+
+	return (size + 1) * MERGEABLE_BUFFER_ALIGN;
+}
+
+static void put_mergeable_buf(unsigned long mrg_ctx)
+{
+	put_page(virt_to_head_page(mergeable_ctx_to_buf_address(mrg_ctx)));
+}
+
+/* Called from the NAPI poll only, which serializes the updates. */
+static void virtnet_rx_avg_add(struct receive_queue *rq, unsigned int len)
+{
+	unsigned long avg = rq->mrg_avg_pkt_len;
+
+	if (avg)
+		avg = (avg * (RECEIVE_AVG_WEIGHT - 1) + len) /
+		      RECEIVE_AVG_WEIGHT;
+	else
+		avg = len;
+	rq->mrg_avg_pkt_len = avg;
+}
+
+/*
+ * Size of the next mergeable buffer: room for the average packet, but
+ * never less than a full-MTU frame nor more than a page.
+ */
+static unsigned int get_mergeable_buf_len(struct receive_queue *rq)
+{
+	const unsigned int hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+	unsigned int len;
+
+	len = hdr_len + clamp_t(unsigned int, ACCESS_ONCE(rq->mrg_avg_pkt_len),
+				MAX_PACKET_LEN, PAGE_SIZE - hdr_len);
+	return ALIGN(len, MERGEABLE_BUFFER_ALIGN);
+}
+
 static void skb_xmit_done(struct virtqueue *vq)
 {
 	struct virtnet_info *vi = vq->vdev->priv;
+	struct napi_struct *napi = &vi->sq[vq2txq(vq)].napi;
 
 	/* Suppress further interrupts. */
 	virtqueue_disable_cb(vq);
 
-	/* We were probably waiting for more output buffers. */
-	netif_wake_subqueue(vi->dev, vq2txq(vq));
+	if (napi->weight)
+		napi_schedule(napi);
+	else
+		/* We were probably waiting for more output buffers. */
+		netif_wake_subqueue(vi->dev, vq2txq(vq));
 }
 
 static void set_skb_frag(struct sk_buff *skb, struct page *page,
@@ -251,17 +339,60 @@ static void set_skb_frag(struct sk_buff *skb, struct page *page,
 	*len -= size;
 }
 
+/*
+ * Attach a mergeable buffer to the skb.  Consecutive buffers of a packet
+ * are often adjacent in the same page: grow the last frag then instead
+ * of using up another one, and drop the extra page reference.
+ */
+static void add_mergeable_frag(struct sk_buff *skb, struct page *page,
+			       unsigned int offset, unsigned int len,
+			       unsigned int truesize)
+{
+	int i = skb_shinfo(skb)->nr_frags;
+	skb_frag_t *frag = &skb_shinfo(skb)->frags[i - 1];
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,2,0))
+	if (i && frag->page == page &&
+	    frag->page_offset + frag->size == offset) {
+		frag->size += len;
+		put_page(page);
+	}
+#else
+	if (i && skb_frag_page(frag) == page &&
+	    frag->page_offset + skb_frag_size(frag) == offset) {
+		skb_frag_size_add(frag, len);
+		put_page(page);
+	}
+#endif
+	else {
+#if (LINUX_VERSION_CODE <= KERNEL_VERSION(3,0,13))
+		skb_fill_page_desc(skb, i, page, offset, len);
+#else
+		__skb_fill_page_desc(skb, i, page, offset, len);
+		skb_shinfo(skb)->nr_frags++;
+#endif
+	}
+
+	skb->data_len += len;
+	skb->len += len;
+	skb->truesize += truesize;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,17))
+	skb_shinfo(skb)->tx_flags |= SKBTX_SHARED_FRAG;
+#endif
+}
+
 /* Called from bottom half context */
 static struct sk_buff *page_to_skb(struct receive_queue *rq,
-				   struct page *page, unsigned int len)
+				   struct page *page, unsigned int offset,
+				   unsigned int len, unsigned int truesize)
 {
 	struct virtnet_info *vi = rq->vq->vdev->priv;
 	struct sk_buff *skb;
 	struct skb_vnet_hdr *hdr;
-	unsigned int copy, hdr_len, offset;
+	unsigned int copy, hdr_len, hdr_padded_len;
 	char *p;
 
-	p = page_address(page);
+	p = page_address(page) + offset;
 
 	/* copy small packet so we can reuse these pages for small data */
 	skb = netdev_alloc_skb_ip_align(vi->dev, GOOD_COPY_LEN);
@@ -272,16 +403,17 @@ static struct sk_buff *page_to_skb(struct receive_queue *rq,
 
 	if (vi->mergeable_rx_bufs) {
 		hdr_len = sizeof hdr->mhdr;
-		offset = hdr_len;
+		hdr_padded_len = hdr_len;
 	} else {
 		hdr_len = sizeof hdr->hdr;
-		offset = sizeof(struct padded_vnet_hdr);
+		hdr_padded_len = sizeof(struct padded_vnet_hdr);
 	}
 
 	memcpy(hdr, p, hdr_len);
 
 	len -= hdr_len;
-	p += offset;
+	offset += hdr_padded_len;
+	p += hdr_padded_len;
 
 	copy = len;
 	if (copy > skb_tailroom(skb))
@@ -291,6 +423,14 @@ static struct sk_buff *page_to_skb(struct receive_queue *rq,
 	len -= copy;
 	offset += copy;
 
+	if (vi->mergeable_rx_bufs) {
+		if (len)
+			add_mergeable_frag(skb, page, offset, len, truesize);
+		else
+			put_page(page);
+		return skb;
+	}
+
 	/*
 	 * Verify that we can indeed put this data into a skb.
 	 * This is here to handle cases when the device erroneously
@@ -330,7 +470,7 @@ static struct sk_buff *receive_big(struct net_device *dev,
 				   void *buf)
 {
 	struct page *page = buf;
-	struct sk_buff *skb = page_to_skb(rq, page, 0);
+	struct sk_buff *skb = page_to_skb(rq, page, 0, 0, PAGE_SIZE);
 
 	if (unlikely(!skb))
 		goto err;
@@ -345,59 +485,96 @@ err:
 
 static struct sk_buff *receive_mergeable(struct net_device *dev,
 					 struct receive_queue *rq,
-					 void *buf,
+					 unsigned long ctx,
 					 unsigned int len)
 {
-	struct skb_vnet_hdr *hdr = page_address(buf);
+	void *buf = mergeable_ctx_to_buf_address(ctx);
+	struct skb_vnet_hdr *hdr = buf;
 	int num_buf = hdr->mhdr.num_buffers;
-	struct page *page = buf;
-	struct sk_buff *skb = page_to_skb(rq, page, len);
-	int i;
+	struct page *page = virt_to_head_page(buf);
+	int offset = buf - page_address(page);
+	unsigned int truesize = mergeable_ctx_to_buf_truesize(ctx);
+	struct sk_buff *head_skb, *curr_skb;
+
+	if (unlikely(len > truesize)) {
+		pr_debug("%s: rx error: len %u exceeds truesize %u\n",
+			 dev->name, len, truesize);
+		dev->stats.rx_length_errors++;
+		head_skb = NULL;
+		goto err_skb;
+	}
 
-	if (unlikely(!skb))
+	head_skb = page_to_skb(rq, page, offset, len, truesize);
+	curr_skb = head_skb;
+	if (unlikely(!curr_skb))
 		goto err_skb;
 
 	while (--num_buf) {
-		i = skb_shinfo(skb)->nr_frags;
-		if (i >= MAX_SKB_FRAGS) {
-			pr_debug("%s: packet too long\n", skb->dev->name);
-			skb->dev->stats.rx_length_errors++;
-			goto err_frags;
-		}
-		page = virtqueue_get_buf(rq->vq, &len);
-		if (!page) {
+		int num_skb_frags;
+
+		ctx = (unsigned long)virtqueue_get_buf(rq->vq, &len);
+		if (unlikely(!ctx)) {
 			pr_debug("%s: rx error: %d buffers %d missing\n",
 				 dev->name, hdr->mhdr.num_buffers, num_buf);
 			dev->stats.rx_length_errors++;
 			goto err_buf;
 		}
 
-		if (len > PAGE_SIZE)
-			len = PAGE_SIZE;
+		buf = mergeable_ctx_to_buf_address(ctx);
+		page = virt_to_head_page(buf);
+		--rq->num;
+		rq->stats.merged_bufs++;
+
+		truesize = mergeable_ctx_to_buf_truesize(ctx);
+		if (unlikely(len > truesize)) {
+			pr_debug("%s: rx error: len %u exceeds truesize %u\n",
+				 dev->name, len, truesize);
+			dev->stats.rx_length_errors++;
+			goto err_skb;
+		}
 
-		set_skb_frag(skb, page, 0, &len);
+		/* Small buffers run out of frags early, chain more skbs. */
+		num_skb_frags = skb_shinfo(curr_skb)->nr_frags;
+		if (unlikely(num_skb_frags == MAX_SKB_FRAGS)) {
+			struct sk_buff *nskb = alloc_skb(0, GFP_ATOMIC);
 
-		--rq->num;
+			if (unlikely(!nskb))
+				goto err_skb;
+			if (curr_skb == head_skb)
+				skb_shinfo(curr_skb)->frag_list = nskb;
+			else
+				curr_skb->next = nskb;
+			curr_skb = nskb;
+			head_skb->truesize += nskb->truesize;
+		}
+		if (curr_skb != head_skb) {
+			head_skb->data_len += len;
+			head_skb->len += len;
+			head_skb->truesize += truesize;
+		}
+		offset = buf - page_address(page);
+		add_mergeable_frag(curr_skb, page, offset, len, truesize);
 	}
-	return skb;
+
+	virtnet_rx_avg_add(rq, head_skb->len);
+	return head_skb;
+
 err_skb:
-	give_pages(rq, page);
+	put_page(page);
 	while (--num_buf) {
-err_frags:
-		buf = virtqueue_get_buf(rq->vq, &len);
-		if (unlikely(!buf)) {
+		ctx = (unsigned long)virtqueue_get_buf(rq->vq, &len);
+		if (unlikely(!ctx)) {
 			pr_debug("%s: rx error: %d buffers missing\n",
 				 dev->name, num_buf);
 			dev->stats.rx_length_errors++;
 			break;
 		}
-		page = buf;
-		give_pages(rq, page);
+		put_mergeable_buf(ctx);
 		--rq->num;
 	}
 err_buf:
 	dev->stats.rx_dropped++;
-	dev_kfree_skb(skb);
+	dev_kfree_skb(head_skb);
 	return NULL;
 }
 
@@ -413,14 +590,16 @@ static void receive_buf(struct receive_queue *rq, void *buf, unsigned int len)
 	if (unlikely(len < sizeof(struct virtio_net_hdr) + ETH_HLEN)) {
 		pr_debug("%s: short packet %i\n", dev->name, len);
 		dev->stats.rx_length_errors++;
-		if (vi->mergeable_rx_bufs || vi->big_packets)
+		if (vi->mergeable_rx_bufs)
+			put_mergeable_buf((unsigned long)buf);
+		else if (vi->big_packets)
 			give_pages(rq, buf);
 		else
 			dev_kfree_skb(buf);
 		return;
 	}
 	if (vi->mergeable_rx_bufs)
-		skb = receive_mergeable(dev, rq, buf, len);
+		skb = receive_mergeable(dev, rq, (unsigned long)buf, len);
 	else if (vi->big_packets)
 		skb = receive_big(dev, rq, buf);
 	else
@@ -430,7 +609,9 @@ static void receive_buf(struct receive_queue *rq, void *buf, unsigned int len)
 		return;
 
 	hdr = skb_vnet_hdr(skb);
-	skb->truesize += skb->data_len;
+	/* Mergeable frags were charged their buffer size as they went. */
+	if (!vi->mergeable_rx_bufs)
+		skb->truesize += skb->data_len;
 
 	u64_stats_update_begin(&stats->rx_syncp);
 	stats->rx_bytes += skb->len;
@@ -484,7 +665,18 @@ static void receive_buf(struct receive_queue *rq, void *buf, unsigned int len)
 		skb_shinfo(skb)->gso_segs = 0;
 	}
 
-	netif_receive_skb(skb);
+	rq->stats.packets++;
+	switch (napi_gro_receive(&rq->napi, skb)) {
+	case GRO_MERGED:
+	case GRO_MERGED_FREE:
+		rq->stats.gro_merged++;
+		break;
+	case GRO_HELD:
+		rq->stats.gro_held++;
+		break;
+	default:
+		break;
+	}
 	return;
 
 frame_err:
@@ -567,20 +759,58 @@ static int add_recvbuf_big(struct receive_queue *rq, gfp_t gfp)
 	return err;
 }
 
+/*
+ * Make room for a len byte mergeable buffer in rq->frag_page.  Once the
+ * stack has released every buffer carved from the page, it is reused
+ * from the start instead of being freed.
+ */
+static bool mergeable_frag_refill(struct receive_queue *rq, unsigned int len,
+				  gfp_t gfp)
+{
+	if (rq->frag_page) {
+		if (page_count(rq->frag_page) == 1) {
+			if (rq->frag_offset)
+				rq->stats.frag_recycled++;
+			rq->frag_offset = 0;
+			return true;
+		}
+		if (rq->frag_offset + len <= PAGE_SIZE)
+			return true;
+		put_page(rq->frag_page);
+	}
+
+	rq->frag_page = alloc_page(gfp);
+	rq->frag_offset = 0;
+	return rq->frag_page != NULL;
+}
+
 static int add_recvbuf_mergeable(struct receive_queue *rq, gfp_t gfp)
 {
-	struct page *page;
+	unsigned int len = get_mergeable_buf_len(rq);
+	unsigned int hole;
+	unsigned long ctx;
+	char *buf;
 	int err;
 
-	page = get_a_page(rq, gfp);
-	if (!page)
+	if (unlikely(!mergeable_frag_refill(rq, len, gfp)))
 		return -ENOMEM;
 
-	sg_init_one(rq->sg, page_address(page), PAGE_SIZE);
+	buf = (char *)page_address(rq->frag_page) + rq->frag_offset;
+	get_page(rq->frag_page);
+	rq->frag_offset += len;
+	hole = PAGE_SIZE - rq->frag_offset;
+	if (hole < len) {
+		/* Too little left for another buffer, give it to this one. */
+		len += hole;
+		rq->frag_offset += hole;
+	}
+	ctx = mergeable_buf_to_ctx(buf, len);
+
+	sg_init_one(rq->sg, buf, len);
 
-	err = virtqueue_add_inbuf(rq->vq, rq->sg, 1, page, gfp);
+	err = virtqueue_add_inbuf(rq->vq, rq->sg, 1, (void *)ctx, gfp);
 	if (err < 0)
-		give_pages(rq, page);
+		put_mergeable_buf(ctx);
 
 	return err;
 }
@@ -645,6 +875,28 @@ static void virtnet_napi_enable(struct receive_queue *rq)
 	}
 }
 
+static void virtnet_napi_tx_enable(struct send_queue *sq)
+{
+	if (!sq->napi.weight)
+		return;
+
+	napi_enable(&sq->napi);
+
+	/* Completions that came in while disabled raised no interrupt. */
+	if (napi_schedule_prep(&sq->napi)) {
+		virtqueue_disable_cb(sq->vq);
+		local_bh_disable();
+		__napi_schedule(&sq->napi);
+		local_bh_enable();
+	}
+}
+
+static void virtnet_napi_tx_disable(struct send_queue *sq)
+{
+	if (sq->napi.weight)
+		napi_disable(&sq->napi);
+}
+
 static void refill_work(struct work_struct *work)
 {
 	struct virtnet_info *vi =
@@ -688,7 +940,7 @@ again:
 			schedule_delayed_work(&vi->refill, 0);
 	}
 
-	/* Out of packets? */
+	/* Out of packets?  napi_complete() also flushes held GRO packets. */
 	if (received < budget) {
 		r = virtqueue_enable_cb_prepare(rq->vq);
 		napi_complete(napi);
@@ -714,28 +966,65 @@ static int virtnet_open(struct net_device *dev)
 			if (!try_fill_recv(&vi->rq[i], GFP_KERNEL))
 				schedule_delayed_work(&vi->refill, 0);
 		virtnet_napi_enable(&vi->rq[i]);
+		virtnet_napi_tx_enable(&vi->sq[i]);
 	}
 
 	return 0;
 }
 
+/* Called with the tx queue lock held. */
 static void free_old_xmit_skbs(struct send_queue *sq)
 {
 	struct sk_buff *skb;
-	unsigned int len;
+	unsigned int len, packets = 0, bytes = 0;
 	struct virtnet_info *vi = sq->vq->vdev->priv;
 	struct virtnet_stats *stats = this_cpu_ptr(vi->stats);
 
 	while ((skb = virtqueue_get_buf(sq->vq, &len)) != NULL) {
 		pr_debug("Sent skb %p\n", skb);
 
-		u64_stats_update_begin(&stats->tx_syncp);
-		stats->tx_bytes += skb->len;
-		stats->tx_packets++;
-		u64_stats_update_end(&stats->tx_syncp);
-
+		packets++;
+		bytes += skb->len;
 		dev_kfree_skb_any(skb);
 	}
+
+	if (!packets)
+		return;
+
+	u64_stats_update_begin(&stats->tx_syncp);
+	stats->tx_bytes += bytes;
+	stats->tx_packets += packets;
+	u64_stats_update_end(&stats->tx_syncp);
+
+	/* Without napi_tx completions may wait for the next send: no BQL. */
+	if (sq->napi.weight)
+		netdev_tx_completed_queue(netdev_get_tx_queue(vi->dev,
+							      vq2txq(sq->vq)),
+					  packets, bytes);
+}
+
+static int virtnet_poll_tx(struct napi_struct *napi, int budget)
+{
+	struct send_queue *sq = container_of(napi, struct send_queue, napi);
+	struct virtnet_info *vi = sq->vq->vdev->priv;
+	struct netdev_queue *txq = netdev_get_tx_queue(vi->dev, vq2txq(sq->vq));
+	unsigned int r;
+
+	__netif_tx_lock(txq, raw_smp_processor_id());
+	free_old_xmit_skbs(sq);
+	__netif_tx_unlock(txq);
+
+	r = virtqueue_enable_cb_prepare(sq->vq);
+	napi_complete(napi);
+	if (unlikely(virtqueue_poll(sq->vq, r)) && napi_schedule_prep(napi)) {
+		virtqueue_disable_cb(sq->vq);
+		__napi_schedule(napi);
+	}
+
+	if (sq->vq->num_free >= 2+MAX_SKB_FRAGS)
+		netif_tx_wake_queue(txq);
+
+	return 0;
 }
 
 static int xmit_skb(struct send_queue *sq, struct sk_buff *skb)
@@ -811,11 +1100,17 @@ static netdev_tx_t start_xmit(struct sk_buff *skb, struct net_device *dev)
 	struct virtnet_info *vi = netdev_priv(dev);
 	int qnum = skb_get_queue_mapping(skb);
 	struct send_queue *sq = &vi->sq[qnum];
+	bool use_napi = sq->napi.weight;
+	unsigned int len = skb->len;
 	int err;
 
 	/* Free up any pending old buffers before queueing new ones. */
 	free_old_xmit_skbs(sq);
 
+	/* Let the completion interrupt come once most of the ring is used. */
+	if (use_napi)
+		virtqueue_enable_cb_delayed(sq->vq);
+
 	/* Try to transmit */
 	err = xmit_skb(sq, skb);
 
@@ -831,15 +1126,21 @@ static netdev_tx_t start_xmit(struct sk_buff *skb, struct net_device *dev)
 	}
 	virtqueue_kick(sq->vq);
 
-	/* Don't wait up for transmitted skbs to be freed. */
-	skb_orphan(skb);
-	nf_reset(skb);
+	if (use_napi) {
+		netdev_tx_sent_queue(netdev_get_tx_queue(dev, qnum), len);
+	} else {
+		/* Don't wait up for transmitted skbs to be freed. */
+		skb_orphan(skb);
+		nf_reset(skb);
+	}
 
 	/* Apparently nice girls don't return TX_BUSY; stop the queue
-	 * before it gets out of hand.  Naturally, this wastes entries. */
+	 * before it gets out of hand.  Naturally, this wastes entries.
+	 * In napi_tx mode virtnet_poll_tx() wakes it up again. */
 	if (sq->vq->num_free < 2+MAX_SKB_FRAGS) {
 		netif_stop_subqueue(dev, qnum);
-		if (unlikely(!virtqueue_enable_cb_delayed(sq->vq))) {
+		if (!use_napi &&
+		    unlikely(!virtqueue_enable_cb_delayed(sq->vq))) {
 			/* More just got used, free them then recheck. */
 			free_old_xmit_skbs(sq);
 			if (sq->vq->num_free >= 2+MAX_SKB_FRAGS) {
@@ -1092,8 +1393,10 @@ static int virtnet_close(struct net_device *dev)
 	/* Make sure refill_work doesn't re-enable napi! */
 	cancel_delayed_work_sync(&vi->refill);
 
-	for (i = 0; i < vi->max_queue_pairs; i++)
+	for (i = 0; i < vi->max_queue_pairs; i++) {
 		napi_disable(&vi->rq[i].napi);
+		virtnet_napi_tx_disable(&vi->sq[i]);
+	}
 
 	return 0;
 }
@@ -1378,10 +1681,106 @@ static void virtnet_get_channels(struct net_device *dev,
 }
 #endif
 
+struct virtnet_stat_desc {
+	char desc[ETH_GSTRING_LEN];
+	size_t offset;
+};
+
+#define VIRTNET_RQ_STAT(m)	offsetof(struct virtnet_rq_stats, m)
+
+/* Reported once per queue pair in use, as "rx_queue_<n>_<desc>". */
+static const struct virtnet_stat_desc virtnet_rq_stats_desc[] = {
+	{ "packets",		VIRTNET_RQ_STAT(packets) },
+	{ "gro_merged",		VIRTNET_RQ_STAT(gro_merged) },
+	{ "gro_held",		VIRTNET_RQ_STAT(gro_held) },
+	{ "merged_bufs",	VIRTNET_RQ_STAT(merged_bufs) },
+	{ "frag_recycled",	VIRTNET_RQ_STAT(frag_recycled) },
+};
+
+#define VIRTNET_RQ_STATS_LEN	ARRAY_SIZE(virtnet_rq_stats_desc)
+
+static int virtnet_get_sset_count(struct net_device *dev, int sset)
+{
+	struct virtnet_info *vi = netdev_priv(dev);
+
+	switch (sset) {
+	case ETH_SS_STATS:
+		return vi->curr_queue_pairs * VIRTNET_RQ_STATS_LEN;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void virtnet_get_strings(struct net_device *dev, u32 stringset,
+				u8 *data)
+{
+	struct virtnet_info *vi = netdev_priv(dev);
+	unsigned int i, j;
+
+	if (stringset != ETH_SS_STATS)
+		return;
+
+	for (i = 0; i < vi->curr_queue_pairs; i++) {
+		for (j = 0; j < VIRTNET_RQ_STATS_LEN; j++) {
+			snprintf(data, ETH_GSTRING_LEN, "rx_queue_%u_%s",
+				 i, virtnet_rq_stats_desc[j].desc);
+			data += ETH_GSTRING_LEN;
+		}
+	}
+}
+
+static void virtnet_get_ethtool_stats(struct net_device *dev,
+				      struct ethtool_stats *stats, u64 *data)
+{
+	struct virtnet_info *vi = netdev_priv(dev);
+	unsigned int i, j, idx = 0;
+
+	for (i = 0; i < vi->curr_queue_pairs; i++) {
+		const void *rq_stats = &vi->rq[i].stats;
+
+		for (j = 0; j < VIRTNET_RQ_STATS_LEN; j++)
+			data[idx++] = *(const unsigned long *)
+				(rq_stats + virtnet_rq_stats_desc[j].offset);
+	}
+}
+
+#ifdef CONFIG_SYSFS
+/* Current mergeable buffer size of each receive queue in use. */
+static ssize_t mergeable_rx_buffer_size_show(struct device *d,
+					     struct device_attribute *attr,
+					     char *buf)
+{
+	struct virtnet_info *vi = netdev_priv(to_net_dev(d));
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < vi->curr_queue_pairs; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s%u",
+				 i ? " " : "", get_mergeable_buf_len(&vi->rq[i]));
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	return len;
+}
+
+static DEVICE_ATTR(mergeable_rx_buffer_size, S_IRUGO,
+		   mergeable_rx_buffer_size_show, NULL);
+
+static struct attribute *virtnet_mrg_rx_attrs[] = {
+	&dev_attr_mergeable_rx_buffer_size.attr,
+	NULL
+};
+
+static const struct attribute_group virtnet_mrg_rx_group = {
+	.attrs = virtnet_mrg_rx_attrs,
+};
+#endif
+
 static const struct ethtool_ops virtnet_ethtool_ops = {
 	.get_drvinfo = virtnet_get_drvinfo,
 	.get_link = ethtool_op_get_link,	
 	.get_ringparam = virtnet_get_ringparam,
+	.get_sset_count = virtnet_get_sset_count,
+	.get_strings = virtnet_get_strings,
+	.get_ethtool_stats = virtnet_get_ethtool_stats,
 #if (LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,34))	
 	.set_tx_csum = virtnet_set_tx_csum,
 	.set_sg = ethtool_op_set_sg,
@@ -1518,8 +1917,11 @@ static void virtnet_free_queues(struct virtnet_info *vi)
 {
 	int i;
 
-	for (i = 0; i < vi->max_queue_pairs; i++)
+	for (i = 0; i < vi->max_queue_pairs; i++) {
 		netif_napi_del(&vi->rq[i].napi);
+		if (vi->sq[i].napi.weight)
+			netif_napi_del(&vi->sq[i].napi);
+	}
 
 	kfree(vi->rq);
 	kfree(vi->sq);
@@ -1532,6 +1934,10 @@ static void free_receive_bufs(struct virtnet_info *vi)
 	for (i = 0; i < vi->max_queue_pairs; i++) {
 		while (vi->rq[i].pages)
 			__free_pages(get_a_page(&vi->rq[i], GFP_KERNEL), 0);
+		if (vi->rq[i].frag_page) {
+			put_page(vi->rq[i].frag_page);
+			vi->rq[i].frag_page = NULL;
+		}
 	}
 }
 
@@ -1544,13 +1950,16 @@ static void free_unused_bufs(struct virtnet_info *vi)
 		struct virtqueue *vq = vi->sq[i].vq;
 		while ((buf = virtqueue_detach_unused_buf(vq)) != NULL)
 			dev_kfree_skb(buf);
+		netdev_tx_reset_queue(netdev_get_tx_queue(vi->dev, i));
 	}
 
 	for (i = 0; i < vi->max_queue_pairs; i++) {
 		struct virtqueue *vq = vi->rq[i].vq;
 
 		while ((buf = virtqueue_detach_unused_buf(vq)) != NULL) {
-			if (vi->mergeable_rx_bufs || vi->big_packets)
+			if (vi->mergeable_rx_bufs)
+				put_mergeable_buf((unsigned long)buf);
+			else if (vi->big_packets)
 				give_pages(&vi->rq[i], buf);
 			else
 				dev_kfree_skb(buf);
@@ -1665,6 +2074,9 @@ static int virtnet_alloc_queues(struct virtnet_info *vi)
 		vi->rq[i].pages = NULL;
 		netif_napi_add(vi->dev, &vi->rq[i].napi, virtnet_poll,
 			       napi_weight);
+		if (napi_tx)
+			netif_napi_add(vi->dev, &vi->sq[i].napi,
+				       virtnet_poll_tx, napi_weight);
 
 		sg_init_table(vi->rq[i].sg, ARRAY_SIZE(vi->rq[i].sg));
 		sg_init_table(vi->sq[i].sg, ARRAY_SIZE(vi->sq[i].sg));
@@ -1733,7 +2145,8 @@ static int virtnet_probe(struct virtio_device *vdev)
 	dev->priv_flags |= IFF_UNICAST_FLT;
 #endif	
 	dev->netdev_ops = &virtnet_netdev;
-	dev->features = NETIF_F_HIGHDMA;
+	/* Older kernels do not turn GRO on by themselves. */
+	dev->features = NETIF_F_HIGHDMA | NETIF_F_GRO;
 
 	SET_ETHTOOL_OPS(dev, &virtnet_ethtool_ops);
 	SET_NETDEV_DEV(dev, &vdev->dev);
@@ -1846,6 +2259,10 @@ static int virtnet_probe(struct virtio_device *vdev)
 	}
 	put_online_cpus();
 
+#ifdef CONFIG_SYSFS
+	if (vi->mergeable_rx_bufs)
+		dev->sysfs_groups[0] = &virtnet_mrg_rx_group;
+#endif
 	err = register_netdev(dev);
 	if (err) {
 		pr_debug("virtio_net: registering device failed\n");
@@ -1955,6 +2372,7 @@ static int virtnet_freeze(struct virtio_device *vdev)
 		for (i = 0; i < vi->max_queue_pairs; i++) {
 			napi_disable(&vi->rq[i].napi);
 			netif_napi_del(&vi->rq[i].napi);
+			virtnet_napi_tx_disable(&vi->sq[i]);
 		}
 
 	remove_vq_common(vi);
@@ -1978,8 +2396,10 @@ static int virtnet_restore(struct virtio_device *vdev)
 			if (!try_fill_recv(&vi->rq[i], GFP_KERNEL))
 				schedule_delayed_work(&vi->refill, 0);
 
-		for (i = 0; i < vi->max_queue_pairs; i++)
+		for (i = 0; i < vi->max_queue_pairs; i++) {
 			virtnet_napi_enable(&vi->rq[i]);
+			virtnet_napi_tx_enable(&vi->sq[i]);
+		}
 	}
 
 	netif_device_attach(vi->dev);
@@ -23,6 +23,18 @@
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/hrtimer.h>
+#include <linux/skbuff.h>
+
+/*
+ * Indirect tables big enough for a network packet (header, linear part and
+ * every frag) are recycled through a per-queue cache instead of going
+ * back to the slab; larger ones are allocated and freed one by one.
+ */
+#define VRING_INDIRECT_CACHE_DESCS	(2 + MAX_SKB_FRAGS)
+#define VRING_INDIRECT_CACHE_SIZE \
+	(VRING_INDIRECT_CACHE_DESCS * sizeof(struct vring_desc))
+/* Cached tables allocated along with the queue. */
+#define VRING_INDIRECT_PREFILL		32
 
 #ifdef DEBUG
 /* For development, we want to crash whenever the ring is screwed. */
@@ -69,6 +81,9 @@ struct vring_virtqueue
 	/* Host supports indirect buffers */
 	bool indirect;
 
+	/* Free cache-sized indirect tables, linked through their first word. */
+	void *indirect_cache;
+
 	/* Host publishes avail event idx */
 	bool event;
 
@@ -98,6 +113,56 @@ struct vring_virtqueue
 
 #define to_vvq(_vq) container_of(_vq, struct vring_virtqueue, vq)
 
+static void *vring_alloc_indirect(struct vring_virtqueue *vq,
+				  unsigned int total_sg, gfp_t gfp)
+{
+	void *desc = vq->indirect_cache;
+
+	/*
+	 * We require lowmem mappings for the descriptors because
+	 * otherwise virt_to_phys will give us bogus addresses in the
+	 * virtqueue.
+	 */
+	gfp &= ~(__GFP_HIGHMEM | __GFP_HIGH);
+
+	if (total_sg > VRING_INDIRECT_CACHE_DESCS)
+		return kmalloc(total_sg * sizeof(struct vring_desc), gfp);
+
+	if (desc) {
+		vq->indirect_cache = *(void **)desc;
+		return desc;
+	}
+	return kmalloc(VRING_INDIRECT_CACHE_SIZE, gfp);
+}
+
+/*
+ * Every cache-sized table is either cached or in flight, one per ring
+ * slot at most, so the cache needs no bound of its own.
+ */
+static void vring_free_indirect(struct vring_virtqueue *vq, void *desc,
+				unsigned int total_sg)
+{
+	if (total_sg > VRING_INDIRECT_CACHE_DESCS) {
+		kfree(desc);
+		return;
+	}
+
+	*(void **)desc = vq->indirect_cache;
+	vq->indirect_cache = desc;
+}
+
+/*
+ * An indirect table saves ring slots at the cost of one more fetch by
+ * the host: only go indirect for multiple buffers once half the ring is
+ * in use, or when the buffer couldn't be added directly at all.
+ */
+static inline bool vring_use_indirect(const struct vring_virtqueue *vq,
+				      unsigned int total_sg)
+{
+	return vq->indirect && total_sg > 2 && vq->vq.num_free &&
+	       vq->vq.num_free < total_sg + vq->vring.num / 2;
+}
+
 static inline struct scatterlist *sg_next_chained(struct scatterlist *sg,
 						  unsigned int *count)
 {
@@ -129,14 +194,7 @@ static inline int vring_add_indirect(struct vring_virtqueue *vq,
 	struct scatterlist *sg;
 	int i, n;
 
-	/*
-	 * We require lowmem mappings for the descriptors because
-	 * otherwise virt_to_phys will give us bogus addresses in the
-	 * virtqueue.
-	 */
-	gfp &= ~(__GFP_HIGHMEM | __GFP_HIGH);
-
-	desc = kmalloc(total_sg * sizeof(struct vring_desc), gfp);
+	desc = vring_alloc_indirect(vq, total_sg, gfp);
 	if (!desc)
 		return -ENOMEM;
 
@@ -217,8 +275,8 @@ static inline int virtqueue_add(struct virtqueue *_vq,
 	total_sg = total_in + total_out;
 
 	/* If the host supports indirect descriptor tables, and we have multiple
-	 * buffers, then go indirect. FIXME: tune this threshold */
-	if (vq->indirect && total_sg > 2 && vq->vq.num_free) {
+	 * buffers, then go indirect. */
+	if (vring_use_indirect(vq, total_sg)) {
 		head = vring_add_indirect(vq, sgs, next, total_sg, total_out,
 					  total_in,
 					  out_sgs, in_sgs, gfp);
@@ -498,7 +556,9 @@ static void detach_buf(struct vring_virtqueue *vq, unsigned int head)
 
 	/* Free the indirect table */
 	if (vq->vring.desc[i].flags & VRING_DESC_F_INDIRECT)
-		kfree(phys_to_virt(vq->vring.desc[i].addr));
+		vring_free_indirect(vq, phys_to_virt(vq->vring.desc[i].addr),
+				    vq->vring.desc[i].len /
+				    sizeof(struct vring_desc));
 
 	while (vq->vring.desc[i].flags & VRING_DESC_F_NEXT) {
 		i = vq->vring.desc[i].next;
@@ -810,6 +870,16 @@ struct virtqueue *vring_new_virtqueue(unsigned int index,
 	vq->indirect = virtio_has_feature(vdev, VIRTIO_RING_F_INDIRECT_DESC);
 	vq->event = virtio_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
 
+	vq->indirect_cache = NULL;
+	for (i = 0; vq->indirect &&
+	     i < min_t(unsigned int, num, VRING_INDIRECT_PREFILL); i++) {
+		void *desc = kmalloc(VRING_INDIRECT_CACHE_SIZE, GFP_KERNEL);
+
+		if (!desc)
+			break;
+		vring_free_indirect(vq, desc, VRING_INDIRECT_CACHE_DESCS);
+	}
+
 	/* No callback?  Tell other side not to bother us. */
 	if (!callback)
 		vq->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
@@ -826,14 +896,27 @@ struct virtqueue *vring_new_virtqueue(unsigned int index,
 }
 EXPORT_SYMBOL_GPL(vring_new_virtqueue);
 
-void vring_del_virtqueue(struct virtqueue *vq)
+void vring_del_virtqueue(struct virtqueue *_vq)
 {
-	list_del(&vq->list);
-	kfree(to_vvq(vq));
+	struct vring_virtqueue *vq = to_vvq(_vq);
+	void *desc;
+
+	while ((desc = vq->indirect_cache) != NULL) {
+		vq->indirect_cache = *(void **)desc;
+		kfree(desc);
+	}
+
+	list_del(&_vq->list);
+	kfree(vq);
 }
 EXPORT_SYMBOL_GPL(vring_del_virtqueue);
 
-/* Manipulates transport-specific feature bits. */
+/*
+ * Manipulates transport-specific feature bits.  Only the split ring is
+ * implemented: the packed layout (VIRTIO_F_RING_PACKED, bit 34) needs a
+ * transport with 64-bit features and separate ring area addresses, and
+ * the legacy virtio_pci here has neither.
+ */
 void vring_transport_features(struct virtio_device *vdev)
 {
 	unsigned int i;
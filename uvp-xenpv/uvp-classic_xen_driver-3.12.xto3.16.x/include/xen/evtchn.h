@@ -141,6 +141,10 @@ void unbind_from_per_cpu_irq(unsigned int irq, unsigned int cpu,
 
 #ifndef CONFIG_XEN
 void irq_resume(void);
+/* Run the handler of an IRQ on the given CPU (-1: wherever it arrives). */
+int rebind_irq_to_cpu(int irq, int cpu);
+/* FIFO ABI queue of an IRQ's port, 0 (EVTCHN_FIFO_PRIORITY_MAX) first. */
+int set_irq_evtchn_priority(int irq, unsigned int priority);
 #endif
 
 /* Entry point for notifications into Linux subsystems. */
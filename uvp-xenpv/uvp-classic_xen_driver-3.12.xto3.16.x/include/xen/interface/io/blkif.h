@@ -173,6 +173,13 @@
  *      The maximum supported size of the request ring buffer in units of
  *      machine pages.  The value must be a power of 2.
  *
+ * multi-queue-max-queues
+ *      Values:         <uint32_t>
+ *      Default Value:  1
+ *
+ *      The maximum number of request rings, each with its own event
+ *      channel, that the backend is willing to service for this device.
+ *
  *------------------------- Backend Device Properties -------------------------
  *
  * discard-alignment
@@ -228,6 +235,17 @@
  *
  *----------------------- Request Transport Parameters -----------------------
  *
+ * multi-queue-num-queues
+ *      Values:         <uint32_t>
+ *      Default Value:  1
+ *      Maximum Value:  multi-queue-max-queues
+ *
+ *      The number of request rings the frontend has set up.  When greater
+ *      than 1, "event-channel" and the "ring-ref" node(s) of ring N are
+ *      written below a "queue-N" subdirectory (N counting from 0) instead
+ *      of directly under the frontend node; "ring-page-order" and
+ *      "num-ring-pages" stay at the top level and apply to every ring.
+ *
  * event-channel
  *      Values:         <uint32_t>
  *
@@ -6,6 +6,49 @@
 #include <linux/tcp.h>
 #include <linux/udp.h>
 #include <net/ip.h>
+#include <net/ipv6.h>
+#include <net/ip6_checksum.h>
+
+/*
+ * IPv6 flavour of skb_checksum_setup(): TCP and UDP directly after the
+ * fixed header only, as extension headers are never offloaded.
+ */
+static inline int skb_checksum_setup_ipv6(struct sk_buff *skb,
+					  __be16 *csum)
+{
+	struct ipv6hdr *ip6h = (void *)skb->data;
+	unsigned int off = sizeof(*ip6h);
+
+	switch (ip6h->nexthdr) {
+	case IPPROTO_TCP:
+		if (!skb_partial_csum_set(skb, off,
+					  offsetof(struct tcphdr, check)))
+			return -EPROTO;
+		if (csum)
+			csum = &tcp_hdr(skb)->check;
+		break;
+	case IPPROTO_UDP:
+		if (!skb_partial_csum_set(skb, off,
+					  offsetof(struct udphdr, check)))
+			return -EPROTO;
+		if (csum)
+			csum = &udp_hdr(skb)->check;
+		break;
+	default:
+		net_err_ratelimited("Attempting to checksum a non-TCP/UDP packet,"
+				    " dropping an IPv6 next header %d packet\n",
+				    ip6h->nexthdr);
+		return -EPROTO;
+	}
+
+	if (csum)
+		*csum = ~csum_ipv6_magic(&ip6h->saddr, &ip6h->daddr,
+					 skb->len - off, ip6h->nexthdr, 0);
+
+	skb_probe_transport_header(skb, 0);
+
+	return 0;
+}
 
 static inline int skb_checksum_setup(struct sk_buff *skb,
 				     unsigned long *fixup_counter)
@@ -30,6 +73,8 @@ static inline int skb_checksum_setup(struct sk_buff *skb,
 		--csum;
 	}
 
+	if (skb->protocol == htons(ETH_P_IPV6))
+		return skb_checksum_setup_ipv6(skb, csum);
 	if (skb->protocol != htons(ETH_P_IP))
 		goto out;
 
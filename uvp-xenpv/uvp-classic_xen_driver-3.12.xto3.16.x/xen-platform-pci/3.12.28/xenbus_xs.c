@@ -83,11 +83,26 @@ struct xs_stored_msg {
 	} u;
 };
 
+/*
+ * A request written to xenstored and waiting for its reply.  These live
+ * on the caller's stack; process_msg() matches replies to them by req_id.
+ */
+struct xs_pending_req {
+	struct list_head list;
+	wait_queue_head_t wq;
+	uint32_t req_id;
+	struct xs_stored_msg *reply;
+};
+
 struct xs_handle {
-	/* A list of replies. Currently only one will ever be outstanding. */
+	/*
+	 * Requests awaiting replies, any number of which may be in flight.
+	 * reply_waitq is woken whenever the list drains, for xs_suspend().
+	 */
 	struct list_head reply_list;
 	spinlock_t reply_lock;
 	wait_queue_head_t reply_waitq;
+	uint32_t next_req_id;
 
 	/*
 	 * Mutex ordering: transaction_mutex -> watch_mutex -> request_mutex.
@@ -102,7 +117,7 @@ struct xs_handle {
 	 * reach zero.
 	 */
 
-	/* One request at a time. */
+	/* Keeps each request contiguous on the ring; not held for the reply. */
 	struct mutex request_mutex;
 
 	/* Protect xenbus reader thread against save/restore. */
@@ -181,20 +196,41 @@ static bool xenbus_ok(void)
 #endif
 }
 #endif
-static void *read_reply(enum xsd_sockmsg_type *type, unsigned int *len)
+/* Drop a request from the pending list without waiting for its reply. */
+static void forget_request(struct xs_pending_req *req)
+{
+	spin_lock(&xs_state.reply_lock);
+	if (!req->reply) {
+		list_del(&req->list);
+		if (list_empty(&xs_state.reply_list))
+			wake_up(&xs_state.reply_waitq);
+	}
+	spin_unlock(&xs_state.reply_lock);
+
+	/* A reply that beat us to the lock is discarded. */
+	if (req->reply) {
+		kfree(req->reply->u.reply.body);
+		kfree(req->reply);
+	}
+}
+
+static void *read_reply(struct xs_pending_req *req,
+			enum xsd_sockmsg_type *type, unsigned int *len)
 {
 	struct xs_stored_msg *msg;
 	char *body;
 
+	/*
+	 * process_msg() hands over the reply and wakes us under reply_lock,
+	 * so once we see it under the lock @req is no longer referenced.
+	 */
 	spin_lock(&xs_state.reply_lock);
 
-	while (list_empty(&xs_state.reply_list)) {
+	while (!req->reply) {
 		spin_unlock(&xs_state.reply_lock);
 #ifdef OPENSUSE_1302
 		if (xenbus_ok())
-			/* XXX FIXME: Avoid synchronous wait for response here. */
-			wait_event_timeout(xs_state.reply_waitq,
-					   !list_empty(&xs_state.reply_list),
+			wait_event_timeout(req->wq, req->reply != NULL,
 					   msecs_to_jiffies(500));
 		else {
 			/*
@@ -203,19 +239,16 @@ static void *read_reply(enum xsd_sockmsg_type *type, unsigned int *len)
 			 * killed (xenstored application) or the other domain
 			 * has been killed or is unreachable.
 			 */
+			forget_request(req);
 			return ERR_PTR(-EIO);
 		}
 #else
-      	/* XXX FIXME: Avoid synchronous wait for response here. */
-      	wait_event(xs_state.reply_waitq,
-      		   !list_empty(&xs_state.reply_list));
+		wait_event(req->wq, req->reply != NULL);
 #endif
 		spin_lock(&xs_state.reply_lock);
 	}
 
-	msg = list_entry(xs_state.reply_list.next,
-			 struct xs_stored_msg, list);
-	list_del(&msg->list);
+	msg = req->reply;
 
 	spin_unlock(&xs_state.reply_lock);
 
@@ -256,28 +289,63 @@ static void transaction_resume(void)
 }
 #endif
 
+/*
+ * Write @msg, followed by @num_vecs payload vectors, to xenstored and
+ * wait for the reply, whose type and length are returned in @msg.  Only
+ * the write is serialised; replies are matched up by req_id, so other
+ * callers can issue requests while this one is outstanding.
+ */
+static void *xs_request_reply(struct xsd_sockmsg *msg,
+			      const struct kvec *iovec,
+			      unsigned int num_vecs)
+{
+	struct xs_pending_req req;
+	unsigned int i;
+	int err;
+
+	init_waitqueue_head(&req.wq);
+	req.reply = NULL;
+
+	mutex_lock(&xs_state.request_mutex);
+
+	spin_lock(&xs_state.reply_lock);
+	req.req_id = msg->req_id = xs_state.next_req_id++;
+	list_add_tail(&req.list, &xs_state.reply_list);
+	spin_unlock(&xs_state.reply_lock);
+
+	err = xb_write(msg, sizeof(*msg));
+	for (i = 0; !err && i < num_vecs; i++)
+		err = xb_write(iovec[i].iov_base, iovec[i].iov_len);
+
+	mutex_unlock(&xs_state.request_mutex);
+
+	if (err) {
+		forget_request(&req);
+		return ERR_PTR(err);
+	}
+
+	return read_reply(&req, &msg->type, &msg->len);
+}
+
 void *xenbus_dev_request_and_reply(struct xsd_sockmsg *msg)
 {
 	void *ret;
 	enum xsd_sockmsg_type type = msg->type;
-	int err;
+	uint32_t req_id = msg->req_id;
+	struct kvec iovec;
 
 	if (type == XS_TRANSACTION_START)
 		transaction_start();
 
-	mutex_lock(&xs_state.request_mutex);
-
-	err = xb_write(msg, sizeof(*msg) + msg->len);
-	if (err) {
+	/* The caller's req_id is ours to use on the wire; give it back. */
+	iovec.iov_base = msg + 1;
+	iovec.iov_len = msg->len;
+	ret = xs_request_reply(msg, &iovec, 1);
+	msg->req_id = req_id;
+	if (IS_ERR(ret)) {
 		msg->type = XS_ERROR;
-		ret = ERR_PTR(err);
-	} else
-		ret = read_reply(&msg->type, &msg->len);
-
-	mutex_unlock(&xs_state.request_mutex);
-	
-	if (IS_ERR(ret))
 		return ret;
+	}
 
 	if ((type == XS_TRANSACTION_END) ||
 	    ((type == XS_TRANSACTION_START) && (msg->type == XS_ERROR)))
@@ -302,34 +370,16 @@ static void *xs_talkv(struct xenbus_transaction t,
 	int err;
 
 	msg.tx_id = t.id;
-	msg.req_id = 0;
 	msg.type = type;
 	msg.len = 0;
 	for (i = 0; i < num_vecs; i++)
 		msg.len += iovec[i].iov_len;
 
-	mutex_lock(&xs_state.request_mutex);
-
-	err = xb_write(&msg, sizeof(msg));
-	if (err) {
-		mutex_unlock(&xs_state.request_mutex);
-		return ERR_PTR(err);
-	}
-
-	for (i = 0; i < num_vecs; i++) {
-		err = xb_write(iovec[i].iov_base, iovec[i].iov_len);
-		if (err) {
-			mutex_unlock(&xs_state.request_mutex);
-			return ERR_PTR(err);
-		}
-	}
-
-	ret = read_reply(&msg.type, len);
-
-	mutex_unlock(&xs_state.request_mutex);
-
+	ret = xs_request_reply(&msg, iovec, num_vecs);
 	if (IS_ERR(ret))
 		return ret;
+	if (len)
+		*len = msg.len;
 
 	if (msg.type == XS_ERROR) {
 		err = get_error(ret);
@@ -812,6 +862,8 @@ void xs_suspend(void)
 	transaction_suspend();
 	down_write(&xs_state.watch_mutex);
 	mutex_lock(&xs_state.request_mutex);
+	/* No new requests can go out; let those in flight complete. */
+	wait_event(xs_state.reply_waitq, list_empty(&xs_state.reply_list));
 	mutex_lock(&xs_state.response_mutex);
 }
 
@@ -1009,11 +1061,30 @@ static int process_msg(void)
 		}
 		spin_unlock(&watches_lock);
 	} else {
+		struct xs_pending_req *req;
+
 		msg->u.reply.body = body;
 		spin_lock(&xs_state.reply_lock);
-		list_add_tail(&msg->list, &xs_state.reply_list);
+		list_for_each_entry(req, &xs_state.reply_list, list) {
+			if (req->req_id != msg->hdr.req_id)
+				continue;
+			list_del(&req->list);
+			req->reply = msg;
+			wake_up(&req->wq);
+			msg = NULL;
+			break;
+		}
+		if (list_empty(&xs_state.reply_list))
+			wake_up(&xs_state.reply_waitq);
 		spin_unlock(&xs_state.reply_lock);
-		wake_up(&xs_state.reply_waitq);
+
+		/* Its requester gave up waiting (or it was never ours). */
+		if (msg) {
+			pr_warn_ratelimited("dropping reply to request %u\n",
+					    msg->hdr.req_id);
+			kfree(body);
+			kfree(msg);
+		}
 	}
 
  out:
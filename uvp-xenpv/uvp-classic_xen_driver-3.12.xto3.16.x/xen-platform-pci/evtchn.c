@@ -31,7 +31,17 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/spinlock.h>
+#include <linux/smp.h>
+#include <linux/cpumask.h>
+#include <linux/cpu.h>
+#include <linux/notifier.h>
+#include <linux/llist.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <xen/evtchn.h>
+#include <xen/xen_proc.h>
 #include <xen/interface/hvm/ioreq.h>
 #include <xen/features.h>
 #include "platform-pci.h"
@@ -42,76 +52,332 @@
 
 void *shared_info_area;
 
+static int fifo_events = 1;
+module_param(fifo_events, int, 0444);
+MODULE_PARM_DESC(fifo_events, "Use the FIFO event channel ABI when Xen offers it (default 1)");
+
 #define is_valid_evtchn(x)	((x) != 0)
-#define evtchn_from_irq(x)	(irq_evtchn[irq].evtchn)
+#define evtchn_from_irq(x)	(irq_info(x)->evtchn)
 
-static struct {
+struct irq_evtchn {
 	spinlock_t lock;
 	irq_handler_t handler;
 	void *dev_id;
+	const char *devname;
+	int irq;
 	int evtchn;
+	int cpu;     /* CPU to run the handler on, -1 for whichever takes the upcall */
+	unsigned int priority; /* EVTCHN_FIFO_PRIORITY_*, used under the FIFO ABI */
+	struct llist_node queue_node;
 	int close:1; /* close on unbind_from_irqhandler()? */
 	int inuse:1;
 	int in_handler:1;
-} irq_evtchn[256];
-static int evtchn_to_irq[NR_EVENT_CHANNELS] = {
-	[0 ...  NR_EVENT_CHANNELS-1] = -1 };
+	int queued:1; /* handed to irq_info()->cpu, not yet run there */
+};
+
+/*
+ * The IRQ table grows a chunk at a time, up to one IRQ per port the FIFO
+ * ABI can address.  Chunks are never freed, so the upcall can look an
+ * entry up without taking irq_alloc_lock.
+ */
+#define IRQS_PER_CHUNK	256
+#define NR_XEN_IRQS	EVTCHN_FIFO_NR_CHANNELS
+static struct irq_evtchn *irq_evtchn_chunks[NR_XEN_IRQS / IRQS_PER_CHUNK];
+static unsigned int nr_irq_chunks;
+
+static inline struct irq_evtchn *irq_info(int irq)
+{
+	return &irq_evtchn_chunks[irq / IRQS_PER_CHUNK][irq % IRQS_PER_CHUNK];
+}
+
+static inline int nr_xen_irqs(void)
+{
+	return ACCESS_ONCE(nr_irq_chunks) * IRQS_PER_CHUNK;
+}
+
+/* Port to IRQ map, one page-sized row at a time as ports get bound. */
+#define EVTCHN_ROW_SIZE	(PAGE_SIZE / sizeof(int))
+#define NR_EVTCHN_ROWS	DIV_ROUND_UP(EVTCHN_FIFO_NR_CHANNELS, EVTCHN_ROW_SIZE)
+static int *evtchn_to_irq[NR_EVTCHN_ROWS];
 
 static DEFINE_SPINLOCK(irq_alloc_lock);
+/* Serialises evtchn_to_irq[] row allocation and event array growth. */
+static DEFINE_SPINLOCK(evtchn_setup_lock);
+
+static inline int get_evtchn_to_irq(unsigned int port)
+{
+	int *row;
+
+	if (port >= EVTCHN_FIFO_NR_CHANNELS)
+		return -1;
+	row = ACCESS_ONCE(evtchn_to_irq[port / EVTCHN_ROW_SIZE]);
+	return row ? row[port % EVTCHN_ROW_SIZE] : -1;
+}
+
+static inline void set_evtchn_to_irq(unsigned int port, int irq)
+{
+	/* evtchn_port_setup() has allocated the row. */
+	evtchn_to_irq[port / EVTCHN_ROW_SIZE][port % EVTCHN_ROW_SIZE] = irq;
+}
+
+/*
+ * FIFO ABI state.  Every vCPU gets a control block, as the ABI requires,
+ * but ports stay bound to vcpu0 (see below), so only vcpu0's queues are
+ * ever consumed.
+ */
+#define EVENT_WORDS_PER_PAGE	(PAGE_SIZE / sizeof(event_word_t))
+#define MAX_EVENT_ARRAY_PAGES	(EVTCHN_FIFO_NR_CHANNELS / EVENT_WORDS_PER_PAGE)
+#define BM(w)			((unsigned long *)(w))
+
+struct evtchn_fifo_queue {
+	uint32_t head[EVTCHN_FIFO_MAX_QUEUES];
+};
+
+static int evtchn_fifo;
+static event_word_t *event_array[MAX_EVENT_ARRAY_PAGES];
+static unsigned int event_array_pages;
+static DEFINE_PER_CPU(struct evtchn_fifo_control_block *, cpu_control_block);
+static DEFINE_PER_CPU(struct evtchn_fifo_queue, cpu_queue);
+
+static inline unsigned int evtchn_nr_channels(void)
+{
+	return evtchn_fifo ? event_array_pages * EVENT_WORDS_PER_PAGE
+			   : NR_EVENT_CHANNELS;
+}
+
+static inline event_word_t *event_word_from_port(unsigned int port)
+{
+	return event_array[port / EVENT_WORDS_PER_PAGE] +
+	       port % EVENT_WORDS_PER_PAGE;
+}
+
+/*
+ * All ports are bound to vcpu0 and arrive through the single platform-PCI
+ * interrupt, which Xen only raises on behalf of vcpu0.  Handlers of IRQs
+ * with an affinity set are forwarded to their CPU with an IPI, batched
+ * per upcall through this per-CPU list.  EVTCHN_CPU_QUEUE_KICKED is set
+ * from sending the IPI until its callback has returned, so the csd is
+ * never reused while still locked.
+ */
+struct evtchn_cpu_queue {
+	struct llist_head list;
+	unsigned long flags;
+	struct call_single_data csd;
+};
+#define EVTCHN_CPU_QUEUE_KICKED	0
+static DEFINE_PER_CPU(struct evtchn_cpu_queue, evtchn_cpu_queue);
+
+static struct irq_evtchn *alloc_irq_chunk(void)
+{
+	struct irq_evtchn *chunk;
+	int i;
+
+	chunk = kcalloc(IRQS_PER_CHUNK, sizeof(*chunk), GFP_KERNEL);
+	if (!chunk)
+		return NULL;
+	for (i = 0; i < IRQS_PER_CHUNK; i++) {
+		spin_lock_init(&chunk[i].lock);
+		chunk[i].cpu = -1;
+	}
+	return chunk;
+}
 
 static int alloc_xen_irq(void)
 {
 	static int warned;
-	int irq;
+	struct irq_evtchn *chunk = NULL;
+	int irq, i, nr_irqs;
 
+ again:
 	spin_lock(&irq_alloc_lock);
 
-	for (irq = 1; irq < ARRAY_SIZE(irq_evtchn); irq++) {
-		if (irq_evtchn[irq].inuse) 
-			continue;
-		irq_evtchn[irq].inuse = 1;
-		spin_unlock(&irq_alloc_lock);
-		return irq;
+	nr_irqs = nr_irq_chunks * IRQS_PER_CHUNK;
+	for (irq = 1; irq < nr_irqs; irq++) {
+		if (!irq_info(irq)->inuse)
+			goto found;
+	}
+
+	if (nr_irq_chunks < ARRAY_SIZE(irq_evtchn_chunks)) {
+		if (!chunk) {
+			spin_unlock(&irq_alloc_lock);
+			chunk = alloc_irq_chunk();
+			if (!chunk)
+				return -ENOMEM;
+			goto again;
+		}
+		for (i = 0; i < IRQS_PER_CHUNK; i++)
+			chunk[i].irq = nr_irqs + i;
+		smp_wmb();
+		irq_evtchn_chunks[nr_irq_chunks] = chunk;
+		smp_wmb();
+		nr_irq_chunks++;
+		chunk = NULL;
+		/* IRQ 0 is never handed out. */
+		irq = nr_irqs ? nr_irqs : 1;
+		goto found;
 	}
 
 	if (!warned) {
 		warned = 1;
 		printk(KERN_WARNING "No available IRQ to bind to: "
-		       "increase irq_evtchn[] size in evtchn.c.\n");
+		       "all %d Xen IRQs are in use.\n", NR_XEN_IRQS - 1);
 	}
 
 	spin_unlock(&irq_alloc_lock);
 
 	return -ENOSPC;
+
+ found:
+	irq_info(irq)->inuse = 1;
+	irq_info(irq)->cpu = -1;
+	irq_info(irq)->priority = EVTCHN_FIFO_PRIORITY_DEFAULT;
+	spin_unlock(&irq_alloc_lock);
+	kfree(chunk);
+	return irq;
 }
 
 static void free_xen_irq(int irq)
 {
 	spin_lock(&irq_alloc_lock);
-	irq_evtchn[irq].inuse = 0;
+	irq_info(irq)->inuse = 0;
 	spin_unlock(&irq_alloc_lock);
 }
 
 int irq_to_evtchn_port(int irq)
 {
-	return irq_evtchn[irq].evtchn;
+	return irq_info(irq)->evtchn;
 }
 EXPORT_SYMBOL(irq_to_evtchn_port);
 
 void mask_evtchn(int port)
 {
 	shared_info_t *s = shared_info_area;
-	synch_set_bit(port, &s->evtchn_mask[0]);
+
+	/* The FIFO event array only covers the ports expanded so far. */
+	if (unlikely((unsigned int)port >= evtchn_nr_channels()))
+		return;
+
+	if (evtchn_fifo)
+		synch_set_bit(EVTCHN_FIFO_MASKED, BM(event_word_from_port(port)));
+	else
+		synch_set_bit(port, &s->evtchn_mask[0]);
 }
 EXPORT_SYMBOL(mask_evtchn);
 
 void unmask_evtchn(int port)
 {
 	evtchn_unmask_t op = { .port = port };
+
+	if (unlikely((unsigned int)port >= evtchn_nr_channels()))
+		return;
+
+	if (evtchn_fifo) {
+		event_word_t *word = event_word_from_port(port);
+
+		/* Xen only needs to hear about it if an event got latched. */
+		synch_clear_bit(EVTCHN_FIFO_MASKED, BM(word));
+		if (!synch_test_bit(EVTCHN_FIFO_PENDING, BM(word)))
+			return;
+	}
 	VOID(HYPERVISOR_event_channel_op(EVTCHNOP_unmask, &op));
 }
 EXPORT_SYMBOL(unmask_evtchn);
 
+static void clear_evtchn(unsigned int port)
+{
+	shared_info_t *s = shared_info_area;
+
+	if (evtchn_fifo)
+		synch_clear_bit(EVTCHN_FIFO_PENDING, BM(event_word_from_port(port)));
+	else
+		synch_clear_bit(port, &s->evtchn_pending[0]);
+}
+
+/* Caller holds evtchn_setup_lock. */
+static int evtchn_fifo_expand_array(gfp_t gfp)
+{
+	struct evtchn_expand_array expand;
+	event_word_t *array_page;
+	unsigned int i;
+	int err;
+
+	if (event_array_pages >= MAX_EVENT_ARRAY_PAGES)
+		return -ENOSPC;
+
+	/* Pages stay around across save/restore and are handed back to Xen. */
+	array_page = event_array[event_array_pages];
+	if (!array_page) {
+		array_page = (event_word_t *)__get_free_page(gfp);
+		if (!array_page)
+			return -ENOMEM;
+		event_array[event_array_pages] = array_page;
+	}
+
+	for (i = 0; i < EVENT_WORDS_PER_PAGE; i++)
+		array_page[i] = 1 << EVTCHN_FIFO_MASKED;
+
+	expand.array_gfn = virt_to_mfn(array_page);
+	err = HYPERVISOR_event_channel_op(EVTCHNOP_expand_array, &expand);
+	if (err)
+		return err;
+
+	smp_wmb();
+	event_array_pages++;
+	return 0;
+}
+
+/*
+ * Make @port usable before it gets bound: allocate its evtchn_to_irq[]
+ * row and, under the FIFO ABI, grow the event array to cover it.
+ */
+static int evtchn_port_setup(unsigned int port)
+{
+	unsigned int row = port / EVTCHN_ROW_SIZE;
+	unsigned long flags;
+	int *map, i, err = 0;
+
+	if (port >= (evtchn_fifo ? EVTCHN_FIFO_NR_CHANNELS : NR_EVENT_CHANNELS))
+		return -EINVAL;
+
+	spin_lock_irqsave(&evtchn_setup_lock, flags);
+
+	if (!evtchn_to_irq[row]) {
+		map = (int *)__get_free_page(GFP_ATOMIC);
+		if (!map) {
+			err = -ENOMEM;
+			goto out;
+		}
+		for (i = 0; i < EVTCHN_ROW_SIZE; i++)
+			map[i] = -1;
+		smp_wmb();
+		evtchn_to_irq[row] = map;
+	}
+
+	while (evtchn_fifo && port >= evtchn_nr_channels()) {
+		err = evtchn_fifo_expand_array(GFP_ATOMIC);
+		if (err)
+			break;
+	}
+
+ out:
+	spin_unlock_irqrestore(&evtchn_setup_lock, flags);
+	return err;
+}
+
+/* Caller holds irq_info(irq)->lock. */
+static int evtchn_apply_priority(int irq)
+{
+	struct evtchn_set_priority set_priority;
+
+	if (!evtchn_fifo || !is_valid_evtchn(evtchn_from_irq(irq)))
+		return 0;
+
+	set_priority.port     = evtchn_from_irq(irq);
+	set_priority.priority = irq_info(irq)->priority;
+	return HYPERVISOR_event_channel_op(EVTCHNOP_set_priority,
+					   &set_priority);
+}
+
 int bind_listening_port_to_irqhandler(
 	unsigned int remote_domain,
 	irq_handler_t handler,
@@ -126,28 +392,39 @@ int bind_listening_port_to_irqhandler(
 	if (irq < 0)
 		return irq;
 
-	spin_lock_irq(&irq_evtchn[irq].lock);
+	spin_lock_irq(&irq_info(irq)->lock);
 
 	alloc_unbound.dom        = DOMID_SELF;
 	alloc_unbound.remote_dom = remote_domain;
 	err = HYPERVISOR_event_channel_op(EVTCHNOP_alloc_unbound,
 					  &alloc_unbound);
 	if (err) {
-		spin_unlock_irq(&irq_evtchn[irq].lock);
+		spin_unlock_irq(&irq_info(irq)->lock);
+		free_xen_irq(irq);
+		return err;
+	}
+
+	err = evtchn_port_setup(alloc_unbound.port);
+	if (err) {
+		struct evtchn_close close = { .port = alloc_unbound.port };
+
+		VOID(HYPERVISOR_event_channel_op(EVTCHNOP_close, &close));
+		spin_unlock_irq(&irq_info(irq)->lock);
 		free_xen_irq(irq);
 		return err;
 	}
 
-	irq_evtchn[irq].handler = handler;
-	irq_evtchn[irq].dev_id  = dev_id;
-	irq_evtchn[irq].evtchn  = alloc_unbound.port;
-	irq_evtchn[irq].close   = 1;
+	irq_info(irq)->handler = handler;
+	irq_info(irq)->dev_id  = dev_id;
+	irq_info(irq)->devname = devname;
+	irq_info(irq)->evtchn  = alloc_unbound.port;
+	irq_info(irq)->close   = 1;
 
-	evtchn_to_irq[alloc_unbound.port] = irq;
+	set_evtchn_to_irq(alloc_unbound.port, irq);
 
 	unmask_evtchn(alloc_unbound.port);
 
-	spin_unlock_irq(&irq_evtchn[irq].lock);
+	spin_unlock_irq(&irq_info(irq)->lock);
 
 	return irq;
 }
@@ -160,24 +437,32 @@ int bind_caller_port_to_irqhandler(
 	const char *devname,
 	void *dev_id)
 {
-	int irq;
+	int err, irq;
 
 	irq = alloc_xen_irq();
 	if (irq < 0)
 		return irq;
 
-	spin_lock_irq(&irq_evtchn[irq].lock);
+	spin_lock_irq(&irq_info(irq)->lock);
 
-	irq_evtchn[irq].handler = handler;
-	irq_evtchn[irq].dev_id  = dev_id;
-	irq_evtchn[irq].evtchn  = caller_port;
-	irq_evtchn[irq].close   = 0;
+	err = evtchn_port_setup(caller_port);
+	if (err) {
+		spin_unlock_irq(&irq_info(irq)->lock);
+		free_xen_irq(irq);
+		return err;
+	}
+
+	irq_info(irq)->handler = handler;
+	irq_info(irq)->dev_id  = dev_id;
+	irq_info(irq)->devname = devname;
+	irq_info(irq)->evtchn  = caller_port;
+	irq_info(irq)->close   = 0;
 
-	evtchn_to_irq[caller_port] = irq;
+	set_evtchn_to_irq(caller_port, irq);
 
 	unmask_evtchn(caller_port);
 
-	spin_unlock_irq(&irq_evtchn[irq].lock);
+	spin_unlock_irq(&irq_info(irq)->lock);
 
 	return irq;
 }
@@ -187,32 +472,82 @@ void unbind_from_irqhandler(unsigned int irq, void *dev_id)
 {
 	int evtchn;
 
-	spin_lock_irq(&irq_evtchn[irq].lock);
+	spin_lock_irq(&irq_info(irq)->lock);
 
 	evtchn = evtchn_from_irq(irq);
 
 	if (is_valid_evtchn(evtchn)) {
-		evtchn_to_irq[evtchn] = -1;
+		set_evtchn_to_irq(evtchn, -1);
 		mask_evtchn(evtchn);
-		if (irq_evtchn[irq].close) {
+		if (irq_info(irq)->close) {
 			struct evtchn_close close = { .port = evtchn };
 			if (HYPERVISOR_event_channel_op(EVTCHNOP_close, &close))
 				BUG();
 		}
 	}
 
-	irq_evtchn[irq].handler = NULL;
-	irq_evtchn[irq].evtchn  = 0;
+	irq_info(irq)->handler = NULL;
+	irq_info(irq)->devname = NULL;
+	irq_info(irq)->evtchn  = 0;
 
-	spin_unlock_irq(&irq_evtchn[irq].lock);
+	spin_unlock_irq(&irq_info(irq)->lock);
 
-	while (irq_evtchn[irq].in_handler)
+	while (irq_info(irq)->in_handler)
 		cpu_relax();
 
 	free_xen_irq(irq);
 }
 EXPORT_SYMBOL(unbind_from_irqhandler);
 
+/*
+ * Run the handler of @irq on @cpu from now on; a negative @cpu runs it on
+ * whichever CPU takes the platform interrupt, as before.
+ */
+int rebind_irq_to_cpu(int irq, int cpu)
+{
+	if (irq <= 0 || irq >= nr_xen_irqs())
+		return -EINVAL;
+	if (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_online(cpu)))
+		return -EINVAL;
+
+	spin_lock_irq(&irq_info(irq)->lock);
+	if (!irq_info(irq)->inuse) {
+		spin_unlock_irq(&irq_info(irq)->lock);
+		return -ENOENT;
+	}
+	irq_info(irq)->cpu = cpu < 0 ? -1 : cpu;
+	spin_unlock_irq(&irq_info(irq)->lock);
+
+	return 0;
+}
+EXPORT_SYMBOL(rebind_irq_to_cpu);
+
+/*
+ * Put the port behind @irq on FIFO queue @priority (EVTCHN_FIFO_PRIORITY_MAX
+ * is serviced first).  With the 2-level ABI it is only recorded.
+ */
+int set_irq_evtchn_priority(int irq, unsigned int priority)
+{
+	int err;
+
+	if (irq <= 0 || irq >= nr_xen_irqs())
+		return -EINVAL;
+	if (priority > EVTCHN_FIFO_PRIORITY_MIN)
+		return -EINVAL;
+
+	spin_lock_irq(&irq_info(irq)->lock);
+	if (!irq_info(irq)->inuse) {
+		spin_unlock_irq(&irq_info(irq)->lock);
+		return -ENOENT;
+	}
+	irq_info(irq)->priority = priority;
+	err = evtchn_apply_priority(irq);
+	spin_unlock_irq(&irq_info(irq)->lock);
+
+	return err;
+}
+EXPORT_SYMBOL(set_irq_evtchn_priority);
+
 void notify_remote_via_irq(int irq)
 {
 	int evtchn;
@@ -232,19 +567,167 @@ static inline unsigned long active_evtchns(unsigned int cpu, shared_info_t *sh,
 	return (sh->evtchn_pending[idx] & ~sh->evtchn_mask[idx]);
 }
 
-static irqreturn_t evtchn_interrupt(int irq, void *dev_id
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,19)
-				    , struct pt_regs *regs
+# define run_handler(handler, irq, dev_id, regs) handler(irq, dev_id, regs)
 #else
-# define handler(irq, dev_id, regs) handler(irq, dev_id)
+# define run_handler(handler, irq, dev_id, regs) handler(irq, dev_id)
 #endif
-				    )
+
+/* Call the handlers queued on @q.  Interrupts are disabled. */
+static void evtchn_cpu_queue_flush(struct evtchn_cpu_queue *q)
+{
+	struct llist_node *node;
+	struct irq_evtchn *info;
+	irq_handler_t handler;
+	void *dev_id;
+
+	/* Anything queued after this point comes with a fresh IPI. */
+	node = llist_del_all(&q->list);
+	while (node) {
+		info = llist_entry(node, struct irq_evtchn, queue_node);
+		/* Read ahead: the entry may be requeued once queued is clear. */
+		node = node->next;
+
+		spin_lock(&info->lock);
+		info->queued = 0;
+		handler = info->handler;
+		dev_id  = info->dev_id;
+		if (unlikely(handler == NULL)) {
+			info->in_handler = 0;
+			spin_unlock(&info->lock);
+			continue;
+		}
+		spin_unlock(&info->lock);
+
+		local_irq_enable();
+		run_handler(handler, info->irq, dev_id, NULL);
+		local_irq_disable();
+
+		spin_lock(&info->lock);
+		if (!info->queued)
+			info->in_handler = 0;
+		spin_unlock(&info->lock);
+	}
+}
+
+/* Runs on the target CPU: call the handlers queued for it. */
+static void evtchn_cpu_queue_run(void *data)
+{
+	struct evtchn_cpu_queue *q = data;
+
+	do {
+		evtchn_cpu_queue_flush(q);
+		clear_bit(EVTCHN_CPU_QUEUE_KICKED, &q->flags);
+		smp_mb__after_clear_bit();
+		/* Entries added while we ran were not kicked: take them too. */
+	} while (!llist_empty(&q->list) &&
+		 !test_and_set_bit(EVTCHN_CPU_QUEUE_KICKED, &q->flags));
+}
+
+static void evtchn_cpu_queue_kick(int cpu)
+{
+	struct evtchn_cpu_queue *q = &per_cpu(evtchn_cpu_queue, cpu);
+
+	/* Still pending, or running: that pass picks up the new entries. */
+	if (test_and_set_bit(EVTCHN_CPU_QUEUE_KICKED, &q->flags))
+		return;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,15,0)
+	__smp_call_function_single(cpu, &q->csd, 0);
+#else
+	smp_call_function_single_async(cpu, &q->csd);
+#endif
+}
+
+/*
+ * A CPU going offline may leave handlers queued for it, with in_handler
+ * set so that unbind_from_irqhandler() would wait forever: run them here
+ * instead.  No new ones are queued, evtchn_handle_port() checks
+ * cpu_online().  Before 3.16 a kick in flight is not flushed on the way
+ * down and runs at the CPU's next IPI, so one is raised when it returns.
+ */
+static int evtchn_cpu_notify(struct notifier_block *nfb,
+			     unsigned long action, void *hcpu)
+{
+	int cpu = (long)hcpu;
+	struct evtchn_cpu_queue *q = &per_cpu(evtchn_cpu_queue, cpu);
+
+	switch (action & ~CPU_TASKS_FROZEN) {
+	case CPU_DEAD:
+		local_irq_disable();
+		evtchn_cpu_queue_flush(q);
+		local_irq_enable();
+		break;
+	case CPU_ONLINE:
+		if (test_bit(EVTCHN_CPU_QUEUE_KICKED, &q->flags))
+			smp_call_function_single(cpu, evtchn_cpu_queue_run,
+						 q, 0);
+		break;
+	}
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block evtchn_cpu_notifier = {
+	.notifier_call = evtchn_cpu_notify,
+};
+
+/*
+ * Run the handler bound to @port, or queue it for its target CPU and
+ * note that CPU in @kick.  The port's pending bit is already clear.
+ */
+static void evtchn_handle_port(unsigned int port, int this_cpu,
+			       cpumask_t *kick)
+{
+	struct irq_evtchn *info;
+	irq_handler_t handler;
+	void *dev_id;
+	int irq, target;
+
+	irq = get_evtchn_to_irq(port);
+	if (irq < 0)
+		return;
+	info = irq_info(irq);
+
+	spin_lock(&info->lock);
+	handler = info->handler;
+	dev_id  = info->dev_id;
+	if (unlikely(handler == NULL)) {
+		printk("Xen IRQ%d (port %d) has no handler!\n", irq, port);
+		spin_unlock(&info->lock);
+		return;
+	}
+	info->in_handler = 1;
+	target = info->cpu;
+	if (target >= 0 && target != this_cpu && cpu_online(target)) {
+		/* Forward to the CPU this irq is bound to. */
+		if (!info->queued) {
+			info->queued = 1;
+			/* Only the first entry on an idle list needs an IPI. */
+			if (llist_add(&info->queue_node,
+				      &per_cpu(evtchn_cpu_queue, target).list))
+				cpumask_set_cpu(target, kick);
+		}
+		spin_unlock(&info->lock);
+		return;
+	}
+	spin_unlock(&info->lock);
+
+	local_irq_enable();
+	run_handler(handler, irq, dev_id, NULL);
+	local_irq_disable();
+
+	spin_lock(&info->lock);
+	if (!info->queued)
+		info->in_handler = 0;
+	spin_unlock(&info->lock);
+}
+
+static void evtchn_2l_handle_events(unsigned int cpu, int this_cpu,
+				    cpumask_t *kick)
 {
 	unsigned int l1i, l2i, port;
 	unsigned long masked_l1, masked_l2;
-	/* XXX: All events are bound to vcpu0 but irq may be redirected. */
-	int cpu = 0; /*smp_processor_id();*/
-	irq_handler_t handler;
 	shared_info_t *s = shared_info_area;
 	vcpu_info_t *v = &s->vcpu_info[cpu];
 	unsigned long l1, l2;
@@ -286,31 +769,9 @@ static irqreturn_t evtchn_interrupt(int irq, void *dev_id
 
 			/* process port */
 			port = (l1i * BITS_PER_LONG) + l2i;
-			synch_clear_bit(port, &s->evtchn_pending[0]);
-
-			irq = evtchn_to_irq[port];
-			if (irq < 0)
-				continue;
-
-			spin_lock(&irq_evtchn[irq].lock);
-			handler = irq_evtchn[irq].handler;
-			dev_id  = irq_evtchn[irq].dev_id;
-			if (unlikely(handler == NULL)) {
-				printk("Xen IRQ%d (port %d) has no handler!\n",
-				       irq, port);
-				spin_unlock(&irq_evtchn[irq].lock);
-				continue;
-			}
-			irq_evtchn[irq].in_handler = 1;
-			spin_unlock(&irq_evtchn[irq].lock);
-
-			local_irq_enable();
-			handler(irq, irq_evtchn[irq].dev_id, regs);
-			local_irq_disable();
+			clear_evtchn(port);
 
-			spin_lock(&irq_evtchn[irq].lock);
-			irq_evtchn[irq].in_handler = 0;
-			spin_unlock(&irq_evtchn[irq].lock);
+			evtchn_handle_port(port, this_cpu, kick);
 
 			/* if this is the final port processed, we'll pick up here+1 next time */
 			per_cpu(last_processed_l1i, cpu) = l1i;
@@ -322,29 +783,321 @@ static irqreturn_t evtchn_interrupt(int irq, void *dev_id
 		if (l2 == 0) /* we handled all ports, so we can clear the selector bit */
 			l1 &= ~(1UL << l1i);
 	}
+}
+
+/*
+ * Clear LINKED and LINK together, returning the old link: reading the
+ * link and clearing LINKED separately would let Xen relink the event in
+ * between.
+ */
+static uint32_t evtchn_fifo_clear_linked(volatile event_word_t *word)
+{
+	event_word_t new, old, w;
+
+	w = *word;
+	do {
+		old = w;
+		new = w & ~((1 << EVTCHN_FIFO_LINKED) | EVTCHN_FIFO_LINK_MASK);
+	} while ((w = sync_cmpxchg(word, old, new)) != old);
+
+	return w & EVTCHN_FIFO_LINK_MASK;
+}
+
+/*
+ * Take the head event off FIFO queue @priority of @cpu and handle it.
+ * Clears @priority in *@ready once the queue has been drained.
+ */
+static void evtchn_fifo_consume_one(unsigned int cpu, unsigned int priority,
+				    unsigned long *ready, int this_cpu,
+				    cpumask_t *kick)
+{
+	struct evtchn_fifo_control_block *control_block;
+	struct evtchn_fifo_queue *q = &per_cpu(cpu_queue, cpu);
+	event_word_t *word;
+	uint32_t head;
+	unsigned int port;
+
+	head = q->head[priority];
+
+	/*
+	 * Reached the tail last time?  Re-read the head from the control
+	 * block, ordered before reading the event word below.
+	 */
+	if (head == 0) {
+		control_block = per_cpu(cpu_control_block, cpu);
+		rmb();
+		head = control_block->head[priority];
+	}
+
+	port = head;
+	word = event_word_from_port(port);
+	head = evtchn_fifo_clear_linked(word);
+
+	if (head == 0)
+		clear_bit(priority, ready);
+
+	if (synch_test_bit(EVTCHN_FIFO_PENDING, BM(word)) &&
+	    !synch_test_bit(EVTCHN_FIFO_MASKED, BM(word))) {
+		clear_evtchn(port);
+		evtchn_handle_port(port, this_cpu, kick);
+	}
+
+	q->head[priority] = head;
+}
+
+static void evtchn_fifo_handle_events(unsigned int cpu, int this_cpu,
+				      cpumask_t *kick)
+{
+	struct evtchn_fifo_control_block *control_block;
+	shared_info_t *s = shared_info_area;
+	unsigned long ready;
+	unsigned int q;
+
+	s->vcpu_info[cpu].evtchn_upcall_pending = 0;
+
+	control_block = per_cpu(cpu_control_block, cpu);
+	ready = xchg(&control_block->ready, 0);
+
+	/* Lowest queue number first: that is the highest priority. */
+	while (ready) {
+		q = __ffs(ready);
+		evtchn_fifo_consume_one(cpu, q, &ready, this_cpu, kick);
+		ready |= xchg(&control_block->ready, 0);
+	}
+}
+
+static irqreturn_t evtchn_interrupt(int irq, void *dev_id
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,19)
+				    , struct pt_regs *regs
+#endif
+				    )
+{
+	/* Only one instance of this handler runs at a time. */
+	static cpumask_t kick;
+	int target;
+
+	cpumask_clear(&kick);
+
+	/*
+	 * All events are bound to vcpu0, so its vcpu_info and queues are the
+	 * ones to scan, while the platform irq itself may be taken on any CPU.
+	 */
+	if (evtchn_fifo)
+		evtchn_fifo_handle_events(0, smp_processor_id(), &kick);
+	else
+		evtchn_2l_handle_events(0, smp_processor_id(), &kick);
+
+	for_each_cpu(target, &kick)
+		evtchn_cpu_queue_kick(target);
 
 	return IRQ_HANDLED;
 }
 
+static int evtchn_fifo_init_control(unsigned int cpu)
+{
+	struct evtchn_fifo_control_block *control_block;
+	struct evtchn_init_control init_control;
+
+	control_block = per_cpu(cpu_control_block, cpu);
+	if (!control_block) {
+		control_block = (void *)get_zeroed_page(GFP_KERNEL);
+		if (!control_block)
+			return -ENOMEM;
+		per_cpu(cpu_control_block, cpu) = control_block;
+	} else
+		memset(control_block, 0, PAGE_SIZE);
+	memset(&per_cpu(cpu_queue, cpu), 0, sizeof(struct evtchn_fifo_queue));
+
+	init_control.control_gfn = virt_to_mfn(control_block);
+	init_control.offset      = 0;
+	init_control.vcpu        = cpu;
+
+	return HYPERVISOR_event_channel_op(EVTCHNOP_init_control,
+					   &init_control);
+}
+
+static void evtchn_fifo_free_control(unsigned int cpu)
+{
+	free_page((unsigned long)per_cpu(cpu_control_block, cpu));
+	per_cpu(cpu_control_block, cpu) = NULL;
+}
+
+/*
+ * Switch to the FIFO ABI.  Xen moves the domain over as soon as vcpu0's
+ * control block is registered; the other vCPUs only need one so that
+ * Xen accepts the ABI for them.
+ */
+static int evtchn_fifo_init(void)
+{
+	unsigned int cpu;
+	int err;
+
+	err = evtchn_fifo_init_control(0);
+	if (err) {
+		evtchn_fifo_free_control(0);
+		return err;
+	}
+	evtchn_fifo = 1;
+
+	for_each_possible_cpu(cpu) {
+		if (cpu == 0)
+			continue;
+		if (evtchn_fifo_init_control(cpu))
+			evtchn_fifo_free_control(cpu);
+	}
+
+	return 0;
+}
+
+/* The new domain starts out 2-level: hand Xen our pages again. */
+static int evtchn_fifo_resume(void)
+{
+	unsigned int cpu, pages = event_array_pages;
+	unsigned long flags;
+	int err;
+
+	for_each_possible_cpu(cpu) {
+		if (!per_cpu(cpu_control_block, cpu))
+			continue;
+		err = evtchn_fifo_init_control(cpu);
+		if (err && cpu == 0)
+			return err;
+	}
+
+	spin_lock_irqsave(&evtchn_setup_lock, flags);
+	event_array_pages = 0;
+	err = 0;
+	while (!err && event_array_pages < pages)
+		err = evtchn_fifo_expand_array(GFP_ATOMIC);
+	spin_unlock_irqrestore(&evtchn_setup_lock, flags);
+
+	/* Still FIFO; ports past the array just fail to bind again. */
+	if (err)
+		printk(KERN_WARNING "xen: restoring FIFO event array failed "
+		       "(%d), %u of %u pages.\n", err, event_array_pages, pages);
+
+	return 0;
+}
+
+#ifdef CONFIG_PROC_FS
+static ssize_t evtchn_affinity_write(struct file *file,
+				     const char __user *buffer,
+				     size_t count, loff_t *ppos)
+{
+	char buf[32];
+	int irq, cpu, prio, err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (count <= 1)
+		return -EBADMSG; /* runt */
+	if (count >= sizeof(buf))
+		return -EFBIG;   /* too long */
+
+	if (copy_from_user(buf, buffer, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	/* "<irq> <cpu> [<priority>]", cpu -1 meaning the CPU taking the upcall */
+	switch (sscanf(buf, "%d %d %d", &irq, &cpu, &prio)) {
+	case 3:
+		if (prio < 0)
+			return -EINVAL;
+		err = set_irq_evtchn_priority(irq, prio);
+		if (err)
+			return err;
+		/* fall through */
+	case 2:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	err = rebind_irq_to_cpu(irq, cpu);
+	return err ? err : count;
+}
+
+static int evtchn_affinity_show(struct seq_file *m, void *v)
+{
+	struct irq_evtchn *info;
+	int irq, nr_irqs = nr_xen_irqs();
+
+	seq_printf(m, "%4s %6s %4s %4s %s\n", "irq", "port", "cpu", "prio",
+		   "name");
+	for (irq = 1; irq < nr_irqs; irq++) {
+		info = irq_info(irq);
+		if (!info->inuse || !info->evtchn)
+			continue;
+		seq_printf(m, "%4d %6d %4d %4u %s\n", irq, info->evtchn,
+			   info->cpu, info->priority, info->devname ?: "");
+	}
+
+	return 0;
+}
+
+static int evtchn_affinity_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, evtchn_affinity_show, PDE_DATA(inode));
+}
+
+static const struct file_operations evtchn_affinity_fops = {
+	.open = evtchn_affinity_open,
+	.llseek = seq_lseek,
+	.read = seq_read,
+	.write = evtchn_affinity_write,
+	.release = single_release
+};
+#endif
+
 void irq_resume(void)
 {
-	int evtchn, irq;
+	unsigned int evtchn, row, i;
+	int irq, nr_irqs = nr_xen_irqs();
 
-	for (evtchn = 0; evtchn < NR_EVENT_CHANNELS; evtchn++) {
-		mask_evtchn(evtchn);
-		evtchn_to_irq[evtchn] = -1;
+	if (evtchn_fifo && evtchn_fifo_resume()) {
+		printk(KERN_WARNING "xen: FIFO event channels unavailable "
+		       "after restore, using 2-level.\n");
+		evtchn_fifo = 0;
+	}
+
+	/* FIFO event array pages come back fully masked. */
+	if (!evtchn_fifo)
+		for (evtchn = 0; evtchn < NR_EVENT_CHANNELS; evtchn++)
+			mask_evtchn(evtchn);
+
+	for (row = 0; row < NR_EVTCHN_ROWS; row++) {
+		if (!evtchn_to_irq[row])
+			continue;
+		for (i = 0; i < EVTCHN_ROW_SIZE; i++)
+			evtchn_to_irq[row][i] = -1;
 	}
 
-	for (irq = 0; irq < ARRAY_SIZE(irq_evtchn); irq++)
-		irq_evtchn[irq].evtchn = 0;
+	for (irq = 0; irq < nr_irqs; irq++)
+		irq_info(irq)->evtchn = 0;
 }
 
 int xen_irq_init(struct pci_dev *pdev)
 {
-	int irq;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct evtchn_cpu_queue *q = &per_cpu(evtchn_cpu_queue, cpu);
+
+		init_llist_head(&q->list);
+		q->csd.func = evtchn_cpu_queue_run;
+		q->csd.info = q;
+	}
+	register_cpu_notifier(&evtchn_cpu_notifier);
 
-	for (irq = 0; irq < ARRAY_SIZE(irq_evtchn); irq++)
-		spin_lock_init(&irq_evtchn[irq].lock);
+	if (fifo_events && !evtchn_fifo_init())
+		printk(KERN_INFO "xen: using FIFO event channel ABI\n");
+
+#ifdef CONFIG_PROC_FS
+	if (!create_xen_proc_entry("evtchn_affinity", S_IFREG|S_IRUGO|S_IWUSR,
+				   &evtchn_affinity_fops, NULL))
+		printk(KERN_WARNING "Unable to create /proc/xen/evtchn_affinity.\n");
+#endif
 
 	return request_irq(pdev->irq, evtchn_interrupt,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
@@ -357,4 +1110,4 @@ int xen_irq_init(struct pci_dev *pdev)
 			   IRQF_DISABLED,
 #endif
 			   "xen-platform-pci", pdev);
-}
\ No newline at end of file
+}
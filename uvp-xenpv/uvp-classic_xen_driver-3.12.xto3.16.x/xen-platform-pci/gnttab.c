@@ -37,6 +37,12 @@
 #include <linux/mm.h>
 #include <linux/seqlock.h>
 #include <linux/timer.h>
+#include <linux/percpu.h>
+#include <linux/cpu.h>
+#include <linux/notifier.h>
+#include <linux/workqueue.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <xen/interface/xen.h>
 #include <xen/gnttab.h>
 #include <asm/pgtable.h>
@@ -45,6 +51,7 @@
 #include <asm/io.h>
 #include <xen/interface/memory.h>
 #include <asm/gnttab_dma.h>
+#include <xen/xen_proc.h>
 
 #ifdef HAVE_XEN_PLATFORM_COMPAT_H
 #include <xen/platform-compat.h>
@@ -62,6 +69,37 @@ static int gnttab_free_count;
 static grant_ref_t gnttab_free_head;
 static DEFINE_SPINLOCK(gnttab_list_lock);
 
+/* gnttab_list_lock statistics, see /proc/xen/gnttab_stats. */
+static unsigned long gnttab_lock_acquired;
+static unsigned long gnttab_lock_contended;
+
+#define gnttab_list_lock_irqsave(flags)					\
+	do {								\
+		if (!spin_trylock_irqsave(&gnttab_list_lock, flags)) {	\
+			spin_lock_irqsave(&gnttab_list_lock, flags);	\
+			gnttab_lock_contended++;			\
+		}							\
+		gnttab_lock_acquired++;					\
+	} while (0)
+
+/*
+ * Per-CPU caches of free references, refilled from and drained to the
+ * global list GNTTAB_CACHE_BATCH entries at a time, so that grabbing
+ * and releasing a few references does not take gnttab_list_lock.  A
+ * cache is a chain like the global list and is only touched by its own
+ * CPU with IRQs off; count, not the chain end, says how long it is.
+ */
+#define GNTTAB_CACHE_BATCH 32
+#define GNTTAB_CACHE_HIGH  (2 * GNTTAB_CACHE_BATCH)
+
+struct gnttab_cache {
+	grant_ref_t head;
+	unsigned int count;
+};
+static DEFINE_PER_CPU(struct gnttab_cache, gnttab_cache) = {
+	.head = GNTTAB_LIST_END,
+};
+
 static struct grant_entry_v1 *shared;
 
 static struct gnttab_free_callback *gnttab_free_callback_list;
@@ -74,13 +112,13 @@ static int gnttab_expand(unsigned int req_entries);
 #define nr_freelist_frames(grant_frames)				\
 	(((grant_frames) * ENTRIES_PER_GRANT_FRAME + RPP - 1) / RPP)
 
-static int get_free_entries(int count)
+static int __get_free_entries(int count)
 {
 	unsigned long flags;
 	int ref, rc;
 	grant_ref_t head;
 
-	spin_lock_irqsave(&gnttab_list_lock, flags);
+	gnttab_list_lock_irqsave(flags);
 
 	if ((gnttab_free_count < count) &&
 	    ((rc = gnttab_expand(count - gnttab_free_count)) < 0)) {
@@ -100,8 +138,6 @@ static int get_free_entries(int count)
 	return ref;
 }
 
-#define get_free_entry() get_free_entries(1)
-
 static void do_free_callbacks(void)
 {
 	struct gnttab_free_callback *callback, *next;
@@ -129,17 +165,120 @@ static inline void check_free_callbacks(void)
 		do_free_callbacks();
 }
 
-static void put_free_entry(grant_ref_t ref)
+/* Move up to @count entries, and at least @min, onto @cache.  IRQs off. */
+static int gnttab_cache_refill(struct gnttab_cache *cache,
+			       unsigned int min, unsigned int count)
 {
 	unsigned long flags;
-	spin_lock_irqsave(&gnttab_list_lock, flags);
-	gnttab_entry(ref) = gnttab_free_head;
-	gnttab_free_head = ref;
-	gnttab_free_count++;
+	grant_ref_t ref;
+
+	gnttab_list_lock_irqsave(flags);
+
+	/* Leave what is there to waiters rather than hoarding it. */
+	if (gnttab_free_callback_list)
+		count = min;
+	if (gnttab_free_count < count)
+		gnttab_expand(count - gnttab_free_count);
+	if (count > gnttab_free_count)
+		count = gnttab_free_count;
+	if (count < min) {
+		spin_unlock_irqrestore(&gnttab_list_lock, flags);
+		return -ENOSPC;
+	}
+
+	gnttab_free_count -= count;
+	cache->count += count;
+	while (count--) {
+		ref = gnttab_free_head;
+		gnttab_free_head = gnttab_entry(ref);
+		gnttab_entry(ref) = cache->head;
+		cache->head = ref;
+	}
+
+	spin_unlock_irqrestore(&gnttab_list_lock, flags);
+
+	return 0;
+}
+
+/* Hand @count entries of @cache back to the global list.  IRQs off. */
+static void gnttab_cache_drain(struct gnttab_cache *cache, unsigned int count)
+{
+	unsigned long flags;
+	grant_ref_t ref;
+
+	if (!count)
+		return;
+
+	gnttab_list_lock_irqsave(flags);
+
+	cache->count -= count;
+	gnttab_free_count += count;
+	while (count--) {
+		ref = cache->head;
+		cache->head = gnttab_entry(ref);
+		gnttab_entry(ref) = gnttab_free_head;
+		gnttab_free_head = ref;
+	}
 	check_free_callbacks();
+
 	spin_unlock_irqrestore(&gnttab_list_lock, flags);
 }
 
+static int get_free_entries(int count)
+{
+	struct gnttab_cache *cache;
+	unsigned long flags;
+	grant_ref_t head;
+	int ref;
+
+	if (count > GNTTAB_CACHE_BATCH)
+		return __get_free_entries(count);
+
+	local_irq_save(flags);
+
+	cache = this_cpu_ptr(&gnttab_cache);
+	if (cache->count < count &&
+	    gnttab_cache_refill(cache, count - cache->count,
+				GNTTAB_CACHE_BATCH)) {
+		local_irq_restore(flags);
+		return -ENOSPC;
+	}
+
+	ref = head = cache->head;
+	cache->count -= count;
+	while (count-- > 1)
+		head = gnttab_entry(head);
+	cache->head = gnttab_entry(head);
+	gnttab_entry(head) = GNTTAB_LIST_END;
+
+	local_irq_restore(flags);
+
+	return ref;
+}
+
+#define get_free_entry() get_free_entries(1)
+
+static void put_free_entry(grant_ref_t ref)
+{
+	struct gnttab_cache *cache;
+	unsigned long flags;
+
+	local_irq_save(flags);
+
+	cache = this_cpu_ptr(&gnttab_cache);
+	gnttab_entry(ref) = cache->head;
+	cache->head = ref;
+	cache->count++;
+
+	/* Waiters only see the global list: give them everything we have. */
+	if (unlikely(gnttab_free_callback_list))
+		gnttab_cache_drain(cache, cache->count);
+	else if (cache->count > GNTTAB_CACHE_HIGH)
+		gnttab_cache_drain(cache, cache->count - GNTTAB_CACHE_BATCH);
+
+	local_irq_restore(flags);
+}
+
 /*
  * Public grant-issuing interface functions
  */
@@ -223,7 +362,7 @@ static void gnttab_handle_deferred(unsigned long unused)
 	struct deferred_entry *first = NULL;
 	unsigned long flags;
 
-	spin_lock_irqsave(&gnttab_list_lock, flags);
+	gnttab_list_lock_irqsave(flags);
 	while (nr--) {
 		struct deferred_entry *entry
 			= list_first_entry(&deferred_list,
@@ -252,7 +391,7 @@ static void gnttab_handle_deferred(unsigned long unused)
 			if (!first)
 				first = entry;
 		}
-		spin_lock_irqsave(&gnttab_list_lock, flags);
+		gnttab_list_lock_irqsave(flags);
 		if (entry)
 			list_add_tail(&entry->list, &deferred_list);
 		else if (list_empty(&deferred_list))
@@ -276,7 +415,7 @@ static void gnttab_add_deferred(grant_ref_t ref, struct page *page)
 		entry->ref = ref;
 		entry->page = page;
 		entry->warn_delay = 60;
-		spin_lock_irqsave(&gnttab_list_lock, flags);
+		gnttab_list_lock_irqsave(flags);
 		list_add_tail(&entry->list, &deferred_list);
 		if (!timer_pending(&deferred_timer)) {
 			deferred_timer.expires = jiffies + HZ;
@@ -393,17 +532,33 @@ EXPORT_SYMBOL_GPL(gnttab_free_grant_reference);
 
 void gnttab_free_grant_references(grant_ref_t head)
 {
+	struct gnttab_cache *cache;
 	grant_ref_t ref;
 	unsigned long flags;
 	int count = 1;
 	if (head == GNTTAB_LIST_END)
 		return;
-	spin_lock_irqsave(&gnttab_list_lock, flags);
 	ref = head;
 	while (gnttab_entry(ref) != GNTTAB_LIST_END) {
 		ref = gnttab_entry(ref);
 		count++;
 	}
+
+	local_irq_save(flags);
+	cache = this_cpu_ptr(&gnttab_cache);
+	if (count <= GNTTAB_CACHE_BATCH && likely(!gnttab_free_callback_list)) {
+		gnttab_entry(ref) = cache->head;
+		cache->head = head;
+		cache->count += count;
+		if (cache->count > GNTTAB_CACHE_HIGH)
+			gnttab_cache_drain(cache,
+					   cache->count - GNTTAB_CACHE_BATCH);
+		local_irq_restore(flags);
+		return;
+	}
+	local_irq_restore(flags);
+
+	gnttab_list_lock_irqsave(flags);
 	gnttab_entry(ref) = gnttab_free_head;
 	gnttab_free_head = head;
 	gnttab_free_count += count;
@@ -449,11 +604,48 @@ void gnttab_release_grant_reference(grant_ref_t *private_head,
 }
 EXPORT_SYMBOL_GPL(gnttab_release_grant_reference);
 
+static void gnttab_cache_flush(void *unused)
+{
+	struct gnttab_cache *cache = this_cpu_ptr(&gnttab_cache);
+
+	gnttab_cache_drain(cache, cache->count);
+}
+
+/*
+ * Callers may hold spinlocks with IRQs off, so remote caches are flushed
+ * from process context.
+ */
+static void gnttab_cache_flush_all(struct work_struct *unused)
+{
+	on_each_cpu(gnttab_cache_flush, NULL, 1);
+}
+static DECLARE_WORK(gnttab_cache_flush_work, gnttab_cache_flush_all);
+
+/* A dead CPU's cache goes back to the global list. */
+static int gnttab_cpu_notify(struct notifier_block *nfb,
+			     unsigned long action, void *hcpu)
+{
+	struct gnttab_cache *cache = per_cpu_ptr(&gnttab_cache, (long)hcpu);
+	unsigned long flags;
+
+	if ((action & ~CPU_TASKS_FROZEN) == CPU_DEAD) {
+		local_irq_save(flags);
+		gnttab_cache_drain(cache, cache->count);
+		local_irq_restore(flags);
+	}
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block gnttab_cpu_notifier = {
+	.notifier_call = gnttab_cpu_notify,
+};
+
 void gnttab_request_free_callback(struct gnttab_free_callback *callback,
 				  void (*fn)(void *), void *arg, u16 count)
 {
 	unsigned long flags;
-	spin_lock_irqsave(&gnttab_list_lock, flags);
+	gnttab_list_lock_irqsave(flags);
 	if (callback->queued)
 		goto out;
 	callback->fn = fn;
@@ -465,6 +657,18 @@ void gnttab_request_free_callback(struct gnttab_free_callback *callback,
 	check_free_callbacks();
 out:
 	spin_unlock_irqrestore(&gnttab_list_lock, flags);
+
+	/*
+	 * Flush this CPU's cache so the waiter can use what it holds.  If
+	 * that is not enough, pull in the other CPUs' too: an idle CPU never
+	 * gets to flush its own from put_free_entry().
+	 */
+	local_irq_save(flags);
+	gnttab_cache_flush(NULL);
+	local_irq_restore(flags);
+
+	if (callback->queued)
+		schedule_work(&gnttab_cache_flush_work);
 }
 EXPORT_SYMBOL_GPL(gnttab_request_free_callback);
 
@@ -473,7 +677,7 @@ void gnttab_cancel_free_callback(struct gnttab_free_callback *callback)
 	struct gnttab_free_callback **pcb;
 	unsigned long flags;
 
-	spin_lock_irqsave(&gnttab_list_lock, flags);
+	gnttab_list_lock_irqsave(flags);
 	for (pcb = &gnttab_free_callback_list; *pcb; pcb = &(*pcb)->next) {
 		if (*pcb == callback) {
 			*pcb = callback->next;
@@ -925,6 +1129,55 @@ static int gnttab_expand(unsigned int req_entries)
 	return rc;
 }
 
+#ifdef CONFIG_PROC_FS
+static ssize_t gnttab_stats_write(struct file *file, const char __user *buffer,
+				  size_t count, loff_t *ppos)
+{
+	unsigned long flags;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	/* Any write resets the lock counters. */
+	spin_lock_irqsave(&gnttab_list_lock, flags);
+	gnttab_lock_acquired = 0;
+	gnttab_lock_contended = 0;
+	spin_unlock_irqrestore(&gnttab_list_lock, flags);
+
+	return count;
+}
+
+static int gnttab_stats_show(struct seq_file *m, void *v)
+{
+	unsigned int cpu, cached = 0;
+
+	for_each_possible_cpu(cpu)
+		cached += per_cpu(gnttab_cache, cpu).count;
+
+	seq_printf(m, "lock acquired:  %lu\n"
+		      "lock contended: %lu\n"
+		      "free entries:   %d\n"
+		      "cached entries: %u\n",
+		   gnttab_lock_acquired, gnttab_lock_contended,
+		   gnttab_free_count, cached);
+
+	return 0;
+}
+
+static int gnttab_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gnttab_stats_show, PDE_DATA(inode));
+}
+
+static const struct file_operations gnttab_stats_fops = {
+	.open = gnttab_stats_open,
+	.llseek = seq_lseek,
+	.read = seq_read,
+	.write = gnttab_stats_write,
+	.release = single_release
+};
+#endif
+
 #ifdef CONFIG_XEN
 static int __init
 #else
@@ -992,6 +1245,14 @@ gnttab_init(void)
 		register_syscore_ops(&gnttab_syscore_ops);
 #endif
 
+	register_cpu_notifier(&gnttab_cpu_notifier);
+
+#ifdef CONFIG_PROC_FS
+	if (!create_xen_proc_entry("gnttab_stats", S_IFREG|S_IRUGO|S_IWUSR,
+				   &gnttab_stats_fops, NULL))
+		printk(KERN_WARNING "Unable to create /proc/xen/gnttab_stats.\n");
+#endif
+
 	return 0;
 
  ini_nomem:
@@ -72,37 +72,99 @@ static void connect(struct blkfront_info *);
 static void blkfront_closing(struct blkfront_info *);
 static int blkfront_remove(struct xenbus_device *);
 static int talk_to_backend(struct xenbus_device *, struct blkfront_info *);
-static int setup_blkring(struct xenbus_device *, struct blkfront_info *);
+static int setup_blkring(struct xenbus_device *,
+			 struct blkfront_ring_info *);
 
-static void kick_pending_request_queues(struct blkfront_info *);
+static void blkif_stop_queue(struct blkfront_info *);
+static void blkif_start_queue(struct blkfront_info *);
+static void kick_pending_request_queues(struct blkfront_ring_info *);
 
 static irqreturn_t blkif_int(int irq, void *dev_id);
+static int blkif_poll(struct blk_iopoll *iop, int budget);
+static enum hrtimer_restart blkif_coalesce_timeout(struct hrtimer *timer);
 static void blkif_restart_queue(struct work_struct *arg);
-static int blkif_recover(struct blkfront_info *, unsigned int old_ring_size,
-			 unsigned int new_ring_size);
-static void blkif_completion(struct blk_shadow *, struct blkfront_info *info, struct blkif_response *bret);
+static void blkfront_purge_grants(struct work_struct *work);
+static int blkif_recover(struct blkfront_info *);
+static void blkif_completion(struct blk_shadow *,
+			     struct blkfront_ring_info *rinfo,
+			     struct blkif_response *bret);
 static void blkif_free(struct blkfront_info *, int);
 
 static void  write_frontend_state_flag(const char * nodename);
 static int blkfront_setup_indirect(struct blkfront_info *info);
 
+/* Responses handled per blkif_poll() round before yielding the CPU. */
+#define BLKIF_POLL_WEIGHT 64
 
-static int fill_grant_buffer(struct blkfront_info *info, int num)
+/*
+ * Upper bound on the number of rings negotiated with the backend, which
+ * do_blkif_request() spreads submissions over by CPU.  Defaults to the
+ * number of online CPUs at load time; the actual count is
+ * min(max_queues, backend's multi-queue-max-queues).
+ */
+static unsigned int xen_blkif_max_queues;
+module_param_named(max_queues, xen_blkif_max_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(max_queues, "Maximum number of rings per virtual disk");
+
+/*
+ * With feature_persistent every pooled grant pins a page, up to
+ * (256 + 1) * 256 pages, almost 257M, per ring for a full pool.
+ */
+static unsigned int xen_blkif_max_pgrants;
+module_param_named(max_persistent_grants, xen_blkif_max_pgrants, uint, 0644);
+MODULE_PARM_DESC(max_persistent_grants,
+		 "Maximum number of grants pooled per ring (0: enough for a full ring)");
+
+static unsigned int xen_blkif_pgrant_idle_secs = 60;
+module_param_named(persistent_grant_idle_secs, xen_blkif_pgrant_idle_secs,
+		   uint, 0644);
+MODULE_PARM_DESC(persistent_grant_idle_secs,
+		 "Seconds a pooled grant may stay unused before it is reclaimed (0: never)");
+
+/* With persistent_grant_idle_secs at 0 the scan stops until reconnect. */
+static void blkfront_schedule_purge(struct blkfront_info *info)
+{
+	unsigned int secs = xen_blkif_pgrant_idle_secs;
+
+	if (secs)
+		schedule_delayed_work(&info->purge_work, secs * HZ);
+}
+
+unsigned int xen_blkif_max_segments = 256;
+module_param_named(max_seg, xen_blkif_max_segments, uint, 0644);
+MODULE_PARM_DESC(max_seg, "Maximum amount of segments in indirect requests (default is 256 (1M))");
+
+/* Grants needed by the largest request the device accepts. */
+static unsigned int blkfront_max_grefs(struct blkfront_info *info)
+{
+	return info->max_indirect_segments ?
+		info->max_indirect_segments +
+		INDIRECT_GREFS(info->max_indirect_segments) :
+		BLKIF_MAX_SEGMENTS_PER_REQUEST;
+}
+
+static void free_grant(struct blkfront_info *info, struct grant *gnt)
+{
+	if (info->feature_persistent)
+		__free_page(pfn_to_page(gnt->pfn));
+	kfree(gnt);
+}
+
+/* Allocate @num unused grant entries, with pages if persistent, on @list. */
+static int alloc_grants(struct blkfront_info *info, struct list_head *list,
+			unsigned int num, gfp_t gfp)
 {
 	struct page *granted_page;
-    struct grant *gnt_list_entry, *n;
-    int i = 0;
+	struct grant *gnt_list_entry, *n;
+	unsigned int i;
 
-    while (i < num) {
-        gnt_list_entry = kzalloc(sizeof(struct grant), GFP_NOIO);
-        if (!gnt_list_entry)
-            goto out_of_memory;
+	for (i = 0; i < num; i++) {
+		gnt_list_entry = kzalloc(sizeof(struct grant), gfp);
+		if (!gnt_list_entry)
+			goto out_of_memory;
 
-		/* If frontend uses feature_persistent, it will preallocate
-		 * (256 + 1) * 256 pages, almost 257M.
-		 */
 		if (info->feature_persistent) {
-			granted_page = alloc_page(GFP_NOIO);
+			granted_page = alloc_page(gfp);
 			if (!granted_page) {
 				kfree(gnt_list_entry);
 				goto out_of_memory;
@@ -110,43 +172,90 @@ static int fill_grant_buffer(struct blkfront_info *info, int num)
 			gnt_list_entry->pfn = page_to_pfn(granted_page);
 		}
 
-        gnt_list_entry->gref = GRANT_INVALID_REF;
-        list_add(&gnt_list_entry->node, &info->grants);
-        i++;
-    }
+		gnt_list_entry->gref = GRANT_INVALID_REF;
+		gnt_list_entry->last_used = jiffies;
+		list_add(&gnt_list_entry->node, list);
+	}
 
-    return 0;
+	return 0;
 
 out_of_memory:
-    list_for_each_entry_safe(gnt_list_entry, n,
-                             &info->grants, node) {
-        list_del(&gnt_list_entry->node);
-		if (info->feature_persistent)
-			__free_page(pfn_to_page(gnt_list_entry->pfn));
-        kfree(gnt_list_entry);
-        i--;
-    }
-    BUG_ON(i != 0);
-    return -ENOMEM;
+	list_for_each_entry_safe(gnt_list_entry, n, list, node) {
+		list_del(&gnt_list_entry->node);
+		free_grant(info, gnt_list_entry);
+	}
+	return -ENOMEM;
+}
+
+/* Unused entries go behind the persistent ones; ring_lock held if live. */
+static void add_grants(struct blkfront_ring_info *rinfo,
+		       struct list_head *list, unsigned int num)
+{
+	list_splice_tail(list, &rinfo->grants);
+	rinfo->grants_c += num;
+	rinfo->grants_total += num;
+}
+
+static int fill_grant_buffer(struct blkfront_ring_info *rinfo, int num)
+{
+	LIST_HEAD(list);
+	int err;
+
+	err = alloc_grants(rinfo->dev_info, &list, num, GFP_NOIO);
+	if (!err)
+		add_grants(rinfo, &list, num);
+	return err;
+}
+
+/* Back-off before blkif_restart_queue() retries a failed allocation. */
+#define BLKIF_GRANT_RETRY_DELAY (HZ / 10)
+
+/*
+ * Make sure @num more entries are on the list, called with ring_lock
+ * held.  Past the ceiling the request has to wait for completions to
+ * return entries; if atomic allocation fails, blkif_restart_queue()
+ * retries it with GFP_NOIO.
+ */
+static int grow_grant_buffer(struct blkfront_ring_info *rinfo,
+			     unsigned int num)
+{
+	LIST_HEAD(list);
+
+	if (rinfo->grants_total + num > rinfo->grants_max)
+		return -EBUSY;
+
+	if (alloc_grants(rinfo->dev_info, &list, num,
+			 GFP_NOWAIT | __GFP_NOWARN)) {
+		rinfo->grants_wanted = num;
+		schedule_delayed_work(&rinfo->work, 0);
+		return -ENOMEM;
+	}
+
+	add_grants(rinfo, &list, num);
+	return 0;
 }
 
 static struct grant *get_grant(grant_ref_t *gref_head,
                                unsigned long pfn,
-                               struct blkfront_info *info)
+                               struct blkfront_ring_info *rinfo)
 {
+    struct blkfront_info *info = rinfo->dev_info;
     struct grant *gnt_list_entry;
     unsigned long buffer_mfn;
 
-    BUG_ON(list_empty(&info->grants));
-    gnt_list_entry = list_first_entry(&info->grants, struct grant,
+    BUG_ON(list_empty(&rinfo->grants));
+    gnt_list_entry = list_first_entry(&rinfo->grants, struct grant,
                                       node);
     list_del(&gnt_list_entry->node);
+	rinfo->grants_c--;
 
 	/* for persistent grant */
 	if (gnt_list_entry->gref != GRANT_INVALID_REF) {
-		info->persistent_gnts_c--;
+		rinfo->persistent_gnts_c--;
+		rinfo->pgrant_hits++;
 		return gnt_list_entry;
 	}
+	rinfo->pgrant_misses++;
 
     /* Assign a gref to this page */
     gnt_list_entry->gref = gnttab_claim_grant_reference(gref_head);
@@ -216,15 +325,15 @@ static int blkfront_probe(struct xenbus_device *dev,
 		return -ENOMEM;
 	}
 
-	spin_lock_init(&info->io_lock);
 	mutex_init(&info->mutex);
-	INIT_LIST_HEAD(&info->grants);
-	INIT_LIST_HEAD(&info->indirect_pages);
+	spin_lock_init(&info->io_lock);
+	INIT_DELAYED_WORK(&info->purge_work, blkfront_purge_grants);
+	info->coalesce_usecs = BLKIF_COALESCE_USECS;
+	info->coalesce_frames = BLKIF_COALESCE_FRAMES;
+	info->coalesce_adaptive = true;
 	info->xbdev = dev;
 	info->vdevice = vdevice;
-	info->persistent_gnts_c = 0;
 	info->connected = BLKIF_STATE_DISCONNECTED;
-	INIT_WORK(&info->work, blkif_restart_queue);
 	INIT_LIST_HEAD(&info->resume_list);
 
 	/* Front end dir is a number, which is used as the id. */
@@ -261,13 +370,39 @@ static int blkfront_resume(struct xenbus_device *dev)
 {
 	struct blkfront_info *info = dev_get_drvdata(&dev->dev);
 	enum xenbus_state backend_state;
-	int i;
+	unsigned int i, r;
 	int err;
 
 	//printk("[INTO]----->blkfront_resume: %s\n", dev->nodename);
-	for (i=0; i<info->ring_size; i++) {
-		if (gnttab_query_foreign_access(info->ring_refs[i]))
-			return 0;
+	for (r = 0; r < info->nr_rings; r++) {
+		for (i = 0; i < info->ring_size; i++) {
+			if (gnttab_query_foreign_access(
+					info->rinfo[r].ring_refs[i]))
+				return 0;
+		}
+	}
+
+	/*
+	 * Recover stage 1: make a safe copy of the shadow state of every
+	 * ring.  The rings themselves go away in blkif_free() and the
+	 * backend may offer a different number of them after resume.
+	 */
+	if (info->connected == BLKIF_STATE_CONNECTED) {
+		for (r = 0; r < info->nr_rings; r++) {
+			struct blkfront_ring_info *rinfo = &info->rinfo[r];
+
+			for (i = 0; i < RING_SIZE(&rinfo->ring); i++) {
+				struct blk_resume_entry *ent;
+
+				/* Not in use? */
+				if (!rinfo->shadow[i].request)
+					continue;
+				ent = kmalloc(sizeof(*ent), GFP_NOIO |
+					      __GFP_NOFAIL | __GFP_HIGH);
+				ent->copy = rinfo->shadow[i];
+				list_add_tail(&ent->list, &info->resume_list);
+			}
+		}
 	}
 
 	blkif_free(info, info->connected == BLKIF_STATE_CONNECTED);
@@ -294,12 +429,100 @@ static void shadow_init(struct blk_shadow *shadow, unsigned int ring_size)
 	shadow[i - 1].req.u.rw.id = 0x0fffffff;
 }
 
+static int blkfront_alloc_rings(struct blkfront_info *info,
+				unsigned int nr_rings)
+{
+	struct blkfront_ring_info *rings;
+	unsigned int r, i;
+
+	BUG_ON(info->rinfo);
+
+	rings = kcalloc(nr_rings, sizeof(*rings), GFP_KERNEL);
+	if (!rings)
+		return -ENOMEM;
+	mutex_lock(&info->mutex);
+	info->rinfo = rings;
+	info->nr_rings = nr_rings;
+	mutex_unlock(&info->mutex);
+
+	for (r = 0; r < nr_rings; r++) {
+		struct blkfront_ring_info *rinfo = &info->rinfo[r];
+
+		spin_lock_init(&rinfo->ring_lock);
+		INIT_LIST_HEAD(&rinfo->grants);
+		INIT_LIST_HEAD(&rinfo->indirect_pages);
+		INIT_DELAYED_WORK(&rinfo->work, blkif_restart_queue);
+		hrtimer_init(&rinfo->coalesce_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL);
+		rinfo->coalesce_timer.function = blkif_coalesce_timeout;
+		rinfo->event_frames = 1;
+		for (i = 0; i < BLK_MAX_RING_PAGES; i++)
+			rinfo->ring_refs[i] = GRANT_INVALID_REF;
+		rinfo->dev_info = info;
+	}
+
+	return 0;
+}
+
+/*
+ * Write the ring references and event channel of one ring.  With a
+ * single ring the keys go directly under the frontend node, as they
+ * always have; otherwise each ring gets its own "queue-N" subdirectory.
+ */
+static int write_ring_xenstore_keys(struct blkfront_ring_info *rinfo,
+				    struct xenbus_transaction *xbt,
+				    int write_hierarchical,
+				    const char **what)
+{
+	struct blkfront_info *info = rinfo->dev_info;
+	struct xenbus_device *dev = info->xbdev;
+	const char *node = dev->nodename;
+	char *path = NULL;
+	int err;
+
+	if (write_hierarchical) {
+		path = kasprintf(GFP_KERNEL, "%s/queue-%u", dev->nodename,
+				 (unsigned int)(rinfo - info->rinfo));
+		if (!path) {
+			*what = "queue path";
+			return -ENOMEM;
+		}
+		node = path;
+	}
+
+	*what = "ring-ref";
+	if (info->ring_size == 1) {
+		err = xenbus_printf(*xbt, node, "ring-ref", "%u",
+				    rinfo->ring_refs[0]);
+		if (err)
+			goto out;
+	} else {
+		unsigned int i;
+		char buf[16];
+
+		for (i = 0; i < info->ring_size; i++) {
+			snprintf(buf, sizeof(buf), "ring-ref%u", i);
+			err = xenbus_printf(*xbt, node, buf, "%u",
+					    rinfo->ring_refs[i]);
+			if (err)
+				goto out;
+		}
+	}
+
+	*what = "event-channel";
+	err = xenbus_printf(*xbt, node, "event-channel", "%u",
+			    irq_to_evtchn_port(rinfo->irq));
+
+ out:
+	kfree(path);
+	return err;
+}
+
 /* Common code used when first setting up, and when resuming. */
 static int talk_to_backend(struct xenbus_device *dev,
 			   struct blkfront_info *info)
 {
-	unsigned int ring_size, ring_order;
-	unsigned int old_ring_size = RING_SIZE(&info->ring);
+	unsigned int ring_size, ring_order, max_queues, i;
 	const char *what = NULL;
 	struct xenbus_transaction xbt;
 	int err;
@@ -336,10 +559,26 @@ static int talk_to_backend(struct xenbus_device *dev,
 	printk("talk_to_blkback ring_size %d, ring_order %d\n", 1U<<ring_order, ring_order);
 	info->ring_size = ring_size = 1U << ring_order;
 
-	/* Create shared ring, alloc event channel. */
-	err = setup_blkring(dev, info);
-	if (err)
+	err = xenbus_scanf(XBT_NIL, dev->otherend,
+			   "multi-queue-max-queues", "%u", &max_queues);
+	if (err != 1)
+		max_queues = 1;
+	max_queues = min(max_queues, xen_blkif_max_queues);
+	if (!max_queues)
+		max_queues = 1;
+
+	err = blkfront_alloc_rings(info, max_queues);
+	if (err) {
+		xenbus_dev_fatal(dev, err, "allocating ring info");
 		goto out;
+	}
+
+	/* Create shared rings, alloc event channels. */
+	for (i = 0; i < info->nr_rings; i++) {
+		err = setup_blkring(dev, &info->rinfo[i]);
+		if (err)
+			goto destroy_blkring;
+	}
 
 again:
 	err = xenbus_transaction_start(&xbt);
@@ -348,16 +587,7 @@ again:
 		goto destroy_blkring;
 	}
 
-	if (ring_size == 1) {
-		what = "ring-ref";
-		err = xenbus_printf(xbt, dev->nodename, what, "%u",
-				    info->ring_refs[0]);
-		if (err)
-			goto abort_transaction;
-	} else {
-		unsigned int i;
-		char buf[16];
-
+	if (ring_size > 1) {
 		what = "ring-page-order";
 		err = xenbus_printf(xbt, dev->nodename, what, "%u",
 				    ring_order);
@@ -367,21 +597,26 @@ again:
 		err = xenbus_printf(xbt, dev->nodename, what, "%u", ring_size);
 		if (err)
 			goto abort_transaction;
-		what = buf;
-		for (i = 0; i < ring_size; i++) {
-			snprintf(buf, sizeof(buf), "ring-ref%u", i);
-			err = xenbus_printf(xbt, dev->nodename, what, "%u",
-					    info->ring_refs[i]);
+ 	}
+
+	if (info->nr_rings == 1) {
+		err = write_ring_xenstore_keys(&info->rinfo[0], &xbt, 0, &what);
+		if (err)
+			goto abort_transaction;
+	} else {
+		what = "multi-queue-num-queues";
+		err = xenbus_printf(xbt, dev->nodename, what, "%u",
+				    info->nr_rings);
+		if (err)
+			goto abort_transaction;
+		for (i = 0; i < info->nr_rings; i++) {
+			err = write_ring_xenstore_keys(&info->rinfo[i], &xbt,
+						       1, &what);
 			if (err)
 				goto abort_transaction;
 		}
- 	}
+	}
 
-	what = "event-channel";
-	err = xenbus_printf(xbt, dev->nodename, what, "%u",
-			    irq_to_evtchn_port(info->irq));
-	if (err)
-		goto abort_transaction;
 	what = "protocol";
 	err = xenbus_printf(xbt, dev->nodename, what, "%s",
 			    XEN_IO_PROTO_ABI_NATIVE);
@@ -405,21 +640,19 @@ again:
 
 	xenbus_switch_state(dev, XenbusStateInitialised);
 
-	ring_size = RING_SIZE(&info->ring);
-	switch (info->connected) {
-	case BLKIF_STATE_DISCONNECTED:
-		shadow_init(info->shadow, ring_size);
-		break;
-	case BLKIF_STATE_SUSPENDED:
-		printk("talk_to_backend:blkif_recover old_ring_size =%d.ring_size=%d\n", old_ring_size,ring_size); 
-		err = blkif_recover(info, old_ring_size, ring_size);
+	ring_size = RING_SIZE(&info->rinfo[0].ring);
+	for (i = 0; i < info->nr_rings; i++)
+		shadow_init(info->rinfo[i].shadow, ring_size);
+
+	if (info->connected == BLKIF_STATE_SUSPENDED) {
+		printk("talk_to_backend:blkif_recover ring_size=%d.\n", ring_size);
+		err = blkif_recover(info);
 		if (err)
 			goto out;
-		break;
 	}
 
-	pr_info("blkfront: %s: ring-pages=%u nr_ents=%u\n",
-		dev->nodename, info->ring_size, ring_size);
+	pr_info("blkfront: %s: ring-pages=%u nr_ents=%u queues=%u\n",
+		dev->nodename, info->ring_size, ring_size, info->nr_rings);
 
 	return 0;
 
@@ -435,50 +668,65 @@ again:
 
 
 static int setup_blkring(struct xenbus_device *dev,
-			 struct blkfront_info *info)
+			 struct blkfront_ring_info *rinfo)
 {
+	struct blkfront_info *info = rinfo->dev_info;
 	blkif_sring_t *sring;
 	int err;
 	unsigned int nr;
 
 	for (nr = 0; nr < info->ring_size; nr++) {
-		info->ring_refs[nr] = GRANT_INVALID_REF;
-		info->ring_pages[nr] = alloc_page(GFP_NOIO | __GFP_HIGH);
-		if (!info->ring_pages[nr])
+		rinfo->ring_refs[nr] = GRANT_INVALID_REF;
+		rinfo->ring_pages[nr] = alloc_page(GFP_NOIO | __GFP_HIGH);
+		if (!rinfo->ring_pages[nr])
 			break;
 	}
 
 	sring = nr == info->ring_size
-		? vmap(info->ring_pages, nr, VM_MAP, PAGE_KERNEL)
+		? vmap(rinfo->ring_pages, nr, VM_MAP, PAGE_KERNEL)
 		: NULL;
 	if (!sring) {
-		while (nr--)
-			__free_page(info->ring_pages[nr]);
+		while (nr--) {
+			__free_page(rinfo->ring_pages[nr]);
+			rinfo->ring_pages[nr] = NULL;
+		}
 		xenbus_dev_fatal(dev, -ENOMEM, "allocating shared ring");
 		return -ENOMEM;
 	}
 	SHARED_RING_INIT(sring);
-	FRONT_RING_INIT(&info->ring, sring,
+	FRONT_RING_INIT(&rinfo->ring, sring,
 			(unsigned long)info->ring_size << PAGE_SHIFT);
 
-	err = xenbus_multi_grant_ring(dev, nr, info->ring_pages,
-				      info->ring_refs);
+	err = xenbus_multi_grant_ring(dev, nr, rinfo->ring_pages,
+				      rinfo->ring_refs);
 	if (err < 0)
-		goto fail;
+		return err;
+
+	blk_iopoll_init(&rinfo->iopoll, BLKIF_POLL_WEIGHT, blkif_poll);
 
 	err = bind_listening_port_to_irqhandler(
-		dev->otherend_id, blkif_int, 0, "blkif", info);
+		dev->otherend_id, blkif_int, 0, "blkif", rinfo);
 	if (err <= 0) {
 		xenbus_dev_fatal(dev, err,
 				 "bind_listening_port_to_irqhandler");
-		goto fail;
+		return err;
 	}
-	info->irq = err;
+	rinfo->irq = err;
+	blk_iopoll_enable(&rinfo->iopoll);
+
+#ifndef CONFIG_XEN
+	/*
+	 * do_blkif_request() submits ring N from CPU N (modulo nr_rings);
+	 * complete it there as well.
+	 */
+	if (info->nr_rings > 1)
+		rebind_irq_to_cpu(rinfo->irq,
+				  (rinfo - info->rinfo) % num_online_cpus());
+	/* Service disk completions ahead of xenstore and other default traffic. */
+	set_irq_evtchn_priority(rinfo->irq, EVTCHN_FIFO_PRIORITY_DEFAULT - 1);
+#endif
 
 	return 0;
-fail:
-	blkif_free(info, 0);
-	return err;
 }
 
 static int xenwatch_unplugdisk_callback(void *data)
@@ -647,7 +895,7 @@ static void connect(struct blkfront_info *info)
 {
 	unsigned long long sectors;
 	unsigned long sector_size;
-	unsigned int binfo;
+	unsigned int binfo, i;
 	int err, barrier, flush, discard;
 	int persistent;
 
@@ -773,10 +1021,10 @@ static void connect(struct blkfront_info *info)
 	(void)xenbus_switch_state(info->xbdev, XenbusStateConnected);
 
 	/* Kick pending requests. */
-	spin_lock_irq(&info->io_lock);
 	info->connected = BLKIF_STATE_CONNECTED;
-	kick_pending_request_queues(info);
-	spin_unlock_irq(&info->io_lock);
+	for (i = 0; i < info->nr_rings; i++)
+		kick_pending_request_queues(&info->rinfo[i]);
+	blkfront_schedule_purge(info);
 
 	add_disk(info->gd);
 
@@ -810,33 +1058,39 @@ static void  write_frontend_state_flag(const char * nodename)
 static void blkfront_closing(struct blkfront_info *info)
 {
 	unsigned long flags;
+	unsigned int i;
 
 	DPRINTK("blkfront_closing: %d removed\n", info->vdevice);
 
 	if (info->rq == NULL)
 		goto out;
 
-	spin_lock_irqsave(&info->io_lock, flags);
 	/* No more blkif_request(). */
-	blk_stop_queue(info->rq);
-	/* No more gnttab callback work. */
-	gnttab_cancel_free_callback(&info->callback);
-	spin_unlock_irqrestore(&info->io_lock, flags);
+	blkif_stop_queue(info);
 
-	/* Flush gnttab callback work. Must be done with no locks held. */
-	flush_work_sync(&info->work);
+	for (i = 0; i < info->nr_rings; i++) {
+		struct blkfront_ring_info *rinfo = &info->rinfo[i];
+
+		/* No more gnttab callback work. */
+		spin_lock_irqsave(&rinfo->ring_lock, flags);
+		gnttab_cancel_free_callback(&rinfo->callback);
+		spin_unlock_irqrestore(&rinfo->ring_lock, flags);
+
+		/* Flush gnttab callback work. Must be done with no locks held. */
+		flush_delayed_work(&rinfo->work);
+	}
 
 	xlvbd_sysfs_delif(info);
 
 	ssleep(2);
-	while(RING_FREE_REQUESTS(&info->ring) != RING_SIZE(&info->ring))
-	{
-		ssleep(1);
+	for (i = 0; i < info->nr_rings; i++) {
+		struct blkfront_ring_info *rinfo = &info->rinfo[i];
+
+		while (RING_FREE_REQUESTS(&rinfo->ring) !=
+		       RING_SIZE(&rinfo->ring))
+			ssleep(1);
 	}
-	spin_lock_irqsave(&info->io_lock, flags);
-	/* No more blkif_request(). */
-	blk_start_queue(info->rq);
-	spin_unlock_irqrestore(&info->io_lock, flags);
+	blkif_start_queue(info);
 
 	unregister_vcd(info);
 
@@ -903,32 +1157,18 @@ static int blkfront_remove(struct xenbus_device *dev)
 	return 0;
 }
 
-static int blkfront_setup_indirect(struct blkfront_info *info)
+static int blkfront_setup_ring_indirect(struct blkfront_ring_info *rinfo,
+					unsigned int segs)
 {
-	unsigned int indirect_segments, segs;
+	struct blkfront_info *info = rinfo->dev_info;
+	unsigned int max_grefs = blkfront_max_grefs(info);
 	int err, i;
 
-	info->max_indirect_segments = 0;
-	segs = BLKIF_MAX_SEGMENTS_PER_REQUEST;
-
-	err = xenbus_gather(XBT_NIL, info->xbdev->otherend,
-		"feature-max-indirect-segments", "%u", &indirect_segments,
-		NULL);
-
-	if (!err && indirect_segments > BLKIF_MAX_SEGMENTS_PER_REQUEST) {
-		info->max_indirect_segments = min(indirect_segments,
-			xen_blkif_max_segments);
-		segs = info->max_indirect_segments;
-	}
-
-	printk("[%s:%d], segs %d\n", __func__, __LINE__, segs);
-
-	/*info->sg = kzalloc(sizeof(info->sg[0]) * segs, GFP_KERNEL);
-	if (info->sg == NULL)
-		goto out_of_memory;
-	sg_init_table(info->sg, segs);*/
-
-	err = fill_grant_buffer(info, (segs + INDIRECT_GREFS(segs)) * RING_SIZE(&info->ring));
+	/* Start with one request's worth; grow_grant_buffer() does the rest. */
+	rinfo->grants_max = (segs + INDIRECT_GREFS(segs)) * RING_SIZE(&rinfo->ring);
+	if (xen_blkif_max_pgrants && xen_blkif_max_pgrants < rinfo->grants_max)
+		rinfo->grants_max = max(xen_blkif_max_pgrants, max_grefs);
+	err = fill_grant_buffer(rinfo, max_grefs);
 	if (err)
 		goto out_of_memory;
 
@@ -938,55 +1178,53 @@ static int blkfront_setup_indirect(struct blkfront_info *info)
 		 * grants, we need to allocate a set of pages that can be
 		 * used for mapping indirect grefs
 		 */
-		int num = INDIRECT_GREFS(segs) * RING_SIZE(&info->ring);
+		int num = INDIRECT_GREFS(segs) * RING_SIZE(&rinfo->ring);
 
-		BUG_ON(!list_empty(&info->indirect_pages));
+		BUG_ON(!list_empty(&rinfo->indirect_pages));
 		for (i = 0; i < num; i++) {
 			struct page *indirect_page = alloc_page(GFP_NOIO);
 			if (!indirect_page)
 				goto out_of_memory;
-			list_add(&indirect_page->lru, &info->indirect_pages);
+			list_add(&indirect_page->lru, &rinfo->indirect_pages);
 		}
 	}
 
-	for (i = 0; i < RING_SIZE(&info->ring); i++) {
-		info->shadow[i].grants_used = kzalloc(
-			sizeof(info->shadow[i].grants_used[0]) * segs,
+	for (i = 0; i < RING_SIZE(&rinfo->ring); i++) {
+		rinfo->shadow[i].grants_used = kzalloc(
+			sizeof(rinfo->shadow[i].grants_used[0]) * segs,
 			GFP_NOIO);
 		/* malloc space for every shadow's sg */
-		info->shadow[i].sg = kzalloc(sizeof(info->shadow[i].sg[0]) * segs, GFP_NOIO);
+		rinfo->shadow[i].sg = kzalloc(sizeof(rinfo->shadow[i].sg[0]) * segs, GFP_NOIO);
 		if (info->max_indirect_segments)
-			info->shadow[i].indirect_grants = kzalloc(
-				sizeof(info->shadow[i].indirect_grants[0]) *
+			rinfo->shadow[i].indirect_grants = kzalloc(
+				sizeof(rinfo->shadow[i].indirect_grants[0]) *
 				INDIRECT_GREFS(segs),
 				GFP_NOIO);
-		if ((info->shadow[i].grants_used == NULL) ||
-			(info->shadow[i].sg == NULL) ||
+		if ((rinfo->shadow[i].grants_used == NULL) ||
+			(rinfo->shadow[i].sg == NULL) ||
 			(info->max_indirect_segments &&
-			(info->shadow[i].indirect_grants == NULL)))
+			(rinfo->shadow[i].indirect_grants == NULL)))
 			goto out_of_memory;
 		/* initialise every shadow's sg */
-		sg_init_table(info->shadow[i].sg, segs);
+		sg_init_table(rinfo->shadow[i].sg, segs);
 	}
 
 
 	return 0;
 
 out_of_memory:
-	//kfree(info->sg);
-	//info->sg = NULL;
-	for (i = 0; i < RING_SIZE(&info->ring); i++) {
-		kfree(info->shadow[i].grants_used);
-		info->shadow[i].grants_used = NULL;
+	for (i = 0; i < RING_SIZE(&rinfo->ring); i++) {
+		kfree(rinfo->shadow[i].grants_used);
+		rinfo->shadow[i].grants_used = NULL;
 		/* free every shadow's sg */
-		kfree(info->shadow[i].sg);
-		info->shadow[i].sg = NULL;
-		kfree(info->shadow[i].indirect_grants);
-		info->shadow[i].indirect_grants = NULL;
+		kfree(rinfo->shadow[i].sg);
+		rinfo->shadow[i].sg = NULL;
+		kfree(rinfo->shadow[i].indirect_grants);
+		rinfo->shadow[i].indirect_grants = NULL;
 	}
-	if (!list_empty(&info->indirect_pages)) {
+	if (!list_empty(&rinfo->indirect_pages)) {
 		struct page *indirect_page, *n;
-		list_for_each_entry_safe(indirect_page, n, &info->indirect_pages, lru) {
+		list_for_each_entry_safe(indirect_page, n, &rinfo->indirect_pages, lru) {
 			list_del(&indirect_page->lru);
 			__free_page(indirect_page);
 		}
@@ -994,29 +1232,62 @@ out_of_memory:
 	return -ENOMEM;
 }
 
+static int blkfront_setup_indirect(struct blkfront_info *info)
+{
+	unsigned int indirect_segments, segs, limit, i;
+	int err;
+
+	info->max_indirect_segments = 0;
+	segs = BLKIF_MAX_SEGMENTS_PER_REQUEST;
+
+	/* Renegotiated on every (re)connect, so max_seg changes apply then. */
+	limit = info->max_seg ? : xen_blkif_max_segments;
+	limit = min_t(unsigned int, limit, BLKIF_MAX_INDIRECT_SEGMENTS);
+
+	err = xenbus_gather(XBT_NIL, info->xbdev->otherend,
+		"feature-max-indirect-segments", "%u", &indirect_segments,
+		NULL);
+
+	if (!err && indirect_segments > BLKIF_MAX_SEGMENTS_PER_REQUEST &&
+	    limit > BLKIF_MAX_SEGMENTS_PER_REQUEST) {
+		info->max_indirect_segments = min(indirect_segments, limit);
+		segs = info->max_indirect_segments;
+	}
+
+	printk("[%s:%d], segs %d\n", __func__, __LINE__, segs);
+
+	for (i = 0; i < info->nr_rings; i++) {
+		err = blkfront_setup_ring_indirect(&info->rinfo[i], segs);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
 //int is_recovered = 0;
 static inline int GET_ID_FROM_FREELIST(
-	struct blkfront_info *info)
+	struct blkfront_ring_info *rinfo)
 {
-	unsigned long free = info->shadow_free;
+	unsigned long free = rinfo->shadow_free;
 
-	BUG_ON(free >= RING_SIZE(&info->ring));
+	BUG_ON(free >= RING_SIZE(&rinfo->ring));
 
-	info->shadow_free = info->shadow[free].req.u.rw.id;
-	info->shadow[free].req.u.rw.id = 0x0fffffee; /* debug */
+	rinfo->shadow_free = rinfo->shadow[free].req.u.rw.id;
+	rinfo->shadow[free].req.u.rw.id = 0x0fffffee; /* debug */
 	return free;
 }
 
 static inline int ADD_ID_TO_FREELIST(
-	struct blkfront_info *info, unsigned long id)
+	struct blkfront_ring_info *rinfo, unsigned long id)
 {
-	if (info->shadow[id].req.u.rw.id != id)
+	if (rinfo->shadow[id].req.u.rw.id != id)
 		return -EINVAL;
-	if (!info->shadow[id].request)
+	if (!rinfo->shadow[id].request)
 		return -ENXIO;
-	info->shadow[id].req.u.rw.id  = info->shadow_free;
-	info->shadow[id].request = NULL;
-	info->shadow_free = id;
+	rinfo->shadow[id].req.u.rw.id  = rinfo->shadow_free;
+	rinfo->shadow[id].request = NULL;
+	rinfo->shadow_free = id;
 
 	return 0;
 }
@@ -1038,78 +1309,154 @@ static const char *op_name(unsigned int op)
 	return names[op] ?: "reserved";
 }
 
-static inline void flush_requests(struct blkfront_info *info)
+static inline void flush_requests(struct blkfront_ring_info *rinfo)
 {
 	int notify;
 
-	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&info->ring, notify);
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&rinfo->ring, notify);
 
 	if (notify)
-		notify_remote_via_irq(info->irq);
+		notify_remote_via_irq(rinfo->irq);
 }
 
-static void kick_pending_request_queues(struct blkfront_info *info)
+/* Stop and restart calls into do_blkif_request(). */
+static void blkif_stop_queue(struct blkfront_info *info)
 {
-	bool queued = false;
+	unsigned long flags;
 
-	/* Recover stage 3: Re-queue pending requests. */
-	while (!list_empty(&info->resume_list) && !RING_FULL(&info->ring)) {
-		/* Grab a request slot and copy shadow state into it. */
-		struct blk_resume_entry *ent =
-			list_first_entry(&info->resume_list,
-					 struct blk_resume_entry, list);
-		blkif_request_t *req =
-			RING_GET_REQUEST(&info->ring, info->ring.req_prod_pvt);
-		unsigned int i;
+	spin_lock_irqsave(&info->io_lock, flags);
+	blk_stop_queue(info->rq);
+	spin_unlock_irqrestore(&info->io_lock, flags);
+}
+
+static void blkif_start_queue(struct blkfront_info *info)
+{
+	unsigned long flags;
 
-		*req = ent->copy.req;
+	spin_lock_irqsave(&info->io_lock, flags);
+	blk_start_queue(info->rq);
+	spin_unlock_irqrestore(&info->io_lock, flags);
+}
 
-		/* We get a new request id, and must reset the shadow state. */
-		req->u.rw.id = GET_ID_FROM_FREELIST(info);
-		info->shadow[req->u.rw.id] = ent->copy;
-		info->shadow[req->u.rw.id].req.u.rw.id = req->u.rw.id;
+/*
+ * Called without ring_lock: the queue lock nests outside it.  A
+ * stale RING_FULL() only costs a restart that stops again on busy.
+ */
+static void kick_pending_request_queues(struct blkfront_ring_info *rinfo)
+{
+	if (!RING_FULL(&rinfo->ring) && rinfo->dev_info->rq)
+		/* Re-enable calldowns and kick things off. */
+		blkif_start_queue(rinfo->dev_info);
+}
 
-		/* Rewrite any grant references invalidated by susp/resume. */
-		for (i = 0; i < req->u.rw.nr_segments; i++) {
-			gnttab_grant_foreign_access_ref(req->u.rw.seg[i].gref,
-				info->xbdev->otherend_id,
-				pfn_to_mfn(ent->copy.grants_used[i]->pfn),
-				rq_data_dir(ent->copy.request) ?
-				GTF_readonly : 0);
-		}
+static void blkif_restart_queue(struct work_struct *arg)
+{
+	struct blkfront_ring_info *rinfo =
+		container_of(to_delayed_work(arg), struct blkfront_ring_info,
+			     work);
+	struct blkfront_info *info = rinfo->dev_info;
+	unsigned int want;
+	bool kick;
+	LIST_HEAD(list);
 
-		info->ring.req_prod_pvt++;
-		queued = true;
+	spin_lock_irq(&rinfo->ring_lock);
+	want = rinfo->grants_wanted;
+	rinfo->grants_wanted = 0;
+	spin_unlock_irq(&rinfo->ring_lock);
 
-		__list_del_entry(&ent->list);
-		kfree(ent);
+	/*
+	 * Growth that failed in atomic context, see grow_grant_buffer().
+	 * If even GFP_NOIO fails there may be nothing in flight whose
+	 * completion would restart the queue, so try again in a while.
+	 */
+	if (want && alloc_grants(info, &list, want, GFP_NOIO)) {
+		spin_lock_irq(&rinfo->ring_lock);
+		if (info->connected == BLKIF_STATE_CONNECTED) {
+			rinfo->grants_wanted = max(rinfo->grants_wanted, want);
+			schedule_delayed_work(&rinfo->work,
+					      BLKIF_GRANT_RETRY_DELAY);
+		}
+		spin_unlock_irq(&rinfo->ring_lock);
+		return;
+	}
+
+	spin_lock_irq(&rinfo->ring_lock);
+	kick = info->connected == BLKIF_STATE_CONNECTED;
+	if (kick && want) {
+		add_grants(rinfo, &list, want);
+		want = 0;
 	}
+	spin_unlock_irq(&rinfo->ring_lock);
 
-	/* Send off requeued requests */
-	if (queued)
-		flush_requests(info);
+	if (kick)
+		kick_pending_request_queues(rinfo);
 
-	if (!RING_FULL(&info->ring)) {
-		/* Re-enable calldowns. */
-		blk_start_queue(info->rq);
-		/* Kick things off immediately. */
-		do_blkif_request(info->rq);
+	if (want) {
+		struct grant *gnt, *n;
+
+		list_for_each_entry_safe(gnt, n, &list, node) {
+			list_del(&gnt->node);
+			free_grant(info, gnt);
+		}
 	}
 }
 
-static void blkif_restart_queue(struct work_struct *arg)
+/*
+ * Reclaim grants that sat unused on the list for longer than
+ * persistent_grant_idle_secs, coldest first, keeping one request's
+ * worth.  A persistent backend keeps the grants it has seen mapped, so
+ * only those whose foreign access can be ended now are reclaimed; the
+ * others stay on the list.
+ */
+static void blkfront_purge_grants(struct work_struct *work)
 {
-	struct blkfront_info *info = container_of(arg, struct blkfront_info, work);
-	spin_lock_irq(&info->io_lock);
+	struct blkfront_info *info =
+		container_of(to_delayed_work(work), struct blkfront_info,
+			     purge_work);
+	unsigned long idle = xen_blkif_pgrant_idle_secs * HZ;
+	unsigned int floor = blkfront_max_grefs(info);
+	struct grant *gnt, *n;
+	unsigned int i;
+
+	for (i = 0; idle && i < info->nr_rings; i++) {
+		struct blkfront_ring_info *rinfo = &info->rinfo[i];
+		LIST_HEAD(purge);
+
+		spin_lock_irq(&rinfo->ring_lock);
+		list_for_each_entry_safe_reverse(gnt, n, &rinfo->grants, node) {
+			if (rinfo->grants_total <= floor)
+				break;
+			if (time_before(jiffies, gnt->last_used + idle))
+				continue;
+			if (gnt->gref != GRANT_INVALID_REF) {
+				if (gnttab_query_foreign_access(gnt->gref) ||
+				    !gnttab_end_foreign_access_ref(gnt->gref))
+					continue;
+				rinfo->persistent_gnts_c--;
+			}
+			list_move(&gnt->node, &purge);
+			rinfo->grants_c--;
+			rinfo->grants_total--;
+			rinfo->pgrant_purged++;
+		}
+		spin_unlock_irq(&rinfo->ring_lock);
+
+		list_for_each_entry_safe(gnt, n, &purge, node) {
+			list_del(&gnt->node);
+			if (gnt->gref != GRANT_INVALID_REF)
+				gnttab_free_grant_reference(gnt->gref);
+			free_grant(info, gnt);
+		}
+	}
+
 	if (info->connected == BLKIF_STATE_CONNECTED)
-		kick_pending_request_queues(info);
-	spin_unlock_irq(&info->io_lock);
+		blkfront_schedule_purge(info);
 }
 
 static void blkif_restart_queue_callback(void *arg)
 {
-	struct blkfront_info *info = (struct blkfront_info *)arg;
-	schedule_work(&info->work);
+	struct blkfront_ring_info *rinfo = (struct blkfront_ring_info *)arg;
+	schedule_delayed_work(&rinfo->work, 0);
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,28)
@@ -1268,9 +1615,10 @@ int blkif_getgeo(struct block_device *bd, struct hd_geometry *hg)
  *
  * @req: a request struct
  */
-static int blkif_queue_request(struct request *req)
+static int blkif_queue_request(struct request *req,
+			       struct blkfront_ring_info *rinfo)
 {
-	struct blkfront_info *info = req->rq_disk->private_data;
+	struct blkfront_info *info = rinfo->dev_info;
 	blkif_request_t *ring_req;
 	unsigned long id;
 	unsigned int fsect, lsect;
@@ -1291,21 +1639,23 @@ static int blkif_queue_request(struct request *req)
 	if (unlikely(info->connected != BLKIF_STATE_CONNECTED))
 		return 1;
 
-	max_grefs = info->max_indirect_segments ?
-		info->max_indirect_segments +
-		INDIRECT_GREFS(info->max_indirect_segments) :
-		BLKIF_MAX_SEGMENTS_PER_REQUEST;
+	max_grefs = blkfront_max_grefs(info);
+
+	/* Grow the pool on demand, within its ceiling. */
+	if (rinfo->grants_c < max_grefs &&
+	    grow_grant_buffer(rinfo, max_grefs - rinfo->grants_c))
+		return 1;
 
 	/* Check if we have enought grants to allocate a requests */
-	if (info->persistent_gnts_c < max_grefs) {
+	if (rinfo->persistent_gnts_c < max_grefs) {
 		new_persistent_gnts = 1;
 		if (gnttab_alloc_grant_references(
-			max_grefs - info->persistent_gnts_c,
+			max_grefs - rinfo->persistent_gnts_c,
 			&gref_head) < 0) {
 			gnttab_request_free_callback(
-				&info->callback,
+				&rinfo->callback,
 				blkif_restart_queue_callback,
-				info,
+				rinfo,
 				max_grefs);
 			return 1;
 		}
@@ -1313,16 +1663,16 @@ static int blkif_queue_request(struct request *req)
 		new_persistent_gnts = 0;
 
 	/* Fill out a communications ring structure. */
-	ring_req = RING_GET_REQUEST(&info->ring, info->ring.req_prod_pvt);
-	id = GET_ID_FROM_FREELIST(info);
-	info->shadow[id].request = req;
+	ring_req = RING_GET_REQUEST(&rinfo->ring, rinfo->ring.req_prod_pvt);
+	id = GET_ID_FROM_FREELIST(rinfo);
+	rinfo->shadow[id].request = req;
 
 	BUG_ON(info->max_indirect_segments == 0 &&
                 req->nr_phys_segments > BLKIF_MAX_SEGMENTS_PER_REQUEST);
     BUG_ON(info->max_indirect_segments &&
                 req->nr_phys_segments > info->max_indirect_segments);
 
-	nseg = blk_rq_map_sg(req->q, req, info->shadow[id].sg);
+	nseg = blk_rq_map_sg(req->q, req, rinfo->shadow[id].sg);
 	ring_req->u.rw.id = id;
 
 	if (nseg > BLKIF_MAX_SEGMENTS_PER_REQUEST) {
@@ -1361,7 +1711,7 @@ static int blkif_queue_request(struct request *req)
 		if ((req->cmd_flags & REQ_SECURE) && info->feature_secdiscard)
 			ring_req->u.discard.flag = BLKIF_DISCARD_SECURE;
 	} else {
-		for_each_sg(info->shadow[id].sg, sg, nseg, i) {
+		for_each_sg(rinfo->shadow[id].sg, sg, nseg, i) {
 			fsect = sg->offset >> 9;
 			lsect = fsect + (sg->length >> 9) - 1;
 
@@ -1376,23 +1726,23 @@ static int blkif_queue_request(struct request *req)
 				if (!info->feature_persistent) {
 					struct page *indirect_page;
 					/* Fetch a pre-allocated page to use for indirect grefs */
-					BUG_ON(list_empty(&info->indirect_pages));
-					indirect_page = list_first_entry(&info->indirect_pages,
+					BUG_ON(list_empty(&rinfo->indirect_pages));
+					indirect_page = list_first_entry(&rinfo->indirect_pages,
 													 struct page, lru);
 					list_del(&indirect_page->lru);
 					pfn = page_to_pfn(indirect_page);
 				}
 
-				gnt_list_entry = get_grant(&gref_head, pfn, info);
-				info->shadow[id].indirect_grants[n] = gnt_list_entry;
+				gnt_list_entry = get_grant(&gref_head, pfn, rinfo);
+				rinfo->shadow[id].indirect_grants[n] = gnt_list_entry;
 				segments = kmap_atomic(pfn_to_page(gnt_list_entry->pfn));
 				ring_req->u.indirect.indirect_grefs[n] = gnt_list_entry->gref;
 			}
 
-			gnt_list_entry = get_grant(&gref_head, page_to_pfn(sg_page(sg)), info);
+			gnt_list_entry = get_grant(&gref_head, page_to_pfn(sg_page(sg)), rinfo);
 			ref = gnt_list_entry->gref;
 
-			info->shadow[id].grants_used[i] = gnt_list_entry;
+			rinfo->shadow[id].grants_used[i] = gnt_list_entry;
 
 			/* If use persistent grant, it will have a memcpy,
 			 * just copy the data from sg page to grant page. 
@@ -1442,10 +1792,10 @@ static int blkif_queue_request(struct request *req)
 	if (segments)
 		kunmap_atomic(segments);
 
-	info->ring.req_prod_pvt++;
+	rinfo->ring.req_prod_pvt++;
 
 	/* Keep a private copy so we can reissue requests when recovering. */
-	info->shadow[id].req = *ring_req;
+	rinfo->shadow[id].req = *ring_req;
 
 	/* for persistent grant */
 	if (new_persistent_gnts)
@@ -1460,32 +1810,32 @@ static int blkif_queue_request(struct request *req)
  */
 void do_blkif_request(struct request_queue *rq)
 {
-	struct blkfront_info *info = NULL;
+	struct blkfront_info *info = rq->queuedata;
+	struct blkfront_ring_info *rinfo;
 	struct request *req;
 	int queued;
 
 	DPRINTK("Entered do_blkif_request\n");
 
+	if (unlikely(info->connected != BLKIF_STATE_CONNECTED)) {
+		blk_stop_queue(rq);
+		return;
+	}
+	/*
+	 * Called with the queue lock held and interrupts off, so the CPU
+	 * is stable: feed its ring, the one its event channel is bound to.
+	 */
+	rinfo = &info->rinfo[smp_processor_id() % info->nr_rings];
+
 	queued = 0;
 
+	spin_lock(&rinfo->ring_lock);
 	while ((req = blk_peek_request(rq)) != NULL) {
-		info = req->rq_disk->private_data;
-
-		if (RING_FULL(&info->ring))
+		if (RING_FULL(&rinfo->ring))
 			goto wait;
 
 		blk_start_request(req);
 
-		/*if ((req->cmd_type != REQ_TYPE_FS &&
-		     (req->cmd_type != REQ_TYPE_BLOCK_PC || req->cmd_len)) ||
-		    ((req->cmd_flags & (REQ_FLUSH | REQ_FUA)) &&
-		     !info->flush_op)) {
-			req->errors = (DID_ERROR << 16) |
-				      (DRIVER_INVALID << 24);
-			__blk_end_request_all(req, -EIO);
-			continue;
-		}*/
-
 		if (req->cmd_type != REQ_TYPE_FS) {
 			__blk_end_request_all(req, -EIO);
 			continue;
@@ -1497,7 +1847,7 @@ void do_blkif_request(struct request_queue *rq)
 			blk_rq_cur_sectors(req), blk_rq_sectors(req),
 			req->buffer, rq_data_dir(req) ? "write" : "read");
 
-		if (blkif_queue_request(req)) {
+		if (blkif_queue_request(req, rinfo)) {
 			blk_requeue_request(rq, req);
 		wait:
 			/* Avoid pointless unplugs. */
@@ -1509,35 +1859,147 @@ void do_blkif_request(struct request_queue *rq)
 	}
 
 	if (queued != 0)
-		flush_requests(info);
+		flush_requests(rinfo);
+	spin_unlock(&rinfo->ring_lock);
 }
 
 
+/*
+ * The event channel handler only schedules blkif_poll(): copying read
+ * data out of persistent grants can take long for large indirect
+ * requests and must not run with interrupts disabled.
+ */
 static irqreturn_t blkif_int(int irq, void *dev_id)
+{
+	struct blkfront_ring_info *rinfo = (struct blkfront_ring_info *)dev_id;
+
+	if (likely(rinfo->dev_info->connected == BLKIF_STATE_CONNECTED) &&
+	    !blk_iopoll_sched_prep(&rinfo->iopoll))
+		blk_iopoll_sched(&rinfo->iopoll);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * Interrupt moderation.  Rather than an event for the very next
+ * response, ask for one after event_frames of them (never more than
+ * are in flight), with coalesce_timer bounding the wait.  Adaptively,
+ * the batch doubles while full batches beat the timer and halves each
+ * time the timer fires, down to an event per response at low IOPS.
+ */
+static enum hrtimer_restart blkif_coalesce_timeout(struct hrtimer *timer)
+{
+	struct blkfront_ring_info *rinfo =
+		container_of(timer, struct blkfront_ring_info, coalesce_timer);
+
+	rinfo->coalesce_expired = true;
+	if (!blk_iopoll_sched_prep(&rinfo->iopoll))
+		blk_iopoll_sched(&rinfo->iopoll);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Called with ring_lock held; returns non-zero if polling must go on. */
+static int blkif_rearm_event(struct blkfront_ring_info *rinfo, int done)
+{
+	struct blkfront_info *info = rinfo->dev_info;
+	RING_IDX cons = rinfo->ring.rsp_cons;
+	unsigned int frames = rinfo->event_frames;
+	unsigned int limit = info->coalesce_usecs ? info->coalesce_frames : 1;
+	int more_to_do;
+
+	if (!info->coalesce_adaptive)
+		frames = limit;
+	else if (rinfo->coalesce_expired)
+		frames = max(frames / 2, 1U);
+	else if (done >= max(frames, 2U))
+		frames *= 2;
+	rinfo->coalesce_expired = false;
+	rinfo->event_frames = frames = min(frames, limit);
+
+	frames = min(frames, rinfo->ring.req_prod_pvt - cons);
+	if (frames <= 1) {
+		RING_FINAL_CHECK_FOR_RESPONSES(&rinfo->ring, more_to_do);
+		return more_to_do;
+	}
+
+	rinfo->ring.sring->rsp_event = cons + frames;
+	mb();
+	/* The backend only notifies when rsp_prod crosses rsp_event. */
+	if (rinfo->ring.sring->rsp_prod - cons >= frames)
+		return 1;
+
+	hrtimer_start(&rinfo->coalesce_timer,
+		      ns_to_ktime((u64)info->coalesce_usecs * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+	return 0;
+}
+
+/*
+ * Hand a finished request, result in req->errors, back to the block
+ * layer.  The queue lock nests outside ring_lock, so requests are
+ * collected here and ended by blkif_end_requests() once ring_lock is
+ * dropped.
+ */
+static inline void blkif_complete_request(struct request *req,
+					  struct list_head *completed)
+{
+	list_add_tail(&req->queuelist, completed);
+}
+
+static void blkif_end_requests(struct blkfront_info *info,
+			       struct list_head *completed)
+{
+	struct request *req, *n;
+	unsigned long flags;
+
+	if (list_empty(completed))
+		return;
+
+	spin_lock_irqsave(&info->io_lock, flags);
+	list_for_each_entry_safe(req, n, completed, queuelist) {
+		list_del_init(&req->queuelist);
+		__blk_end_request_all(req, req->errors);
+	}
+	spin_unlock_irqrestore(&info->io_lock, flags);
+}
+
+/*
+ * Consume up to @budget responses with interrupts enabled.  As with
+ * NAPI, polling stops and the event is re-armed only once the ring has
+ * been drained within budget; otherwise the block softirq calls back.
+ */
+static int blkif_poll(struct blk_iopoll *iop, int budget)
 {
 	struct request *req;
 	blkif_response_t *bret;
 	RING_IDX i, rp;
-	unsigned long flags;
-	struct blkfront_info *info = (struct blkfront_info *)dev_id;
+	int done = 0, more_to_do = 0;
+	bool discard_failed = false;
+	struct blkfront_ring_info *rinfo =
+		container_of(iop, struct blkfront_ring_info, iopoll);
+	struct blkfront_info *info = rinfo->dev_info;
+	LIST_HEAD(completed);
 
-	spin_lock_irqsave(&info->io_lock, flags);
+	hrtimer_try_to_cancel(&rinfo->coalesce_timer);
+
+	spin_lock(&rinfo->ring_lock);
 
 	if (unlikely(info->connected != BLKIF_STATE_CONNECTED)) {
-		spin_unlock_irqrestore(&info->io_lock, flags);
-		return IRQ_HANDLED;
+		spin_unlock(&rinfo->ring_lock);
+		blk_iopoll_complete(iop);
+		return 0;
 	}
 
- again:
-	rp = info->ring.sring->rsp_prod;
+	rp = rinfo->ring.sring->rsp_prod;
 	rmb(); /* Ensure we see queued responses up to 'rp'. */
 
-	for (i = info->ring.rsp_cons; i != rp; i++) {
+	for (i = rinfo->ring.rsp_cons; i != rp && done < budget; i++, done++) {
 		unsigned long id;
 		int ret;
 
-		bret = RING_GET_RESPONSE(&info->ring, i);
-		if (unlikely(bret->id >= RING_SIZE(&info->ring))) {
+		bret = RING_GET_RESPONSE(&rinfo->ring, i);
+		if (unlikely(bret->id >= RING_SIZE(&rinfo->ring))) {
 			/*
 			 * The backend has messed up and given us an id that
 			 * we would never have given to it (we stamp it up to
@@ -1550,11 +2012,11 @@ static irqreturn_t blkif_int(int irq, void *dev_id)
 			continue;
 		}
 		id   = bret->id;
-		req  = info->shadow[id].request;
+		req  = rinfo->shadow[id].request;
 
-		blkif_completion(&info->shadow[id], info, bret);
+		blkif_completion(&rinfo->shadow[id], rinfo, bret);
 
-		ret = ADD_ID_TO_FREELIST(info, id);
+		ret = ADD_ID_TO_FREELIST(rinfo, id);
 		if (unlikely(ret)) {
 			pr_warning("%s: id %#lx (response to %s) couldn't be recycled (%d)!\n",
 				   info->gd->disk_name, id,
@@ -1572,7 +2034,7 @@ static irqreturn_t blkif_int(int irq, void *dev_id)
 			if (unlikely(bret->status == BLKIF_RSP_EOPNOTSUPP))
 				ret = -EOPNOTSUPP;
 			if (unlikely(bret->status == BLKIF_RSP_ERROR &&
-				     info->shadow[id].req.u.rw.nr_segments == 0)) {
+				     rinfo->shadow[id].req.u.rw.nr_segments == 0)) {
 				kind = "empty ";
 				ret = -EOPNOTSUPP;
 			}
@@ -1599,108 +2061,130 @@ static irqreturn_t blkif_int(int irq, void *dev_id)
 					op_name(bret->operation),
 					bret->status);
 
-			__blk_end_request_all(req, ret);
+			req->errors = ret;
+			blkif_complete_request(req, &completed);
 			break;
 		case BLKIF_OP_DISCARD:
 			if (unlikely(bret->status == BLKIF_RSP_EOPNOTSUPP)) {
-				struct request_queue *rq = info->rq;
-
 				pr_warn("blkfront: %s: discard op failed\n",
 					info->gd->disk_name);
 				ret = -EOPNOTSUPP;
 				info->feature_discard = 0;
 				info->feature_secdiscard = 0;
-				queue_flag_clear(QUEUE_FLAG_DISCARD, rq);
-				queue_flag_clear(QUEUE_FLAG_SECDISCARD, rq);
+				discard_failed = true;
 			}
-			__blk_end_request_all(req, ret);
+			req->errors = ret;
+			blkif_complete_request(req, &completed);
 			break;
 		default:
 			BUG();
 		}
 	}
 
-	info->ring.rsp_cons = i;
+	rinfo->ring.rsp_cons = i;
 
-	if (i != info->ring.req_prod_pvt) {
-		int more_to_do;
-		RING_FINAL_CHECK_FOR_RESPONSES(&info->ring, more_to_do);
-		if (more_to_do)
-			goto again;
-	} else
-		info->ring.sring->rsp_event = i + 1;
+	spin_unlock(&rinfo->ring_lock);
 
-	kick_pending_request_queues(info);
+	blkif_end_requests(info, &completed);
 
-	spin_unlock_irqrestore(&info->io_lock, flags);
+	if (unlikely(discard_failed)) {
+		struct request_queue *rq = info->rq;
+		unsigned long flags;
 
-	return IRQ_HANDLED;
+		spin_lock_irqsave(rq->queue_lock, flags);
+		queue_flag_clear(QUEUE_FLAG_DISCARD, rq);
+		queue_flag_clear(QUEUE_FLAG_SECDISCARD, rq);
+		spin_unlock_irqrestore(rq->queue_lock, flags);
+	}
+
+	kick_pending_request_queues(rinfo);
+
+	if (done >= budget)
+		return done;
+
+	/*
+	 * Leave polling mode before re-arming, so that a response racing
+	 * with the final check raises an event that reschedules us.
+	 */
+	blk_iopoll_complete(iop);
+
+	spin_lock(&rinfo->ring_lock);
+	if (i != rinfo->ring.req_prod_pvt)
+		more_to_do = blkif_rearm_event(rinfo, done);
+	else
+		rinfo->ring.sring->rsp_event = i + 1;
+	spin_unlock(&rinfo->ring_lock);
+
+	if (more_to_do && !blk_iopoll_sched_prep(iop))
+		blk_iopoll_sched(iop);
+
+	return done;
 }
 
-static void blkif_free(struct blkfront_info *info, int suspend)
+static void blkif_free_ring(struct blkfront_ring_info *rinfo)
 {
+	struct blkfront_info *info = rinfo->dev_info;
 	struct grant *persistent_gnt;
 	struct grant *n;
 	int i, j, segs;
 
-	/* Prevent new requests being issued until we fix things up. */
-	spin_lock_irq(&info->io_lock);
-	info->connected = suspend ?
-		BLKIF_STATE_SUSPENDED : BLKIF_STATE_DISCONNECTED;
-	/* No more blkif_request(). */
-	if (info->rq)
-		blk_stop_queue(info->rq);
+	/* Wait for a running blkif_poll(); only enabled once irq is bound. */
+	if (rinfo->irq)
+		blk_iopoll_disable(&rinfo->iopoll);
+	hrtimer_cancel(&rinfo->coalesce_timer);
+
+	spin_lock_irq(&rinfo->ring_lock);
 
 	/* Remove all persistent grants */
-	if (!list_empty(&info->grants)) {
+	if (!list_empty(&rinfo->grants)) {
 		list_for_each_entry_safe(persistent_gnt, n,
-                                 &info->grants, node) {
+                                 &rinfo->grants, node) {
 			list_del(&persistent_gnt->node);
 			if (persistent_gnt->gref != GRANT_INVALID_REF) {
 				gnttab_end_foreign_access(persistent_gnt->gref, 0UL);
-				info->persistent_gnts_c--;
+				rinfo->persistent_gnts_c--;
 			}
 			if (info->feature_persistent)
 				__free_page(pfn_to_page(persistent_gnt->pfn));
 			kfree(persistent_gnt);
 		}
 	}
-	BUG_ON(info->persistent_gnts_c != 0);
+	BUG_ON(rinfo->persistent_gnts_c != 0);
 
 	/*
 	 * Remove indirect pages, this only happens when using indirect
 	 * descriptors but not persistent grants
 	 */
-	if (!list_empty(&info->indirect_pages)) {
+	if (!list_empty(&rinfo->indirect_pages)) {
 		struct page *indirect_page, *n;
 
 		BUG_ON(info->feature_persistent);
-		list_for_each_entry_safe(indirect_page, n, &info->indirect_pages, lru) {
+		list_for_each_entry_safe(indirect_page, n, &rinfo->indirect_pages, lru) {
 			list_del(&indirect_page->lru);
 			__free_page(indirect_page);
 		}
 	}
 
-	for (i = 0; i < RING_SIZE(&info->ring); i++) {
+	for (i = 0; i < RING_SIZE(&rinfo->ring); i++) {
 		/*
 		 * Clear persistent grants present in requests already
 		 * on the shared ring
 		 */
-		if (!info->shadow[i].request)
+		if (!rinfo->shadow[i].request)
 			goto free_shadow;
 
-		segs = info->shadow[i].req.operation == BLKIF_OP_INDIRECT ?
-			info->shadow[i].req.u.indirect.nr_segments :
-			info->shadow[i].req.u.rw.nr_segments;
+		segs = rinfo->shadow[i].req.operation == BLKIF_OP_INDIRECT ?
+			rinfo->shadow[i].req.u.indirect.nr_segments :
+			rinfo->shadow[i].req.u.rw.nr_segments;
 		for (j = 0; j < segs; j++) {
-			persistent_gnt = info->shadow[i].grants_used[j];
+			persistent_gnt = rinfo->shadow[i].grants_used[j];
 			gnttab_end_foreign_access(persistent_gnt->gref, 0UL);
 			if (info->feature_persistent)
 				__free_page(pfn_to_page(persistent_gnt->pfn));
 			kfree(persistent_gnt);
 		}
 
-		if (info->shadow[i].req.operation != BLKIF_OP_INDIRECT)
+		if (rinfo->shadow[i].req.operation != BLKIF_OP_INDIRECT)
 			/*
 			 * If this is not an indirect operation don't try to
 			 * free indirect segments
@@ -1708,43 +2192,69 @@ static void blkif_free(struct blkfront_info *info, int suspend)
 			goto free_shadow;
 
 		for (j = 0; j < INDIRECT_GREFS(segs); j++) {
-			persistent_gnt = info->shadow[i].indirect_grants[j];
+			persistent_gnt = rinfo->shadow[i].indirect_grants[j];
 			gnttab_end_foreign_access(persistent_gnt->gref, 0UL);
 			__free_page(pfn_to_page(persistent_gnt->pfn));
 			kfree(persistent_gnt);
 		}
 
 free_shadow:
-		kfree(info->shadow[i].grants_used);
-		info->shadow[i].grants_used = NULL;
-		kfree(info->shadow[i].indirect_grants);
-		info->shadow[i].indirect_grants = NULL;
-		kfree(info->shadow[i].sg);
-		info->shadow[i].sg = NULL;
+		kfree(rinfo->shadow[i].grants_used);
+		rinfo->shadow[i].grants_used = NULL;
+		kfree(rinfo->shadow[i].indirect_grants);
+		rinfo->shadow[i].indirect_grants = NULL;
+		kfree(rinfo->shadow[i].sg);
+		rinfo->shadow[i].sg = NULL;
 	}
 
-	//kfree(info->sg);
-	//info->sg = NULL;
+	rinfo->grants_c = rinfo->grants_total = 0;
+
 	/* No more gnttab callback work. */
-	gnttab_cancel_free_callback(&info->callback);
-	spin_unlock_irq(&info->io_lock);
+	gnttab_cancel_free_callback(&rinfo->callback);
+	spin_unlock_irq(&rinfo->ring_lock);
 
 	/* Flush gnttab callback work. Must be done with no locks held. */
-	flush_work_sync(&info->work);
+	flush_delayed_work(&rinfo->work);
 
 	/* Free resources associated with old device channel. */
-	vunmap(info->ring.sring);
-	info->ring.sring = NULL;
+	if (rinfo->ring.sring)
+		vunmap(rinfo->ring.sring);
+	rinfo->ring.sring = NULL;
 	gnttab_multi_end_foreign_access(info->ring_size,
-					info->ring_refs, info->ring_pages);
-	if (info->irq)
-		unbind_from_irqhandler(info->irq, info);
-	info->irq = 0;
+					rinfo->ring_refs, rinfo->ring_pages);
+	if (rinfo->irq)
+		unbind_from_irqhandler(rinfo->irq, rinfo);
+	rinfo->irq = 0;
 }
 
-static void blkif_completion(struct blk_shadow *s, struct blkfront_info *info,
-									struct blkif_response *bret)
+static void blkif_free(struct blkfront_info *info, int suspend)
 {
+	unsigned int i;
+
+	/* Prevent new requests being issued until we fix things up. */
+	info->connected = suspend ?
+		BLKIF_STATE_SUSPENDED : BLKIF_STATE_DISCONNECTED;
+	/* No more blkif_request(). */
+	if (info->rq)
+		blkif_stop_queue(info);
+	cancel_delayed_work_sync(&info->purge_work);
+
+	for (i = 0; i < info->nr_rings; i++)
+		blkif_free_ring(&info->rinfo[i]);
+
+	/* The pgrant sysfs files walk rinfo under info->mutex. */
+	mutex_lock(&info->mutex);
+	kfree(info->rinfo);
+	info->rinfo = NULL;
+	info->nr_rings = 0;
+	mutex_unlock(&info->mutex);
+}
+
+static void blkif_completion(struct blk_shadow *s,
+			     struct blkfront_ring_info *rinfo,
+			     struct blkif_response *bret)
+{
+	struct blkfront_info *info = rinfo->dev_info;
 	int i;
 	int nseg;
 	/* for persistent grant */
@@ -1764,6 +2274,11 @@ static void blkif_completion(struct blk_shadow *s, struct blkfront_info *info,
 		 * Since bv_offset can be different than 0, and bv_len different
 		 * than PAGE_SIZE, we have to keep track of the current offset,
 		 * to be sure we are copying the data from the right shared page.
+		 *
+		 * Granting the bio pages themselves would save the copy, but
+		 * a backend that negotiated feature-persistent keeps every
+		 * gref it is handed mapped until disconnect, so the fresh
+		 * references would never come back.
 		 */
 		for_each_sg(s->sg, sg, nseg, i) {
 			BUG_ON(sg->offset + sg->length > PAGE_SIZE);
@@ -1790,8 +2305,9 @@ static void blkif_completion(struct blk_shadow *s, struct blkfront_info *info,
 			if (!info->feature_persistent)
 				printk(KERN_WARNING "backed has not unmapped grant: %u\n",
 						     s->grants_used[i]->gref);
-			list_add(&s->grants_used[i]->node, &info->grants);
-			info->persistent_gnts_c++;
+			list_add(&s->grants_used[i]->node, &rinfo->grants);
+			rinfo->persistent_gnts_c++;
+			s->grants_used[i]->last_used = jiffies;
 		} else {
 			/*
 			 * If the grant is not mapped by the backend we end the
@@ -1801,8 +2317,10 @@ static void blkif_completion(struct blk_shadow *s, struct blkfront_info *info,
 			 */
 			gnttab_end_foreign_access(s->grants_used[i]->gref, 0UL);
 			s->grants_used[i]->gref = GRANT_INVALID_REF;
-			list_add_tail(&s->grants_used[i]->node, &info->grants);
+			list_add_tail(&s->grants_used[i]->node, &rinfo->grants);
+			s->grants_used[i]->last_used = jiffies;
 		}
+		rinfo->grants_c++;
 	}
 	if (s->req.operation == BLKIF_OP_INDIRECT) {
 		for (i = 0; i < INDIRECT_GREFS(nseg); i++) {
@@ -1810,8 +2328,9 @@ static void blkif_completion(struct blk_shadow *s, struct blkfront_info *info,
 				if (!info->feature_persistent)
 					printk(KERN_WARNING "backed has not unmapped grant: %u\n",
 							s->indirect_grants[i]->gref);
-				list_add(&s->indirect_grants[i]->node, &info->grants);
-				info->persistent_gnts_c++;
+				list_add(&s->indirect_grants[i]->node, &rinfo->grants);
+				rinfo->persistent_gnts_c++;
+				s->indirect_grants[i]->last_used = jiffies;
 			} else {
 				struct page *indirect_page;
 			
@@ -1822,11 +2341,13 @@ static void blkif_completion(struct blk_shadow *s, struct blkfront_info *info,
 				 */
 				if (!info->feature_persistent) {
 				    indirect_page = pfn_to_page(s->indirect_grants[i]->pfn);
-				    list_add(&indirect_page->lru, &info->indirect_pages);
+				    list_add(&indirect_page->lru, &rinfo->indirect_pages);
                 }
                 s->indirect_grants[i]->gref = GRANT_INVALID_REF;
-				list_add_tail(&s->indirect_grants[i]->node, &info->grants);
+				list_add_tail(&s->indirect_grants[i]->node, &rinfo->grants);
+				s->indirect_grants[i]->last_used = jiffies;
 			}
+			rinfo->grants_c++;
 		}
 	}
 }
@@ -1897,12 +2418,9 @@ static void split_bio_end(struct bio *bio, int error)
 	bio_put(bio);
 }
 
-static int blkif_recover(struct blkfront_info *info,
-			 unsigned int old_ring_size,
-			 unsigned int ring_size)
+static int blkif_recover(struct blkfront_info *info)
 {
 	unsigned int i;
-	struct request *req, *n;
 	unsigned int segs;
 	int rc;
 	struct bio *bio, *cloned_bio;
@@ -1910,39 +2428,13 @@ static int blkif_recover(struct blkfront_info *info,
 	unsigned int offset;
 	int pending, size;
 	struct split_bio *split_bio;
-	struct list_head requests;
-	
 	struct blk_resume_entry *ent = NULL;
-	LIST_HEAD(list);
 
-	//WARN_ON(1); 
-	/* Stage 1: Make a safe copy of the shadow state. */
-	for (i = 0; i < old_ring_size; i++) {
-		/* Not in use? */
-		if (!info->shadow[i].request)
-			continue;
-		ent = kmalloc(sizeof(*ent),
-			      GFP_NOIO | __GFP_NOFAIL | __GFP_HIGH);
-		if (!ent)
-			break;
-		ent->copy = info->shadow[i];
-		list_add_tail(&ent->list, &list);
-	}
-	if (i < old_ring_size) {
-		while (!list_empty(&list)) {
-			ent = list_first_entry(&list, struct blk_resume_entry,
-					       list);
-			__list_del_entry(&ent->list);
-			kfree(ent);
-		}
-		return -ENOMEM;
-	}
-	list_splice_tail(&list, &info->resume_list);
-
-	/* Stage 2: Set up free list. */
-	memset(&info->shadow, 0, sizeof(info->shadow));
-	shadow_init(info->shadow, ring_size);
-	info->shadow_free = info->ring.req_prod_pvt;	
+	/*
+	 * Stage 1 (saving the shadow state) was done in blkfront_resume()
+	 * before the old rings were torn down; stage 2 (the free lists) in
+	 * talk_to_backend() once the new rings were set up.
+	 */
 	rc = blkfront_setup_indirect(info);
 	if (rc) {
 		while (!list_empty(&info->resume_list)) {
@@ -1956,13 +2448,16 @@ static int blkif_recover(struct blkfront_info *info,
 
 	segs = info->max_indirect_segments ? : BLKIF_MAX_SEGMENTS_PER_REQUEST;
 	blk_queue_max_segments(info->rq, segs);
+	blk_queue_max_hw_sectors(info->rq, segs * (PAGE_SIZE >> 9));
+	info->rq->limits.max_sectors = queue_max_hw_sectors(info->rq);
 
 	bio_list_init(&bio_list);
-	INIT_LIST_HEAD(&requests);
 
-	/* Recover stage 3: Re-queue pending requests. */
-	while (!list_empty(&info->resume_list) && !RING_FULL(&info->ring)) {
-		/* Grab a request slot and copy shadow state into it. */
+	/*
+	 * Recover stage 3: Complete the saved requests and collect their
+	 * bios, which get resubmitted below against the new segment limit.
+	 */
+	while (!list_empty(&info->resume_list)) {
 		ent = list_first_entry(&info->resume_list,
 					 struct blk_resume_entry, list);
 
@@ -1970,55 +2465,21 @@ static int blkif_recover(struct blkfront_info *info,
 		merge_bio.tail = ent->copy.request->biotail;
 		bio_list_merge(&bio_list, &merge_bio);
 		ent->copy.request->bio = NULL;
-		//blk_put_request(ent->copy.request);
-                blk_end_request_all(ent->copy.request, 0);
+		blk_end_request_all(ent->copy.request, 0);
 
 		__list_del_entry(&ent->list);
 		kfree(ent);
 	}
 
-	/*
-	 * Empty the queue, this is important because we might have
-	 * requests in the queue with more segments than what we
-	 * can handle now.
-	 */
-	spin_lock_irq(&info->io_lock);
-	while ((req = blk_fetch_request(info->rq)) != NULL) {
-		merge_bio.head = req->bio;
-		merge_bio.tail = req->biotail;
-		bio_list_merge(&bio_list, &merge_bio);
-		req->bio = NULL;
-		if (req->cmd_flags & (REQ_FLUSH | REQ_FUA))
-			pr_alert("diskcache flush request found!\n");
-		//__blk_put_request(info->rq, req);
-                __blk_end_request_all(req, 0);    
-	}
-	spin_unlock_irq(&info->io_lock);
-
 	(void)xenbus_switch_state(info->xbdev, XenbusStateConnected);
 
-	spin_lock_irq(&info->io_lock);
-
-	/* Now safe for us to use the shared ring */
+	/* Now safe for us to use the shared rings */
 	info->connected = BLKIF_STATE_CONNECTED;
 
 	/* Kick any other new requests queued since we resumed */
-	//kick_pending_request_queues(info);
-	if (!RING_FULL(&info->ring)) {
-		/* Re-enable calldowns. */
-		blk_start_queue(info->rq);
-		/* Kick things off immediately. */
-		do_blkif_request(info->rq);
-	}
-
-	list_for_each_entry_safe(req, n, &requests, queuelist) {
-		/* Requeue pending requests (flush or discard) */
-		list_del_init(&req->queuelist);
-		BUG_ON(req->nr_phys_segments > segs);
-		blk_requeue_request(info->rq, req);
-	}
-
-	spin_unlock_irq(&info->io_lock);
+	for (i = 0; i < info->nr_rings; i++)
+		kick_pending_request_queues(&info->rinfo[i]);
+	blkfront_schedule_purge(info);
 
 	while ((bio = bio_list_pop(&bio_list)) != NULL) {
 		/* Traverse the list of pending bios and re-queue them */
@@ -2092,6 +2553,9 @@ static int __init xlblk_init(void)
 	if (!is_running_on_xen())
 		return -ENODEV;
 
+	if (xen_blkif_max_queues == 0)
+		xen_blkif_max_queues = num_online_cpus();
+
 	return xenbus_register_frontend(&blkfront_driver);
 }
 module_init(xlblk_init);
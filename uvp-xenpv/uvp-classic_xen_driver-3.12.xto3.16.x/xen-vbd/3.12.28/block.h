@@ -45,6 +45,8 @@
 #include <linux/fs.h>
 #include <linux/hdreg.h>
 #include <linux/blkdev.h>
+#include <linux/blk-iopoll.h>
+#include <linux/hrtimer.h>
 #include <linux/major.h>
 #include <linux/mutex.h>
 #include <asm/hypervisor.h>
@@ -76,6 +78,7 @@ struct grant {
     grant_ref_t gref;
     unsigned long pfn;
     struct list_head node;
+    unsigned long last_used;	/* jiffies when last put back on the list */
 };
 
 struct blk_shadow {
@@ -97,13 +100,10 @@ struct split_bio {
 
 /*
  * Maximum number of segments in indirect requests, the actual value used by
- * the frontend driver is the minimum of this value and the value provided
- * by the backend driver.
+ * the frontend driver is the minimum of this value (or the device's max_seg
+ * sysfs override) and the value provided by the backend driver.
  */
-
-static unsigned int xen_blkif_max_segments = 256;
-//module_param_named(max_seg, xen_blkif_max_segments, int, S_IRUGO);
-//MODULE_PARM_DESC(max_seg, "Maximum amount of segments in indirect requests (default is 256 (1M))");
+extern unsigned int xen_blkif_max_segments;
 
 #define BLK_MAX_RING_PAGE_ORDER 4U
 #define BLK_MAX_RING_PAGES (1U << BLK_MAX_RING_PAGE_ORDER)
@@ -114,8 +114,57 @@ static unsigned int xen_blkif_max_segments = 256;
     (PAGE_SIZE/sizeof(struct blkif_request_segment_aligned))
 #define INDIRECT_GREFS(_segs) \
     ((_segs + SEGS_PER_INDIRECT_FRAME - 1)/SEGS_PER_INDIRECT_FRAME)
+#define BLKIF_MAX_INDIRECT_SEGMENTS \
+    (BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST * SEGS_PER_INDIRECT_FRAME)
+
+/* Completion interrupt moderation, see blkif_rearm_event(). */
+#define BLKIF_COALESCE_USECS		20
+#define BLKIF_COALESCE_FRAMES		16
+#define BLKIF_MAX_COALESCE_USECS	1000
 
 
+struct blkfront_info;
+
+/*
+ * Per-ring state.  do_blkif_request() feeds the ring of the submitting
+ * CPU; each ring owns its shared ring, event channel, shadow array and the
+ * grants handed out for requests on that ring, all protected by
+ * ring_lock.  Responses are consumed from iopoll in softirq context, so
+ * ring_lock is never taken in hard IRQ context.
+ */
+struct blkfront_ring_info
+{
+	spinlock_t ring_lock;
+	blkif_front_ring_t ring;
+	unsigned int irq;
+	struct blk_iopoll iopoll;
+	struct hrtimer coalesce_timer;
+	unsigned int event_frames;
+	bool coalesce_expired;
+	struct delayed_work work;
+	struct gnttab_free_callback callback;
+	struct blk_shadow shadow[BLK_MAX_RING_SIZE];
+	grant_ref_t ring_refs[BLK_MAX_RING_PAGES];
+	struct page *ring_pages[BLK_MAX_RING_PAGES];
+	/*
+	 * Pool of grant entries, starting at one request's worth and grown
+	 * on demand up to grants_max; blkfront_purge_grants() reclaims idle
+	 * ones.  grants_c are on the list, grants_total exist in all.
+	 */
+	struct list_head grants;
+	struct list_head indirect_pages;
+	unsigned int persistent_gnts_c;
+	unsigned int grants_c;
+	unsigned int grants_total;
+	unsigned int grants_max;
+	unsigned int grants_wanted;
+	unsigned long pgrant_hits;
+	unsigned long pgrant_misses;
+	unsigned long pgrant_purged;
+	unsigned long shadow_free;
+	struct blkfront_info *dev_info;
+};
+
 /*
  * We have one of these per vbd, whether ide, scsi or 'other'.  They
  * hang in private_data off the gendisk structure. We may end up
@@ -130,29 +179,23 @@ struct blkfront_info
 	blkif_vdev_t handle;
 	int connected;
 	unsigned int ring_size;
-	blkif_front_ring_t ring;
-	spinlock_t io_lock;
-	/* move sg to blk_shadow struct */
-	//struct scatterlist *sg;
-	unsigned int irq;
 	struct xlbd_major_info *mi;
 	struct request_queue *rq;
-	struct work_struct work;
-	struct gnttab_free_callback callback;
-	struct blk_shadow shadow[BLK_MAX_RING_SIZE];
+	spinlock_t io_lock;	/* queue lock, nests outside ring_lock */
+	struct blkfront_ring_info *rinfo;
+	unsigned int nr_rings;
 	struct list_head resume_list;
-	grant_ref_t ring_refs[BLK_MAX_RING_PAGES];
-	struct page *ring_pages[BLK_MAX_RING_PAGES];
-	struct list_head grants;
-	struct list_head indirect_pages;
 	unsigned int max_indirect_segments;
-	unsigned long shadow_free;
+	unsigned int max_seg;	/* for the next connect, 0: xen_blkif_max_segments */
 	unsigned int feature_flush;
 	unsigned int flush_op;
 	bool feature_discard;
 	bool feature_secdiscard;
-	unsigned int persistent_gnts_c;
 	unsigned int feature_persistent:1;
+	struct delayed_work purge_work;
+	unsigned int coalesce_usecs;	/* 0: an event per response */
+	unsigned int coalesce_frames;
+	bool coalesce_adaptive;
 	unsigned int discard_granularity;
 	unsigned int discard_alignment;
 	int is_ready;
@@ -177,7 +220,7 @@ extern int blkif_ioctl(struct block_device *bdev, fmode_t mode,
 extern int blkif_getgeo(struct block_device *, struct hd_geometry *);
 extern int blkif_check(dev_t dev);
 extern int blkif_revalidate(dev_t dev);
-extern void do_blkif_request (struct request_queue *rq);
+extern void do_blkif_request(struct request_queue *rq);
 
 /* Virtual block-device subsystem. */
 /* Note that xlvbd_add doesn't call add_disk for you: you're expected
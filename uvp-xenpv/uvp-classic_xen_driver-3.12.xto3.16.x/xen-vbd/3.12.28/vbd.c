@@ -364,6 +364,8 @@ xlvbd_init_blk_queue(struct gendisk *gd, u16 sector_size,
 	if (rq == NULL)
 		return -1;
 
+	rq->queuedata = info;
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
 	queue_flag_set_unlocked(QUEUE_FLAG_VIRT, rq);
 #endif
@@ -379,7 +381,9 @@ xlvbd_init_blk_queue(struct gendisk *gd, u16 sector_size,
 
 	/* Hard sector size and max sectors impersonate the equiv. hardware. */
 	blk_queue_logical_block_size(rq, sector_size);
-	blk_queue_max_hw_sectors(rq, segments*8);
+	blk_queue_max_hw_sectors(rq, segments * (PAGE_SIZE >> 9));
+	/* Don't let BLK_DEF_MAX_SECTORS split what fits one ring request. */
+	rq->limits.max_sectors = queue_max_hw_sectors(rq);
 
 	/* Each segment in a request is up to an aligned page in size. */
 	blk_queue_segment_boundary(rq, PAGE_SIZE - 1);
@@ -591,8 +595,152 @@ static ssize_t show_media(struct device *dev,
 	return sprintf(buf, "disk\n");
 }
 
+/* Persistent grant pool counters, summed over the device's rings. */
+enum { PGRANT_POOL_SIZE, PGRANT_POOL_MAX, PGRANT_HITS, PGRANT_MISSES,
+       PGRANT_PURGED };
+
+static unsigned long pgrant_stat(struct blkfront_info *info, int which)
+{
+	unsigned long sum = 0;
+	unsigned int i;
+
+	/* blkif_free() frees the rings under info->mutex. */
+	mutex_lock(&info->mutex);
+	for (i = 0; i < info->nr_rings; i++) {
+		struct blkfront_ring_info *rinfo = &info->rinfo[i];
+
+		switch (which) {
+		case PGRANT_POOL_SIZE:	sum += rinfo->grants_total; break;
+		case PGRANT_POOL_MAX:	sum += rinfo->grants_max; break;
+		case PGRANT_HITS:	sum += rinfo->pgrant_hits; break;
+		case PGRANT_MISSES:	sum += rinfo->pgrant_misses; break;
+		case PGRANT_PURGED:	sum += rinfo->pgrant_purged; break;
+		}
+	}
+	mutex_unlock(&info->mutex);
+	return sum;
+}
+
+#define PGRANT_ATTR(name, which)					\
+static ssize_t show_##name(struct device *dev,				\
+			   struct device_attribute *attr, char *buf)	\
+{									\
+	struct blkfront_info *info = dev_get_drvdata(dev);		\
+									\
+	return sprintf(buf, "%lu\n", pgrant_stat(info, which));	\
+}
+PGRANT_ATTR(pgrant_pool_size, PGRANT_POOL_SIZE)
+PGRANT_ATTR(pgrant_pool_max, PGRANT_POOL_MAX)
+PGRANT_ATTR(pgrant_hits, PGRANT_HITS)
+PGRANT_ATTR(pgrant_misses, PGRANT_MISSES)
+PGRANT_ATTR(pgrant_purged, PGRANT_PURGED)
+
+static ssize_t show_pgrant_hit_rate(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct blkfront_info *info = dev_get_drvdata(dev);
+	unsigned long hits = pgrant_stat(info, PGRANT_HITS);
+	unsigned long total = hits + pgrant_stat(info, PGRANT_MISSES);
+
+	/* Percentage of segments served by an already granted page. */
+	return sprintf(buf, "%lu\n", total ? hits * 100 / total : 0);
+}
+
+static ssize_t show_max_seg(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct blkfront_info *info = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", info->max_seg ? : xen_blkif_max_segments);
+}
+
+/*
+ * Segments per request to ask for at the next connect (e.g. after
+ * migration); 0 goes back to the max_seg module parameter.  The backend's
+ * feature-max-indirect-segments still caps it.
+ */
+static ssize_t store_max_seg(struct device *dev,
+			     struct device_attribute *attr,
+			     const char *buf, size_t len)
+{
+	struct blkfront_info *info = dev_get_drvdata(dev);
+	char *endp;
+	unsigned long segs;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	segs = simple_strtoul(buf, &endp, 0);
+	if (endp == buf)
+		return -EBADMSG;
+	if (segs > BLKIF_MAX_INDIRECT_SEGMENTS)
+		return -EINVAL;
+
+	info->max_seg = segs;
+	return len;
+}
+
+static ssize_t show_indirect_segs(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct blkfront_info *info = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", info->max_indirect_segments);
+}
+
+/*
+ * Completion interrupt moderation, applied when each ring next re-arms
+ * its event.  coalesce_usecs 0 asks for an event per response.
+ */
+#define COALESCE_ATTR(name, max)					\
+static ssize_t show_##name(struct device *dev,				\
+			   struct device_attribute *attr, char *buf)	\
+{									\
+	struct blkfront_info *info = dev_get_drvdata(dev);		\
+									\
+	return sprintf(buf, "%u\n", info->name);			\
+}									\
+									\
+static ssize_t store_##name(struct device *dev,			\
+			    struct device_attribute *attr,		\
+			    const char *buf, size_t len)		\
+{									\
+	struct blkfront_info *info = dev_get_drvdata(dev);		\
+	char *endp;							\
+	unsigned long val;						\
+									\
+	if (!capable(CAP_SYS_ADMIN))					\
+		return -EPERM;						\
+									\
+	val = simple_strtoul(buf, &endp, 0);				\
+	if (endp == buf)						\
+		return -EBADMSG;					\
+	if (val > (max))						\
+		return -EINVAL;						\
+									\
+	info->name = val;						\
+	return len;							\
+}
+COALESCE_ATTR(coalesce_usecs, BLKIF_MAX_COALESCE_USECS)
+COALESCE_ATTR(coalesce_frames, BLK_MAX_RING_SIZE)
+COALESCE_ATTR(coalesce_adaptive, 1)
+
 static struct device_attribute xlvbd_attrs[] = {
 	__ATTR(media, S_IRUGO, show_media, NULL),
+	__ATTR(max_seg, S_IRUGO|S_IWUSR, show_max_seg, store_max_seg),
+	__ATTR(indirect_segs, S_IRUGO, show_indirect_segs, NULL),
+	__ATTR(pgrant_pool_size, S_IRUGO, show_pgrant_pool_size, NULL),
+	__ATTR(pgrant_pool_max, S_IRUGO, show_pgrant_pool_max, NULL),
+	__ATTR(pgrant_hits, S_IRUGO, show_pgrant_hits, NULL),
+	__ATTR(pgrant_misses, S_IRUGO, show_pgrant_misses, NULL),
+	__ATTR(pgrant_hit_rate, S_IRUGO, show_pgrant_hit_rate, NULL),
+	__ATTR(pgrant_purged, S_IRUGO, show_pgrant_purged, NULL),
+	__ATTR(coalesce_usecs, S_IRUGO|S_IWUSR,
+	       show_coalesce_usecs, store_coalesce_usecs),
+	__ATTR(coalesce_frames, S_IRUGO|S_IWUSR,
+	       show_coalesce_frames, store_coalesce_frames),
+	__ATTR(coalesce_adaptive, S_IRUGO|S_IWUSR,
+	       show_coalesce_adaptive, store_coalesce_adaptive),
 };
 
 int xlvbd_sysfs_addif(struct blkfront_info *info)
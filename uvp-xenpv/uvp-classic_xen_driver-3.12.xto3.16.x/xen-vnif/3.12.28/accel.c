@@ -319,11 +319,13 @@ accelerator_set_vif_state_hooks(struct netfront_accel_vif_state *vif_state)
 {
 	struct netfront_accelerator *accelerator;
 	unsigned long flags;
+	unsigned int i;
 
 	DPRINTK("%p\n",vif_state);
 
 	/* Make sure there are no data path operations going on */
-	napi_disable(&vif_state->np->napi);
+	for (i = 0; i < vif_state->np->num_queues; i++)
+		napi_disable(&vif_state->np->queues[i].napi);
 	netif_tx_lock_bh(vif_state->np->netdev);
 
 	accelerator = vif_state->np->accelerator;
@@ -332,7 +334,8 @@ accelerator_set_vif_state_hooks(struct netfront_accel_vif_state *vif_state)
 	spin_unlock_irqrestore(&accelerator->vif_states_lock, flags);
 
 	netif_tx_unlock_bh(vif_state->np->netdev);
-	napi_enable(&vif_state->np->napi);
+	for (i = 0; i < vif_state->np->num_queues; i++)
+		napi_enable(&vif_state->np->queues[i].napi);
 }
 
 
@@ -504,9 +507,11 @@ accelerator_remove_single_hook(struct netfront_accelerator *accelerator,
 			       struct netfront_accel_vif_state *vif_state)
 {
 	unsigned long flags;
+	unsigned int i;
 
 	/* Make sure there are no data path operations going on */
-	napi_disable(&vif_state->np->napi);
+	for (i = 0; i < vif_state->np->num_queues; i++)
+		napi_disable(&vif_state->np->queues[i].napi);
 	netif_tx_lock_bh(vif_state->np->netdev);
 
 	spin_lock_irqsave(&accelerator->vif_states_lock, flags);
@@ -522,7 +527,8 @@ accelerator_remove_single_hook(struct netfront_accelerator *accelerator,
 	spin_unlock_irqrestore(&accelerator->vif_states_lock, flags);
 
 	netif_tx_unlock_bh(vif_state->np->netdev);
-	napi_enable(&vif_state->np->napi);
+	for (i = 0; i < vif_state->np->num_queues; i++)
+		napi_enable(&vif_state->np->queues[i].napi);
 }
 
 
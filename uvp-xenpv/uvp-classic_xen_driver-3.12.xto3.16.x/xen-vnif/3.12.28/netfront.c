@@ -34,6 +34,8 @@
 #include <linux/version.h>
 #include <linux/kernel.h>
 #include <linux/pfn.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
 #include <linux/sched.h>
 #include <net/arp.h>
 #include <linux/slab.h>
@@ -55,6 +57,7 @@
 #include <net/pkt_sched.h>
 #include <net/route.h>
 #include <net/tcp.h>
+#include <net/busy_poll.h>
 #include <asm/uaccess.h>
 #include <xen/evtchn.h>
 #include <xen/xenbus.h>
@@ -73,6 +76,8 @@
 
 struct netfront_cb {
 	unsigned int pull_to;
+	struct netfront_pgrant *pgrant; /* posted RX buffer's persistent grant */
+	unsigned short tx_head;	/* TX id of the slot carrying the header */
 };
 
 #define NETFRONT_SKB_CB(skb)	((struct netfront_cb *)((skb)->cb))
@@ -111,6 +116,36 @@ MODULE_PARM_DESC(rx_flip, "Flip packets from network card (rather than copy)");
 # define MODPARM_rx_flip false
 #endif
 
+/*
+ * Upper bound on the number of TX/RX queue pairs negotiated with the
+ * backend.  Defaults to the number of online CPUs at load time; the
+ * actual count is min(max_queues, backend's multi-queue-max-queues).
+ */
+static unsigned int xennet_max_queues;
+module_param_named(max_queues, xennet_max_queues, uint, 0644);
+MODULE_PARM_DESC(max_queues,
+		 "Maximum number of queues per virtual interface");
+
+/*
+ * Upper bound on the shared ring size, as a page order; the order used
+ * is min(max_ring_page_order, backend's max-ring-page-order).  Single
+ * page rings unless the admin asks for more, up to
+ * XENNET_MAX_RING_PAGE_ORDER.
+ */
+static unsigned int xennet_max_ring_page_order;
+module_param_named(max_ring_page_order, xennet_max_ring_page_order, uint, 0644);
+MODULE_PARM_DESC(max_ring_page_order,
+		 "Maximum order of pages in each TX/RX shared ring");
+
+/*
+ * Copy packet data through persistently granted pages when the backend
+ * offers feature-persistent.  Only used with a copying receiver.
+ */
+static bool xennet_persistent_grants = true;
+module_param_named(feature_persistent, xennet_persistent_grants, bool, 0644);
+MODULE_PARM_DESC(feature_persistent,
+		 "Use persistent grants for packet data if the backend supports them");
+
 #define RX_COPY_THRESHOLD 256
 #define DEFAULT_DEBUG_LEVEL_SHIFT 3
 
@@ -199,26 +234,26 @@ static inline unsigned short get_id_from_freelist(struct sk_buff **list)
 	return id;
 }
 
-static inline int xennet_rxidx(RING_IDX idx)
+static inline int xennet_rxidx(struct netfront_queue *queue, RING_IDX idx)
 {
-	return idx & (NET_RX_RING_SIZE - 1);
+	return idx & (queue->rx_ring_size - 1);
 }
 
-static inline struct sk_buff *xennet_get_rx_skb(struct netfront_info *np,
+static inline struct sk_buff *xennet_get_rx_skb(struct netfront_queue *queue,
 						RING_IDX ri)
 {
-	int i = xennet_rxidx(ri);
-	struct sk_buff *skb = np->rx_skbs[i];
-	np->rx_skbs[i] = NULL;
+	int i = xennet_rxidx(queue, ri);
+	struct sk_buff *skb = queue->rx_skbs[i];
+	queue->rx_skbs[i] = NULL;
 	return skb;
 }
 
-static inline grant_ref_t xennet_get_rx_ref(struct netfront_info *np,
+static inline grant_ref_t xennet_get_rx_ref(struct netfront_queue *queue,
 					    RING_IDX ri)
 {
-	int i = xennet_rxidx(ri);
-	grant_ref_t ref = np->grant_rx_ref[i];
-	np->grant_rx_ref[i] = GRANT_INVALID_REF;
+	int i = xennet_rxidx(queue, ri);
+	grant_ref_t ref = queue->grant_rx_ref[i];
+	queue->grant_rx_ref[i] = GRANT_INVALID_REF;
 	return ref;
 }
 
@@ -226,16 +261,16 @@ static inline grant_ref_t xennet_get_rx_ref(struct netfront_info *np,
 	pr_debug("netfront (%s:%d) " fmt,		\
 		 __FUNCTION__, __LINE__, ##args)
 
-static int setup_device(struct xenbus_device *, struct netfront_info *);
+static int setup_device(struct xenbus_device *, struct netfront_queue *);
 static struct net_device *create_netdev(struct xenbus_device *);
 
-static void end_access(int, void *);
-static void netif_release_rings(struct netfront_info *);
+static void netif_release_rings(struct netfront_queue *);
 static void netif_disconnect_backend(struct netfront_info *);
+static void xennet_destroy_queues(struct netfront_info *);
 
 static int network_connect(struct net_device *);
-static void network_tx_buf_gc(struct net_device *);
-static void network_alloc_rx_buffers(struct net_device *);
+static void network_tx_buf_gc(struct netfront_queue *);
+static void network_alloc_rx_buffers(struct netfront_queue *);
 
 static irqreturn_t netif_int(int irq, void *dev_id);
 static void send_fake_arp(struct net_device *, int arpType);
@@ -397,8 +432,6 @@ static int netfront_remove(struct xenbus_device *dev)
 
 	netif_disconnect_backend(info);
 
-	del_timer_sync(&info->rx_refill_timer);
-
 	xennet_sysfs_delif(info->netdev);
 
 	unregister_netdev(info->netdev);
@@ -465,12 +498,82 @@ static int xen_net_read_mac(struct xenbus_device *dev, u8 mac[])
 	return 0;
 }
 
+/*
+ * Write the ring references and event channel of one queue.  With a
+ * single queue the keys go directly under the frontend node, as they
+ * always have; otherwise each queue gets its own "queue-N" subdirectory.
+ */
+static int write_queue_xenstore_keys(struct netfront_queue *queue,
+				     struct xenbus_transaction *xbt,
+				     int write_hierarchical,
+				     const char **message)
+{
+	struct xenbus_device *dev = queue->info->xbdev;
+	const char *node = dev->nodename;
+	char *path = NULL;
+	int err;
+
+	if (write_hierarchical) {
+		path = kasprintf(GFP_KERNEL, "%s/queue-%u",
+				 dev->nodename, queue->id);
+		if (!path) {
+			*message = "allocating queue path";
+			return -ENOMEM;
+		}
+		node = path;
+	}
+
+	if (!queue->info->ring_page_order) {
+		err = xenbus_printf(*xbt, node, "tx-ring-ref", "%u",
+				    queue->tx_ring_refs[0]);
+		if (err) {
+			*message = "writing tx ring-ref";
+			goto out;
+		}
+		err = xenbus_printf(*xbt, node, "rx-ring-ref", "%u",
+				    queue->rx_ring_refs[0]);
+		if (err) {
+			*message = "writing rx ring-ref";
+			goto out;
+		}
+	} else {
+		unsigned int i, nr = 1U << queue->info->ring_page_order;
+		char key[16];
+
+		for (i = 0; i < nr; i++) {
+			snprintf(key, sizeof(key), "tx-ring-ref%u", i);
+			err = xenbus_printf(*xbt, node, key, "%u",
+					    queue->tx_ring_refs[i]);
+			if (err) {
+				*message = "writing tx ring-ref";
+				goto out;
+			}
+			snprintf(key, sizeof(key), "rx-ring-ref%u", i);
+			err = xenbus_printf(*xbt, node, key, "%u",
+					    queue->rx_ring_refs[i]);
+			if (err) {
+				*message = "writing rx ring-ref";
+				goto out;
+			}
+		}
+	}
+	err = xenbus_printf(*xbt, node, "event-channel", "%u",
+			    irq_to_evtchn_port(queue->irq));
+	if (err)
+		*message = "writing event-channel";
+
+ out:
+	kfree(path);
+	return err;
+}
+
 /* Common code used when first setting up, and when resuming. */
 static int talk_to_backend(struct xenbus_device *dev,
 			   struct netfront_info *info)
 {
 	const char *message;
 	struct xenbus_transaction xbt;
+	unsigned int i;
 	int err;
 
 	/* Read mac only in the first setup. */
@@ -483,10 +586,14 @@ static int talk_to_backend(struct xenbus_device *dev,
 		}
 	}
 
-	/* Create shared ring, alloc event channel. */
-	err = setup_device(dev, info);
-	if (err)
-		goto out;
+	memcpy(info->netdev->dev_addr, info->mac, ETH_ALEN);
+
+	/* Create shared rings, alloc event channels. */
+	for (i = 0; i < info->num_queues; i++) {
+		err = setup_device(dev, &info->queues[i]);
+		if (err)
+			goto release_rings;
+	}
 
 	/* This will load an accelerator if one is configured when the
 	 * watch fires */
@@ -499,24 +606,35 @@ again:
 		goto destroy_ring;
 	}
 
-	err = xenbus_printf(xbt, dev->nodename, "tx-ring-ref","%u",
-			    info->tx_ring_ref);
-	if (err) {
-		message = "writing tx ring-ref";
-		goto abort_transaction;
-	}
-	err = xenbus_printf(xbt, dev->nodename, "rx-ring-ref","%u",
-			    info->rx_ring_ref);
-	if (err) {
-		message = "writing rx ring-ref";
-		goto abort_transaction;
+	if (info->ring_page_order) {
+		err = xenbus_printf(xbt, dev->nodename, "ring-page-order",
+				    "%u", info->ring_page_order);
+		if (err) {
+			message = "writing ring-page-order";
+			goto abort_transaction;
+		}
 	}
-	err = xenbus_printf(xbt, dev->nodename,
-			    "event-channel", "%u",
-			    irq_to_evtchn_port(info->irq));
-	if (err) {
-		message = "writing event-channel";
-		goto abort_transaction;
+
+	if (info->num_queues == 1) {
+		err = write_queue_xenstore_keys(&info->queues[0], &xbt,
+						0, &message);
+		if (err)
+			goto abort_transaction;
+	} else {
+		err = xenbus_printf(xbt, dev->nodename,
+				    "multi-queue-num-queues", "%u",
+				    info->num_queues);
+		if (err) {
+			message = "writing multi-queue-num-queues";
+			goto abort_transaction;
+		}
+
+		for (i = 0; i < info->num_queues; i++) {
+			err = write_queue_xenstore_keys(&info->queues[i], &xbt,
+							1, &message);
+			if (err)
+				goto abort_transaction;
+		}
 	}
 
 	err = xenbus_printf(xbt, dev->nodename, "request-rx-copy", "%u",
@@ -526,6 +644,13 @@ again:
 		goto abort_transaction;
 	}
 
+	err = xenbus_printf(xbt, dev->nodename, "feature-persistent", "%u",
+			    info->persistent_grants);
+	if (err) {
+		message = "writing feature-persistent";
+		goto abort_transaction;
+	}
+
 	err = xenbus_write(xbt, dev->nodename, "feature-rx-notify", "1");
 	if (err) {
 		message = "writing feature-rx-notify";
@@ -538,7 +663,6 @@ again:
 		message = "writing feature-no-csum-offload";
 		goto abort_transaction;
 	}
-#ifdef OPENSUSE_1302 
 #ifdef NETIF_F_IPV6_CSUM
 	err = xenbus_write(xbt, dev->nodename, "feature-ipv6-csum-offload",
 			   "1");
@@ -548,7 +672,6 @@ again:
 	}
 #else
 #define NETIF_F_IPV6_CSUM 0
-#endif
 #endif
 	err = xenbus_write(xbt, dev->nodename, "feature-sg", "1");
 	if (err) {
@@ -562,16 +685,15 @@ again:
 		message = "writing feature-gso-tcpv4";
 		goto abort_transaction;
 	}
-#ifdef OPENSUSE_1302
 #ifdef NETIF_F_TSO6
-	err = xenbus_write(xbt, dev->nodename, "feature-gso-tcpv6", "1");
+	err = xenbus_write(xbt, dev->nodename, "feature-gso-tcpv6",
+			   __stringify(HAVE_GSO));
 	if (err) {
 		message = "writing feature-gso-tcpv6";
 		goto abort_transaction;
 	}
 #else
 #define NETIF_F_TSO6 0
-#endif
 #endif
 	err = xenbus_transaction_end(xbt, 0);
 	if (err) {
@@ -588,68 +710,96 @@ again:
 	xenbus_dev_fatal(dev, err, "%s", message);
  destroy_ring:
 	netfront_accelerator_call_remove(info, dev);
+ release_rings:
 	netif_disconnect_backend(info);
  out:
 	return err;
 }
 
-static int setup_device(struct xenbus_device *dev, struct netfront_info *info)
+/*
+ * Allocate and map the @nr pages of a shared ring and grant them to the
+ * backend; the pages and their references are left in @pages and @refs.
+ */
+static void *xennet_alloc_ring(struct xenbus_device *dev, unsigned int nr,
+			       struct page **pages, grant_ref_t *refs,
+			       const char *what)
+{
+	unsigned int i;
+	void *sring;
+	int err;
+
+	for (i = 0; i < nr; i++) {
+		refs[i] = GRANT_INVALID_REF;
+		pages[i] = alloc_page(GFP_NOIO | __GFP_HIGH | __GFP_ZERO);
+		if (!pages[i])
+			break;
+	}
+
+	sring = i == nr ? vmap(pages, nr, VM_MAP, PAGE_KERNEL) : NULL;
+	if (!sring) {
+		while (i--) {
+			__free_page(pages[i]);
+			pages[i] = NULL;
+		}
+		xenbus_dev_fatal(dev, -ENOMEM, "allocating %s ring", what);
+		return NULL;
+	}
+
+	err = xenbus_multi_grant_ring(dev, nr, pages, refs);
+	if (err < 0) {
+		vunmap(sring);
+		gnttab_multi_end_foreign_access(nr, refs, pages);
+		return NULL;
+	}
+
+	return sring;
+}
+
+static int setup_device(struct xenbus_device *dev, struct netfront_queue *queue)
 {
+	unsigned int nr = 1U << queue->info->ring_page_order;
 	struct netif_tx_sring *txs;
 	struct netif_rx_sring *rxs;
 	int err;
-	struct net_device *netdev = info->netdev;
 
-	info->tx_ring_ref = GRANT_INVALID_REF;
-	info->rx_ring_ref = GRANT_INVALID_REF;
-	info->rx.sring = NULL;
-	info->tx.sring = NULL;
-	info->irq = 0;
+	queue->rx.sring = NULL;
+	queue->tx.sring = NULL;
+	queue->irq = 0;
 
-	txs = (struct netif_tx_sring *)get_zeroed_page(GFP_NOIO | __GFP_HIGH);
+	txs = xennet_alloc_ring(dev, nr, queue->tx_ring_pages,
+				queue->tx_ring_refs, "tx");
 	if (!txs) {
 		err = -ENOMEM;
-		xenbus_dev_fatal(dev, err, "allocating tx ring page");
 		goto fail;
 	}
 	SHARED_RING_INIT(txs);
-	FRONT_RING_INIT(&info->tx, txs, PAGE_SIZE);
-
-	err = xenbus_grant_ring(dev, virt_to_mfn(txs));
-	if (err < 0) {
-		free_page((unsigned long)txs);
-		goto fail;
-	}
-	info->tx_ring_ref = err;
+	FRONT_RING_INIT(&queue->tx, txs, (unsigned long)nr << PAGE_SHIFT);
 
-	rxs = (struct netif_rx_sring *)get_zeroed_page(GFP_NOIO | __GFP_HIGH);
+	rxs = xennet_alloc_ring(dev, nr, queue->rx_ring_pages,
+				queue->rx_ring_refs, "rx");
 	if (!rxs) {
 		err = -ENOMEM;
-		xenbus_dev_fatal(dev, err, "allocating rx ring page");
 		goto fail;
 	}
 	SHARED_RING_INIT(rxs);
-	FRONT_RING_INIT(&info->rx, rxs, PAGE_SIZE);
-
-	err = xenbus_grant_ring(dev, virt_to_mfn(rxs));
-	if (err < 0) {
-		free_page((unsigned long)rxs);
-		goto fail;
-	}
-	info->rx_ring_ref = err;
-
-	memcpy(netdev->dev_addr, info->mac, ETH_ALEN);
+	FRONT_RING_INIT(&queue->rx, rxs, (unsigned long)nr << PAGE_SHIFT);
 
 	err = bind_listening_port_to_irqhandler(
-		dev->otherend_id, netif_int, 0, netdev->name, netdev);
+		dev->otherend_id, netif_int, 0, queue->name, queue);
 	if (err < 0)
 		goto fail;
-	info->irq = err;
+	queue->irq = err;
+
+#ifndef CONFIG_XEN
+	/* Spread the queues' completion work over the online CPUs. */
+	if (queue->info->num_queues > 1)
+		rebind_irq_to_cpu(queue->irq, queue->id % num_online_cpus());
+#endif
 
 	return 0;
 
  fail:
-	netif_release_rings(info);
+	netif_release_rings(queue);
 	return err;
 }
 
@@ -741,95 +891,199 @@ static void send_fake_arp(struct net_device *dev, int arpType)
 #endif
 }
 
-static inline int netfront_tx_slot_available(struct netfront_info *np)
+static inline int netfront_tx_slot_available(struct netfront_queue *queue)
 {
-	return ((np->tx.req_prod_pvt - np->tx.rsp_cons) <
-		(TX_MAX_TARGET - MAX_SKB_FRAGS - 2));
+	return ((queue->tx.req_prod_pvt - queue->tx.rsp_cons) <
+		(queue->tx_max_target - MAX_SKB_FRAGS - 2));
 }
 
 
-static inline void network_maybe_wake_tx(struct net_device *dev)
+static inline void network_maybe_wake_tx(struct netfront_queue *queue)
 {
-	struct netfront_info *np = netdev_priv(dev);
+	struct net_device *dev = queue->info->netdev;
+	struct netdev_queue *dev_queue = netdev_get_tx_queue(dev, queue->id);
 
-	if (unlikely(netif_queue_stopped(dev)) &&
-	    netfront_tx_slot_available(np) &&
+	if (unlikely(netif_tx_queue_stopped(dev_queue)) &&
+	    netfront_tx_slot_available(queue) &&
 	    likely(netif_running(dev)) &&
-	    netfront_check_accelerator_queue_ready(dev, np))
-		netif_wake_queue(dev);
+	    netfront_check_accelerator_queue_ready(dev, queue->info))
+		netif_tx_wake_queue(dev_queue);
 }
 
 
+/*
+ * The acceleration plugin only knows about the device as a whole, so it
+ * is tied to the first queue: that is the TX queue it stops and wakes
+ * and the NAPI context whose poll drives its receive path.
+ */
 int netfront_check_queue_ready(struct net_device *dev)
 {
 	struct netfront_info *np = netdev_priv(dev);
 
+	if (!np->num_queues)
+		return 0;
+
 	return unlikely(netif_queue_stopped(dev)) &&
-		netfront_tx_slot_available(np) &&
+		netfront_tx_slot_available(&np->queues[0]) &&
 		likely(netif_running(dev));
 }
 EXPORT_SYMBOL(netfront_check_queue_ready);
 
+static inline void netfront_napi_schedule(struct netfront_queue *queue)
+{
+	if (queue->id == 0)
+		netfront_accelerator_call_stop_napi_irq(queue->info,
+							queue->info->netdev);
+
+	napi_schedule(&queue->napi);
+}
+
+/*
+ * RX interrupt moderation.  Instead of an event for the very next
+ * response, the backend is asked for one after rx_event_frames of
+ * them, with rx_coalesce_timer catching a batch that never fills.
+ * Adaptively, the batch doubles while full batches beat the timer and
+ * halves whenever the timer has to fire, down to one event per
+ * response on a quiet interface.
+ */
+#define XENNET_COALESCE_USECS	20
+#define XENNET_COALESCE_FRAMES	32
+#define XENNET_MAX_COALESCE_USECS 1000
+
+/* Responses one busy-poll call may consume. */
+#define XENNET_BUSY_POLL_BUDGET	8
+
+static enum hrtimer_restart xennet_rx_coalesce_timeout(struct hrtimer *timer)
+{
+	struct netfront_queue *queue =
+		container_of(timer, struct netfront_queue, rx_coalesce_timer);
+
+	queue->rx_coalesce_expired = true;
+	netfront_napi_schedule(queue);
+
+	return HRTIMER_NORESTART;
+}
+
+static void xennet_rx_update_moderation(struct netfront_queue *queue,
+					int work_done)
+{
+	struct netfront_info *np = queue->info;
+	unsigned int frames = queue->rx_event_frames;
+	unsigned int limit = np->rx_coalesce_usecs ?
+			     np->rx_coalesce_frames : 1;
+
+	if (!np->rx_coalesce_adaptive)
+		frames = limit;
+	else if (queue->rx_coalesce_expired)
+		frames = max(frames / 2, 1U);
+	else if (work_done >= max(frames, 2U))
+		frames *= 2;
+	queue->rx_coalesce_expired = false;
+
+	/* Never wait on more than half of the posted buffers. */
+	queue->rx_event_frames = min3(frames, limit,
+				      max(queue->rx_target / 2, 1U));
+}
+
+/* Re-arm the RX event; returns non-zero if polling must go on. */
+static int xennet_rx_final_check(struct netfront_queue *queue)
+{
+	unsigned int frames = queue->rx_event_frames;
+	RING_IDX cons = queue->rx.rsp_cons;
+	int more_to_do;
+
+	if (frames <= 1) {
+		RING_FINAL_CHECK_FOR_RESPONSES(&queue->rx, more_to_do);
+		return more_to_do;
+	}
+
+	queue->rx.sring->rsp_event = cons + frames;
+	mb();
+	/* The backend only notifies when rsp_prod crosses rsp_event. */
+	if (queue->rx.sring->rsp_prod - cons >= frames)
+		return 1;
+
+	hrtimer_start(&queue->rx_coalesce_timer,
+		      ns_to_ktime((u64)queue->info->rx_coalesce_usecs *
+				  NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+	return 0;
+}
+
 static int network_open(struct net_device *dev)
 {
 	struct netfront_info *np = netdev_priv(dev);
+	struct netfront_queue *queue;
+	unsigned int i;
 
-	napi_enable(&np->napi);
+	for (i = 0; i < np->num_queues; i++) {
+		queue = &np->queues[i];
 
-	spin_lock_bh(&np->rx_lock);
-	if (netfront_carrier_ok(np)) {
-		network_alloc_rx_buffers(dev);
-		np->rx.sring->rsp_event = np->rx.rsp_cons + 1;
-		if (RING_HAS_UNCONSUMED_RESPONSES(&np->rx)){
-			netfront_accelerator_call_stop_napi_irq(np, dev);
+		napi_enable(&queue->napi);
 
-			napi_schedule(&np->napi);
+		spin_lock_bh(&queue->rx_lock);
+		if (netfront_carrier_ok(np)) {
+			network_alloc_rx_buffers(queue);
+			queue->rx.sring->rsp_event = queue->rx.rsp_cons + 1;
+			if (RING_HAS_UNCONSUMED_RESPONSES(&queue->rx))
+				netfront_napi_schedule(queue);
 		}
+		spin_unlock_bh(&queue->rx_lock);
 	}
-	spin_unlock_bh(&np->rx_lock);
 
-	netif_start_queue(dev);
+	netif_tx_start_all_queues(dev);
 
 	return 0;
 }
 
-static void network_tx_buf_gc(struct net_device *dev)
+static void network_tx_buf_gc(struct netfront_queue *queue)
 {
 	RING_IDX cons, prod;
 	unsigned short id;
-	struct netfront_info *np = netdev_priv(dev);
 	struct sk_buff *skb;
+	unsigned int pkts_compl = 0, bytes_compl = 0;
 
-	BUG_ON(!netfront_carrier_ok(np));
+	BUG_ON(!netfront_carrier_ok(queue->info));
 
 	do {
-		prod = np->tx.sring->rsp_prod;
+		prod = queue->tx.sring->rsp_prod;
 		rmb(); /* Ensure we see responses up to 'rp'. */
 
-		for (cons = np->tx.rsp_cons; cons != prod; cons++) {
+		for (cons = queue->tx.rsp_cons; cons != prod; cons++) {
 			struct netif_tx_response *txrsp;
 
-			txrsp = RING_GET_RESPONSE(&np->tx, cons);
+			txrsp = RING_GET_RESPONSE(&queue->tx, cons);
 			if (txrsp->status == XEN_NETIF_RSP_NULL)
 				continue;
 
 			id  = txrsp->id;
-			skb = np->tx_skbs[id];
-			if (unlikely(gnttab_query_foreign_access(
-				np->grant_tx_ref[id]) != 0)) {
-				pr_alert("network_tx_buf_gc: grant still"
-					 " in use by backend domain\n");
-				BUG();
+			skb = queue->tx_skbs[id];
+			/* Persistently granted slots stay granted. */
+			if (queue->grant_tx_ref[id] != GRANT_INVALID_REF) {
+				if (unlikely(gnttab_query_foreign_access(
+					queue->grant_tx_ref[id]) != 0)) {
+					pr_alert("network_tx_buf_gc: grant still"
+						 " in use by backend domain\n");
+					BUG();
+				}
+				gnttab_end_foreign_access_ref(
+					queue->grant_tx_ref[id]);
+				gnttab_release_grant_reference(
+					&queue->gref_tx_head,
+					queue->grant_tx_ref[id]);
+				queue->grant_tx_ref[id] = GRANT_INVALID_REF;
 			}
-			gnttab_end_foreign_access_ref(np->grant_tx_ref[id]);
-			gnttab_release_grant_reference(
-				&np->gref_tx_head, np->grant_tx_ref[id]);
-			np->grant_tx_ref[id] = GRANT_INVALID_REF;
-			add_id_to_freelist(np->tx_skbs, id);
+			xennet_tx_unbounce(queue, id);
+			/* Account each packet once, on its header slot. */
+			if (NETFRONT_SKB_CB(skb)->tx_head == id) {
+				pkts_compl++;
+				bytes_compl += skb->len;
+			}
+			add_id_to_freelist(queue->tx_skbs, id);
 			dev_kfree_skb_irq(skb);
 		}
 
-		np->tx.rsp_cons = prod;
+		queue->tx.rsp_cons = prod;
 
 		/*
 		 * Set a new event, then check for race with update of tx_cons.
@@ -839,32 +1093,97 @@ static void network_tx_buf_gc(struct net_device *dev)
 		 * data is outstanding: in such cases notification from Xen is
 		 * likely to be the only kick that we'll get.
 		 */
-		np->tx.sring->rsp_event =
-			prod + ((np->tx.sring->req_prod - prod) >> 1) + 1;
+		queue->tx.sring->rsp_event =
+			prod + ((queue->tx.sring->req_prod - prod) >> 1) + 1;
 		mb();
-	} while ((cons == prod) && (prod != np->tx.sring->rsp_prod));
+	} while ((cons == prod) && (prod != queue->tx.sring->rsp_prod));
 
-	network_maybe_wake_tx(dev);
+	netdev_tx_completed_queue(netdev_get_tx_queue(queue->info->netdev,
+						      queue->id),
+				  pkts_compl, bytes_compl);
+	network_maybe_wake_tx(queue);
 }
 
 static void rx_refill_timeout(unsigned long data)
 {
-	struct net_device *dev = (struct net_device *)data;
-	struct netfront_info *np = netdev_priv(dev);
+	struct netfront_queue *queue = (struct netfront_queue *)data;
+
+	queue->rx_refill_timeouts++;
+	netfront_napi_schedule(queue);
+}
 
-	netfront_accelerator_call_stop_napi_irq(np, dev);
+/* Keep a reference to an RX page going up the stack; rx_lock held. */
+static void xennet_recycle_rx_page(struct netfront_queue *queue,
+				   struct page *page)
+{
+	/* When full, give up on the oldest entry: it is the least likely
+	 * to come back soon. */
+	if (queue->rx_recycle_prod - queue->rx_recycle_cons ==
+	    XENNET_RX_RECYCLE)
+		put_page(queue->rx_recycle[queue->rx_recycle_cons++ %
+					   XENNET_RX_RECYCLE]);
+
+	get_page(page);
+	queue->rx_recycle[queue->rx_recycle_prod++ % XENNET_RX_RECYCLE] = page;
+}
+
+/*
+ * Get a page for an RX buffer, preferring one the stack has finished
+ * with.  Pages mostly come back in the order they went up, so only the
+ * oldest is checked unless the page allocator fails us.
+ */
+static struct page *xennet_alloc_rx_page(struct netfront_queue *queue)
+{
+	unsigned int cons = queue->rx_recycle_cons;
+	unsigned int prod = queue->rx_recycle_prod;
+	struct page *page;
 
-	napi_schedule(&np->napi);
+	if (cons != prod &&
+	    page_count(queue->rx_recycle[cons % XENNET_RX_RECYCLE]) == 1)
+		goto recycle;
+
+	page = alloc_page(GFP_ATOMIC | __GFP_NOWARN);
+	if (likely(page))
+		return page;
+
+	queue->rx_alloc_failures++;
+
+	/* Out of memory: take any page that is free already. */
+	for (; cons != prod; cons++) {
+		page = queue->rx_recycle[cons % XENNET_RX_RECYCLE];
+		if (page_count(page) == 1) {
+			queue->rx_recycle[cons % XENNET_RX_RECYCLE] =
+				queue->rx_recycle[queue->rx_recycle_cons %
+						  XENNET_RX_RECYCLE];
+			queue->rx_recycle[queue->rx_recycle_cons %
+					  XENNET_RX_RECYCLE] = page;
+			goto recycle;
+		}
+	}
+	return NULL;
+
+ recycle:
+	page = queue->rx_recycle[queue->rx_recycle_cons++ % XENNET_RX_RECYCLE];
+	queue->rx_recycle_hits++;
+	return page;
+}
+
+static void xennet_drain_rx_recycle(struct netfront_queue *queue)
+{
+	while (queue->rx_recycle_cons != queue->rx_recycle_prod)
+		put_page(queue->rx_recycle[queue->rx_recycle_cons++ %
+					   XENNET_RX_RECYCLE]);
 }
 
-static void network_alloc_rx_buffers(struct net_device *dev)
+static void network_alloc_rx_buffers(struct netfront_queue *queue)
 {
 	unsigned short id;
-	struct netfront_info *np = netdev_priv(dev);
+	struct netfront_info *np = queue->info;
+	struct net_device *dev = np->netdev;
 	struct sk_buff *skb;
 	struct page *page;
 	int i, batch_target, notify;
-	RING_IDX req_prod = np->rx.req_prod_pvt;
+	RING_IDX req_prod = queue->rx.req_prod_pvt;
 	grant_ref_t ref;
  	unsigned long pfn;
  	void *vaddr;
@@ -880,8 +1199,8 @@ static void network_alloc_rx_buffers(struct net_device *dev)
 	 * allocator, so should reduce the chance of failed allocation requests
 	 * both for ourself and for other kernel subsystems.
 	 */
-	batch_target = np->rx_target - (req_prod - np->rx.rsp_cons);
-	for (i = skb_queue_len(&np->rx_batch); i < batch_target; i++) {
+	batch_target = queue->rx_target - (req_prod - queue->rx.rsp_cons);
+	for (i = skb_queue_len(&queue->rx_batch); i < batch_target; i++) {
 		/*
 		 * Allocate an skb and a page. Do not use __dev_alloc_skb as
 		 * that will allocate page-sized buffers which is not
@@ -890,15 +1209,21 @@ static void network_alloc_rx_buffers(struct net_device *dev)
 		 */
 		skb = alloc_skb(RX_COPY_THRESHOLD + 16 + NET_IP_ALIGN,
 				GFP_ATOMIC | __GFP_NOWARN);
-		if (unlikely(!skb))
+		if (unlikely(!skb)) {
+			queue->rx_alloc_failures++;
 			goto no_skb;
+		}
 
-		page = alloc_page(GFP_ATOMIC | __GFP_NOWARN);
+		/* Flipped pages are given to Xen, so are never recycled. */
+		if (np->copying_receiver)
+			page = xennet_alloc_rx_page(queue);
+		else
+			page = alloc_page(GFP_ATOMIC | __GFP_NOWARN);
 		if (!page) {
 			kfree_skb(skb);
 no_skb:
 			/* Could not allocate enough skbuffs. Try again later. */
-			mod_timer(&np->rx_refill_timer,
+			mod_timer(&queue->rx_refill_timer,
 				  jiffies + (HZ/10));
 
 			/* Any skbuffs queued for refill? Force them out. */
@@ -909,52 +1234,64 @@ no_skb:
 
 		skb_reserve(skb, 16 + NET_IP_ALIGN); /* mimic dev_alloc_skb() */
 		skb_add_rx_frag(skb, 0, page, 0, 0, PAGE_SIZE);
-		__skb_queue_tail(&np->rx_batch, skb);
+		__skb_queue_tail(&queue->rx_batch, skb);
 	}
 
 	/* Is the batch large enough to be worthwhile? */
-	if (i < (np->rx_target/2)) {
-		if (req_prod > np->rx.sring->req_prod)
+	if (i < (queue->rx_target/2)) {
+		if (req_prod > queue->rx.sring->req_prod)
 			goto push;
 		return;
 	}
 
 	/* Adjust our fill target if we risked running out of buffers. */
-	if (((req_prod - np->rx.sring->rsp_prod) < (np->rx_target / 4)) &&
-	    ((np->rx_target *= 2) > np->rx_max_target))
-		np->rx_target = np->rx_max_target;
+	if (((req_prod - queue->rx.sring->rsp_prod) < (queue->rx_target / 4)) &&
+	    ((queue->rx_target *= 2) > queue->rx_max_target))
+		queue->rx_target = queue->rx_max_target;
 
  refill:
 	for (nr_flips = i = 0; ; i++) {
-		if ((skb = __skb_dequeue(&np->rx_batch)) == NULL)
+		if ((skb = __skb_dequeue(&queue->rx_batch)) == NULL)
 			break;
 
 		skb->dev = dev;
 
-		id = xennet_rxidx(req_prod + i);
+		id = xennet_rxidx(queue, req_prod + i);
 
-		BUG_ON(np->rx_skbs[id]);
-		np->rx_skbs[id] = skb;
-
-		ref = gnttab_claim_grant_reference(&np->gref_rx_head);
-		BUG_ON((signed short)ref < 0);
-		np->grant_rx_ref[id] = ref;
+		BUG_ON(queue->rx_skbs[id]);
+		queue->rx_skbs[id] = skb;
 
 		page = skb_frag_page(skb_shinfo(skb)->frags);
 		pfn = page_to_pfn(page);
 		vaddr = page_address(page);
 
-		req = RING_GET_REQUEST(&np->rx, req_prod + i);
+		req = RING_GET_REQUEST(&queue->rx, req_prod + i);
+		if (queue->rx_pgrants) {
+			/* The backend copies into a persistent page instead. */
+			struct netfront_pgrant *pgrant =
+				list_first_entry(&queue->rx_pgrant_free,
+						 struct netfront_pgrant, node);
+
+			list_del(&pgrant->node);
+			NETFRONT_SKB_CB(skb)->pgrant = pgrant;
+			queue->grant_rx_ref[id] = ref = pgrant->gref;
+			goto set_req;
+		}
+
+		ref = gnttab_claim_grant_reference(&queue->gref_rx_head);
+		BUG_ON((signed short)ref < 0);
+		queue->grant_rx_ref[id] = ref;
+
 		if (!np->copying_receiver) {
 			gnttab_grant_foreign_transfer_ref(ref,
 							  np->xbdev->otherend_id,
 							  pfn);
-			np->rx_pfn_array[nr_flips] = pfn_to_mfn(pfn);
+			queue->rx_pfn_array[nr_flips] = pfn_to_mfn(pfn);
 			if (!xen_feature(XENFEAT_auto_translated_physmap)) {
 				/* Remove this page before passing
 				 * back to Xen. */
 				set_phys_to_machine(pfn, INVALID_P2M_ENTRY);
-				MULTI_update_va_mapping(np->rx_mcl+i,
+				MULTI_update_va_mapping(queue->rx_mcl+i,
 							(unsigned long)vaddr,
 							__pte(0), 0);
 			}
@@ -966,6 +1303,7 @@ no_skb:
 							0);
 		}
 
+ set_req:
 		req->id = id;
 		req->gref = ref;
 	}
@@ -980,28 +1318,28 @@ no_skb:
 		balloon_update_driver_allowance(i);
 
 		set_xen_guest_handle(reservation.extent_start,
-				     np->rx_pfn_array);
+				     queue->rx_pfn_array);
 
 		if (!xen_feature(XENFEAT_auto_translated_physmap)) {
 			/* After all PTEs have been zapped, flush the TLB. */
-			np->rx_mcl[i-1].args[MULTI_UVMFLAGS_INDEX] =
+			queue->rx_mcl[i-1].args[MULTI_UVMFLAGS_INDEX] =
 				UVMF_TLB_FLUSH|UVMF_ALL;
 
 			/* Give away a batch of pages. */
-			MULTI_memory_op(np->rx_mcl + i,
+			MULTI_memory_op(queue->rx_mcl + i,
 					XENMEM_decrease_reservation,
 					&reservation);
 
 			/* Zap PTEs and give away pages in one big
 			 * multicall. */
-			if (unlikely(HYPERVISOR_multicall(np->rx_mcl, i+1)))
+			if (unlikely(HYPERVISOR_multicall(queue->rx_mcl, i+1)))
 				BUG();
 
 			/* Check return status of HYPERVISOR_memory_op(). */
-			if (unlikely(np->rx_mcl[i].result != i))
+			if (unlikely(queue->rx_mcl[i].result != i))
 				panic("Unable to reduce memory reservation\n");
 			while (nr_flips--)
-				BUG_ON(np->rx_mcl[nr_flips].result);
+				BUG_ON(queue->rx_mcl[nr_flips].result);
 		} else {
 			if (HYPERVISOR_memory_op(XENMEM_decrease_reservation,
 						 &reservation) != i)
@@ -1012,25 +1350,140 @@ no_skb:
 	}
 
 	/* Above is a suitable barrier to ensure backend will see requests. */
-	np->rx.req_prod_pvt = req_prod + i;
+	queue->rx.req_prod_pvt = req_prod + i;
  push:
-	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&np->rx, notify);
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&queue->rx, notify);
 	if (notify)
-		notify_remote_via_irq(np->irq);
+		notify_remote_via_irq(queue->irq);
+}
+
+/*
+ * Grant the backend read access to @len bytes at @offset in @page for TX
+ * id @id.  With persistent grants the bytes are copied to the same offset
+ * in that id's pre-granted page instead.
+ */
+static grant_ref_t xennet_tx_grant(struct netfront_queue *queue,
+				   unsigned int id, struct page *page,
+				   unsigned int offset, unsigned int len)
+{
+	grant_ref_t ref;
+	void *vaddr;
+
+	if (queue->tx_pgrants) {
+		vaddr = kmap_atomic(page);
+		memcpy(page_address(queue->tx_pgrants[id].page) + offset,
+		       vaddr + offset, len);
+		kunmap_atomic(vaddr);
+		return queue->tx_pgrants[id].gref;
+	}
+
+	ref = gnttab_claim_grant_reference(&queue->gref_tx_head);
+	BUG_ON((signed short)ref < 0);
+	gnttab_grant_foreign_access_ref(ref, queue->info->xbdev->otherend_id,
+					pfn_to_mfn(page_to_pfn(page)),
+					GTF_readonly);
+	queue->grant_tx_ref[id] = ref;
+
+	return ref;
+}
+
+/* Packets up to this size are copied whenever that saves a slot. */
+#define XENNET_TX_COPYBREAK	(4 * PAGE_SIZE)
+
+/*
+ * Should @skb, which needs @slots slots as it is, rather be copied into
+ * whole pre-granted pages?  Persistent grants copy every slot anyway.
+ */
+static bool xennet_tx_want_bounce(struct netfront_queue *queue,
+				  struct sk_buff *skb, unsigned int slots)
+{
+	unsigned int pages = DIV_ROUND_UP(skb->len, PAGE_SIZE);
+
+	if (slots <= pages)
+		return false;
+	if (queue->tx_pgrants)
+		return true;
+	if (slots <= MAX_SKB_FRAGS + 1 && skb->len > XENNET_TX_COPYBREAK)
+		return false;
+	return queue->tx_bounce_avail >= pages;
+}
+
+/*
+ * Copy @len bytes from @pos in @skb to the start of a pre-granted page
+ * for TX id @id: that id's persistent page, or one from the bounce pool.
+ */
+static grant_ref_t xennet_tx_bounce(struct netfront_queue *queue,
+				    unsigned int id, struct sk_buff *skb,
+				    unsigned int pos, unsigned int len)
+{
+	struct netfront_pgrant *pgrant;
+
+	if (queue->tx_pgrants) {
+		pgrant = &queue->tx_pgrants[id];
+	} else {
+		pgrant = list_first_entry(&queue->tx_bounce_free,
+					  struct netfront_pgrant, node);
+		list_del(&pgrant->node);
+		queue->tx_bounce_avail--;
+		queue->tx_bounce_id[id] = pgrant;
+	}
+
+	if (skb_copy_bits(skb, pos, page_address(pgrant->page), len))
+		BUG();
+
+	return pgrant->gref;
+}
+
+/* Return TX id @id's bounce page, if it holds one, to the pool. */
+static inline void xennet_tx_unbounce(struct netfront_queue *queue,
+				      unsigned int id)
+{
+	struct netfront_pgrant *pgrant = queue->tx_bounce_id[id];
+
+	if (!pgrant)
+		return;
+	list_add(&pgrant->node, &queue->tx_bounce_free);
+	queue->tx_bounce_avail++;
+	queue->tx_bounce_id[id] = NULL;
+}
+
+/* Like xennet_make_frags(), for a packet copied into bounce pages. */
+static void xennet_make_bounce_frags(struct sk_buff *skb,
+				     struct netfront_queue *queue,
+				     struct netif_tx_request *tx)
+{
+	RING_IDX prod = queue->tx.req_prod_pvt;
+	unsigned int pos = tx->size;
+	unsigned int id, bytes;
+
+	for (; pos < skb->len; pos += bytes) {
+		bytes = min_t(unsigned int, skb->len - pos, PAGE_SIZE);
+
+		tx->flags |= XEN_NETTXF_more_data;
+
+		id = get_id_from_freelist(queue->tx_skbs);
+		queue->tx_skbs[id] = skb_get(skb);
+		tx = RING_GET_REQUEST(&queue->tx, prod++);
+		tx->id = id;
+		tx->gref = xennet_tx_bounce(queue, id, skb, pos, bytes);
+		tx->offset = 0;
+		tx->size = bytes;
+		tx->flags = 0;
+	}
+
+	queue->tx.req_prod_pvt = prod;
 }
 
-static void xennet_make_frags(struct sk_buff *skb, struct net_device *dev,
+static void xennet_make_frags(struct sk_buff *skb,
+			      struct netfront_queue *queue,
 			      struct netif_tx_request *tx)
 {
-	struct netfront_info *np = netdev_priv(dev);
 	char *data = skb->data;
-	unsigned long mfn;
-	RING_IDX prod = np->tx.req_prod_pvt;
+	RING_IDX prod = queue->tx.req_prod_pvt;
 	int frags = skb_shinfo(skb)->nr_frags;
 	unsigned int offset = offset_in_page(data);
 	unsigned int len = skb_headlen(skb);
 	unsigned int id;
-	grant_ref_t ref;
 	int i;
 
 	while (len > PAGE_SIZE - offset) {
@@ -1040,18 +1493,13 @@ static void xennet_make_frags(struct sk_buff *skb, struct net_device *dev,
 		data += tx->size;
 		offset = 0;
 
-		id = get_id_from_freelist(np->tx_skbs);
-		np->tx_skbs[id] = skb_get(skb);
-		tx = RING_GET_REQUEST(&np->tx, prod++);
+		id = get_id_from_freelist(queue->tx_skbs);
+		queue->tx_skbs[id] = skb_get(skb);
+		tx = RING_GET_REQUEST(&queue->tx, prod++);
 		tx->id = id;
-		ref = gnttab_claim_grant_reference(&np->gref_tx_head);
-		BUG_ON((signed short)ref < 0);
-
-		mfn = virt_to_mfn(data);
-		gnttab_grant_foreign_access_ref(ref, np->xbdev->otherend_id,
-						mfn, GTF_readonly);
-
-		tx->gref = np->grant_tx_ref[id] = ref;
+		tx->gref = xennet_tx_grant(queue, id, virt_to_page(data),
+					   offset, min_t(unsigned int, len,
+							 PAGE_SIZE));
 		tx->offset = offset;
 		tx->size = len;
 		tx->flags = 0;
@@ -1077,19 +1525,12 @@ static void xennet_make_frags(struct sk_buff *skb, struct net_device *dev,
 
 			tx->flags |= XEN_NETTXF_more_data;
 
-			id = get_id_from_freelist(np->tx_skbs);
-			np->tx_skbs[id] = skb_get(skb);
-			tx = RING_GET_REQUEST(&np->tx, prod++);
+			id = get_id_from_freelist(queue->tx_skbs);
+			queue->tx_skbs[id] = skb_get(skb);
+			tx = RING_GET_REQUEST(&queue->tx, prod++);
 			tx->id = id;
-			ref = gnttab_claim_grant_reference(&np->gref_tx_head);
-			BUG_ON((signed short)ref < 0);
-
-			mfn = pfn_to_mfn(page_to_pfn(page));
-			gnttab_grant_foreign_access_ref(ref,
-							np->xbdev->otherend_id,
-							mfn, GTF_readonly);
-
-			tx->gref = np->grant_tx_ref[id] = ref;
+			tx->gref = xennet_tx_grant(queue, id, page, offset,
+						   bytes);
 			tx->offset = offset;
 			tx->size = bytes;
 			tx->flags = 0;
@@ -1098,7 +1539,7 @@ static void xennet_make_frags(struct sk_buff *skb, struct net_device *dev,
 		}
 	}
 
-	np->tx.req_prod_pvt = prod;
+	queue->tx.req_prod_pvt = prod;
 }
 
 /*
@@ -1121,20 +1562,43 @@ static unsigned int xennet_count_skb_frag_slots(const struct sk_buff *skb)
 	return pages;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
+static u16 xennet_select_queue(struct net_device *dev, struct sk_buff *skb,
+			       void *accel_priv,
+			       select_queue_fallback_t fallback)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0)
+static u16 xennet_select_queue(struct net_device *dev, struct sk_buff *skb,
+			       void *accel_priv)
+#else
+static u16 xennet_select_queue(struct net_device *dev, struct sk_buff *skb)
+#endif
+{
+	struct netfront_info *np = netdev_priv(dev);
+
+	/* Spread flows over the queues by their hash. */
+	if (np->num_queues <= 1)
+		return 0;
+
+	return skb_tx_hash(dev, skb) % np->num_queues;
+}
+
 static int network_start_xmit(struct sk_buff *skb, struct net_device *dev)
 {
 	unsigned short id;
 	struct netfront_info *np = netdev_priv(dev);
 	struct netfront_stats *stats = this_cpu_ptr(np->stats);
+	struct netfront_queue *queue;
+	struct netdev_queue *dev_queue;
 	struct netif_tx_request *tx;
 	struct netif_extra_info *extra;
 	char *data = skb->data;
 	RING_IDX i;
-	grant_ref_t ref;
-	unsigned long mfn, flags;
+	unsigned long flags;
 	int notify;
 	unsigned int offset = offset_in_page(data);
 	unsigned int slots, len = skb_headlen(skb);
+	bool bounce, linearized = false;
+	u16 queue_index;
 
 	/* Check the fast path, if hooks are available */
  	if (np->accel_vif_state.hooks && 
@@ -1143,6 +1607,16 @@ static int network_start_xmit(struct sk_buff *skb, struct net_device *dev)
  		return NETDEV_TX_OK;
  	} 
 
+	/* Drop the packet if no queues are set up */
+	if (unlikely(!np->num_queues))
+		goto drop;
+
+	queue_index = skb_get_queue_mapping(skb);
+	if (unlikely(queue_index >= np->num_queues))
+		queue_index = 0;
+	queue = &np->queues[queue_index];
+	dev_queue = netdev_get_tx_queue(dev, queue_index);
+
 	/*
 	 * If skb->len is too big for wire format, drop skb and alert
 	 * user about misconfiguration.
@@ -1154,37 +1628,62 @@ static int network_start_xmit(struct sk_buff *skb, struct net_device *dev)
 	}
 
 	slots = PFN_UP(offset + len) + xennet_count_skb_frag_slots(skb);
-	if (unlikely(slots > MAX_SKB_FRAGS + 1)) {
-		net_alert_ratelimited("xennet: skb rides the rocket: %u slots\n",
-				      slots);
-		goto drop;
-	}
 
-	spin_lock_irqsave(&np->tx_lock, flags);
+ relock:
+	spin_lock_irqsave(&queue->tx_lock, flags);
 
 	if (unlikely(!netfront_carrier_ok(np) ||
 		     (slots > 1 && !xennet_can_sg(dev)) ||
 		     netif_needs_gso(skb, netif_skb_features(skb)))) {
-		spin_unlock_irqrestore(&np->tx_lock, flags);
+		spin_unlock_irqrestore(&queue->tx_lock, flags);
 		goto drop;
 	}
 
-	i = np->tx.req_prod_pvt;
-
-	id = get_id_from_freelist(np->tx_skbs);
-	np->tx_skbs[id] = skb;
-
-	tx = RING_GET_REQUEST(&np->tx, i);
+	/*
+	 * A GSO packet of up to gso_max_size fits in MAX_SKB_FRAGS + 1
+	 * whole pages, but fragmented or badly aligned data can need more
+	 * slots.  Such packets are copied into pre-granted bounce pages,
+	 * or linearized if none are free, rather than dropped.  The copy
+	 * for the latter is done with the lock dropped, then we start over.
+	 */
+	bounce = xennet_tx_want_bounce(queue, skb, slots);
+	if (unlikely(slots > MAX_SKB_FRAGS + 1) && !bounce) {
+		spin_unlock_irqrestore(&queue->tx_lock, flags);
+		net_dbg_ratelimited("xennet: skb rides the rocket: %u slots, %u bytes\n",
+				    slots, skb->len);
+		if (skb_linearize(skb))
+			goto drop;
+		linearized = true;
+		data = skb->data;
+		offset = offset_in_page(data);
+		len = skb_headlen(skb);
+		slots = PFN_UP(offset + len);
+		goto relock;
+	}
+	if (unlikely(linearized))
+		queue->tx_linearized++;
+
+	i = queue->tx.req_prod_pvt;
+
+	id = get_id_from_freelist(queue->tx_skbs);
+	queue->tx_skbs[id] = skb;
+	NETFRONT_SKB_CB(skb)->tx_head = id;
+
+	tx = RING_GET_REQUEST(&queue->tx, i);
 
 	tx->id   = id;
-	ref = gnttab_claim_grant_reference(&np->gref_tx_head);
-	BUG_ON((signed short)ref < 0);
-	mfn = virt_to_mfn(data);
-	gnttab_grant_foreign_access_ref(
-		ref, np->xbdev->otherend_id, mfn, GTF_readonly);
-	tx->gref = np->grant_tx_ref[id] = ref;
-	tx->offset = offset;
-	tx->size = len;
+	if (bounce) {
+		queue->tx_coalesced++;
+		tx->size = min_t(unsigned int, skb->len, PAGE_SIZE);
+		tx->gref = xennet_tx_bounce(queue, id, skb, 0, tx->size);
+		tx->offset = 0;
+	} else {
+		tx->gref = xennet_tx_grant(queue, id, virt_to_page(data),
+					   offset, min_t(unsigned int, len,
+							 PAGE_SIZE - offset));
+		tx->offset = offset;
+		tx->size = len;
+	}
 
 	tx->flags = 0;
 	extra = NULL;
@@ -1197,7 +1696,7 @@ static int network_start_xmit(struct sk_buff *skb, struct net_device *dev)
 #if HAVE_TSO
 	if (skb_is_gso(skb)) {
 		struct netif_extra_info *gso = (struct netif_extra_info *)
-			RING_GET_REQUEST(&np->tx, ++i);
+			RING_GET_REQUEST(&queue->tx, ++i);
 
 		if (extra)
 			extra->flags |= XEN_NETIF_EXTRA_FLAG_MORE;
@@ -1205,12 +1704,12 @@ static int network_start_xmit(struct sk_buff *skb, struct net_device *dev)
 			tx->flags |= XEN_NETTXF_extra_info;
 
 		gso->u.gso.size = skb_shinfo(skb)->gso_size;
-#ifndef OPENSUSE_1302
-		gso->u.gso.type = XEN_NETIF_GSO_TYPE_TCPV4;
-#else
+#if HAVE_GSO
 		gso->u.gso.type = skb_shinfo(skb)->gso_type & SKB_GSO_TCPV6 ?
 			XEN_NETIF_GSO_TYPE_TCPV6 :
 			XEN_NETIF_GSO_TYPE_TCPV4;
+#else
+		gso->u.gso.type = XEN_NETIF_GSO_TYPE_TCPV4;
 #endif
 		gso->u.gso.pad = 0;
 		gso->u.gso.features = 0;
@@ -1221,14 +1720,17 @@ static int network_start_xmit(struct sk_buff *skb, struct net_device *dev)
 	}
 #endif
 
-	np->tx.req_prod_pvt = i + 1;
+	queue->tx.req_prod_pvt = i + 1;
 
-	xennet_make_frags(skb, dev, tx);
+	if (bounce)
+		xennet_make_bounce_frags(skb, queue, tx);
+	else
+		xennet_make_frags(skb, queue, tx);
 	tx->size = skb->len;
 
-	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&np->tx, notify);
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&queue->tx, notify);
 	if (notify)
-		notify_remote_via_irq(np->irq);
+		notify_remote_via_irq(queue->irq);
 
 	u64_stats_update_begin(&stats->syncp);
 	stats->tx_bytes += skb->len;
@@ -1236,13 +1738,13 @@ static int network_start_xmit(struct sk_buff *skb, struct net_device *dev)
 	u64_stats_update_end(&stats->syncp);
 	dev->trans_start = jiffies;
 
-	/* Note: It is not safe to access skb after network_tx_buf_gc()! */
-	network_tx_buf_gc(dev);
+	netdev_tx_sent_queue(dev_queue, skb->len);
 
-	if (!netfront_tx_slot_available(np))
-		netif_stop_queue(dev);
+	/* Completed slots are reaped by netif_poll(), not here. */
+	if (!netfront_tx_slot_available(queue))
+		netif_tx_stop_queue(dev_queue);
 
-	spin_unlock_irqrestore(&np->tx_lock, flags);
+	spin_unlock_irqrestore(&queue->tx_lock, flags);
 
 	return NETDEV_TX_OK;
 
@@ -1258,45 +1760,40 @@ static int network_start_xmit(struct sk_buff *skb, struct net_device *dev)
 
 static irqreturn_t netif_int(int irq, void *dev_id)
 {
-	struct net_device *dev = dev_id;
-	struct netfront_info *np = netdev_priv(dev);
+	struct netfront_queue *queue = dev_id;
 	unsigned long flags;
 
-	spin_lock_irqsave(&np->tx_lock, flags);
-
-	if (likely(netfront_carrier_ok(np))) {
-		network_tx_buf_gc(dev);
-		/* Under tx_lock: protects access to rx shared-ring indexes. */
-		if (RING_HAS_UNCONSUMED_RESPONSES(&np->rx)) {
-			netfront_accelerator_call_stop_napi_irq(np, dev);
+	spin_lock_irqsave(&queue->tx_lock, flags);
 
-			napi_schedule(&np->napi);
-		}
-	}
+	/* Under tx_lock: protects access to rx shared-ring indexes. */
+	if (likely(netfront_carrier_ok(queue->info)) &&
+	    (RING_HAS_UNCONSUMED_RESPONSES(&queue->tx) ||
+	     RING_HAS_UNCONSUMED_RESPONSES(&queue->rx)))
+		netfront_napi_schedule(queue);
 
-	spin_unlock_irqrestore(&np->tx_lock, flags);
+	spin_unlock_irqrestore(&queue->tx_lock, flags);
 
 	return IRQ_HANDLED;
 }
 
-static void xennet_move_rx_slot(struct netfront_info *np, struct sk_buff *skb,
-				grant_ref_t ref)
+static void xennet_move_rx_slot(struct netfront_queue *queue,
+				struct sk_buff *skb, grant_ref_t ref)
 {
-	int new = xennet_rxidx(np->rx.req_prod_pvt);
+	int new = xennet_rxidx(queue, queue->rx.req_prod_pvt);
 
-	BUG_ON(np->rx_skbs[new]);
-	np->rx_skbs[new] = skb;
-	np->grant_rx_ref[new] = ref;
-	RING_GET_REQUEST(&np->rx, np->rx.req_prod_pvt)->id = new;
-	RING_GET_REQUEST(&np->rx, np->rx.req_prod_pvt)->gref = ref;
-	np->rx.req_prod_pvt++;
+	BUG_ON(queue->rx_skbs[new]);
+	queue->rx_skbs[new] = skb;
+	queue->grant_rx_ref[new] = ref;
+	RING_GET_REQUEST(&queue->rx, queue->rx.req_prod_pvt)->id = new;
+	RING_GET_REQUEST(&queue->rx, queue->rx.req_prod_pvt)->gref = ref;
+	queue->rx.req_prod_pvt++;
 }
 
-static int xennet_get_extras(struct netfront_info *np,
+static int xennet_get_extras(struct netfront_queue *queue,
 			     struct netif_extra_info *extras, RING_IDX rp)
 {
 	struct netif_extra_info *extra;
-	RING_IDX cons = np->rx.rsp_cons;
+	RING_IDX cons = queue->rx.rsp_cons;
 	int err = 0;
 
 	do {
@@ -1305,19 +1802,19 @@ static int xennet_get_extras(struct netfront_info *np,
 
 		if (unlikely(cons + 1 == rp)) {
 			if (net_ratelimit())
-				netdev_warn(np->netdev,
+				netdev_warn(queue->info->netdev,
 					    "Missing extra info\n");
 			err = -EBADR;
 			break;
 		}
 
 		extra = (struct netif_extra_info *)
-			RING_GET_RESPONSE(&np->rx, ++cons);
+			RING_GET_RESPONSE(&queue->rx, ++cons);
 
 		if (unlikely(!extra->type ||
 			     extra->type >= XEN_NETIF_EXTRA_TYPE_MAX)) {
 			if (net_ratelimit())
-				netdev_warn(np->netdev,
+				netdev_warn(queue->info->netdev,
 					    "Invalid extra type: %d\n",
 					    extra->type);
 			err = -EINVAL;
@@ -1326,16 +1823,16 @@ static int xennet_get_extras(struct netfront_info *np,
 			       sizeof(*extra));
 		}
 
-		skb = xennet_get_rx_skb(np, cons);
-		ref = xennet_get_rx_ref(np, cons);
-		xennet_move_rx_slot(np, skb, ref);
+		skb = xennet_get_rx_skb(queue, cons);
+		ref = xennet_get_rx_ref(queue, cons);
+		xennet_move_rx_slot(queue, skb, ref);
 	} while (extra->flags & XEN_NETIF_EXTRA_FLAG_MORE);
 
-	np->rx.rsp_cons = cons;
+	queue->rx.rsp_cons = cons;
 	return err;
 }
 
-static int xennet_get_responses(struct netfront_info *np,
+static int xennet_get_responses(struct netfront_queue *queue,
 				struct netfront_rx_info *rinfo, RING_IDX rp,
 				struct sk_buff_head *list,
 				int *pages_flipped_p)
@@ -1345,29 +1842,30 @@ static int xennet_get_responses(struct netfront_info *np,
 	struct multicall_entry *mcl;
 	struct netif_rx_response *rx = &rinfo->rx;
 	struct netif_extra_info *extras = rinfo->extras;
-	RING_IDX cons = np->rx.rsp_cons;
-	struct sk_buff *skb = xennet_get_rx_skb(np, cons);
-	grant_ref_t ref = xennet_get_rx_ref(np, cons);
+	RING_IDX cons = queue->rx.rsp_cons;
+	struct sk_buff *skb = xennet_get_rx_skb(queue, cons);
+	grant_ref_t ref = xennet_get_rx_ref(queue, cons);
 	int max = MAX_SKB_FRAGS + (rx->status <= RX_COPY_THRESHOLD);
 	int frags = 1;
 	int err = 0;
 	unsigned long ret;
 
 	if (rx->flags & XEN_NETRXF_extra_info) {
-		err = xennet_get_extras(np, extras, rp);
-		cons = np->rx.rsp_cons;
+		err = xennet_get_extras(queue, extras, rp);
+		cons = queue->rx.rsp_cons;
 	}
 
 	for (;;) {
+		struct netfront_pgrant *pgrant;
 		unsigned long mfn;
 
 		if (unlikely(rx->status < 0 ||
 			     rx->offset + rx->status > PAGE_SIZE)) {
 			if (net_ratelimit())
-				netdev_warn(np->netdev,
+				netdev_warn(queue->info->netdev,
 					    "rx->offset: %x, size: %u\n",
 					    rx->offset, rx->status);
-			xennet_move_rx_slot(np, skb, ref);
+			xennet_move_rx_slot(queue, skb, ref);
 			err = -EINVAL;
 			goto next;
 		}
@@ -1379,22 +1877,23 @@ static int xennet_get_responses(struct netfront_info *np,
 		 */
 		if (ref == GRANT_INVALID_REF) {
 			if (net_ratelimit())
-				netdev_warn(np->netdev,
+				netdev_warn(queue->info->netdev,
 					    "Bad rx response id %d.\n",
 					    rx->id);
 			err = -EINVAL;
 			goto next;
 		}
 
-		if (!np->copying_receiver) {
+		pgrant = NETFRONT_SKB_CB(skb)->pgrant;
+		if (!queue->info->copying_receiver) {
 			/* Memory pressure, insufficient buffer
 			 * headroom, ... */
 			if (!(mfn = gnttab_end_foreign_transfer_ref(ref))) {
 				if (net_ratelimit())
-					netdev_warn(np->netdev,
+					netdev_warn(queue->info->netdev,
 						    "Unfulfilled rx req (id=%d, st=%d).\n",
 						    rx->id, rx->status);
-				xennet_move_rx_slot(np, skb, ref);
+				xennet_move_rx_slot(queue, skb, ref);
 				err = -ENOMEM;
 				goto next;
 			}
@@ -1406,8 +1905,8 @@ static int xennet_get_responses(struct netfront_info *np,
 				unsigned long pfn = page_to_pfn(page);
 				void *vaddr = page_address(page);
 
-				mcl = np->rx_mcl + pages_flipped;
-				mmu = np->rx_mmu + pages_flipped;
+				mcl = queue->rx_mcl + pages_flipped;
+				mmu = queue->rx_mmu + pages_flipped;
 
 				MULTI_update_va_mapping(mcl,
 							(unsigned long)vaddr,
@@ -1421,12 +1920,23 @@ static int xennet_get_responses(struct netfront_info *np,
 				set_phys_to_machine(pfn, mfn);
 			}
 			pages_flipped++;
+		} else if (pgrant) {
+			/* Copy out; the persistent page goes back to the pool. */
+			memcpy(page_address(skb_frag_page(skb_shinfo(skb)->frags))
+			       + rx->offset,
+			       page_address(pgrant->page) + rx->offset,
+			       rx->status);
 		} else {
 			ret = gnttab_end_foreign_access_ref(ref);
 			BUG_ON(!ret);
 		}
 
-		gnttab_release_grant_reference(&np->gref_rx_head, ref);
+		if (pgrant) {
+			NETFRONT_SKB_CB(skb)->pgrant = NULL;
+			list_add(&pgrant->node, &queue->rx_pgrant_free);
+		} else
+			gnttab_release_grant_reference(&queue->gref_rx_head,
+						       ref);
 
 		__skb_queue_tail(list, skb);
 
@@ -1436,42 +1946,43 @@ next:
 
 		if (cons + frags == rp) {
 			if (net_ratelimit())
-				netdev_warn(np->netdev, "Need more frags\n");
+				netdev_warn(queue->info->netdev,
+					    "Need more frags\n");
 			err = -ENOENT;
 			break;
 		}
 
-		rx = RING_GET_RESPONSE(&np->rx, cons + frags);
-		skb = xennet_get_rx_skb(np, cons + frags);
-		ref = xennet_get_rx_ref(np, cons + frags);
+		rx = RING_GET_RESPONSE(&queue->rx, cons + frags);
+		skb = xennet_get_rx_skb(queue, cons + frags);
+		ref = xennet_get_rx_ref(queue, cons + frags);
 		frags++;
 	}
 
 	if (unlikely(frags > max)) {
 		if (net_ratelimit())
-			netdev_warn(np->netdev, "Too many frags\n");
+			netdev_warn(queue->info->netdev, "Too many frags\n");
 		err = -E2BIG;
 	}
 
 	if (unlikely(err))
-		np->rx.rsp_cons = cons + frags;
+		queue->rx.rsp_cons = cons + frags;
 
 	*pages_flipped_p = pages_flipped;
 
 	return err;
 }
 
-static RING_IDX xennet_fill_frags(struct netfront_info *np,
+static RING_IDX xennet_fill_frags(struct netfront_queue *queue,
 				  struct sk_buff *skb,
 				  struct sk_buff_head *list)
 {
 	struct skb_shared_info *shinfo = skb_shinfo(skb);
-	RING_IDX cons = np->rx.rsp_cons;
+	RING_IDX cons = queue->rx.rsp_cons;
 	struct sk_buff *nskb;
 
 	while ((nskb = __skb_dequeue(list))) {
 		struct netif_rx_response *rx =
-			RING_GET_RESPONSE(&np->rx, ++cons);
+			RING_GET_RESPONSE(&queue->rx, ++cons);
 
 		if (shinfo->nr_frags == MAX_SKB_FRAGS) {
 			unsigned int pull_to = NETFRONT_SKB_CB(skb)->pull_to;
@@ -1502,13 +2013,9 @@ static int xennet_set_skb_gso(struct sk_buff *skb,
 		return -EINVAL;
 	}
 
-	/* Currently only TCPv4 S.O. is supported. */
-#ifndef OPENSUSE_1302
-	if (gso->u.gso.type != XEN_NETIF_GSO_TYPE_TCPV4) {
-#else
+	/* TCPv6 is only advertised, hence expected, with full GSO. */
 	if (gso->u.gso.type != XEN_NETIF_GSO_TYPE_TCPV4 &&
-	    gso->u.gso.type != XEN_NETIF_GSO_TYPE_TCPV6) {
-#endif
+	    (!HAVE_GSO || gso->u.gso.type != XEN_NETIF_GSO_TYPE_TCPV6)) {
 		if (net_ratelimit())
 			netdev_warn(skb->dev, "Bad GSO type %d.\n",
 				    gso->u.gso.type);
@@ -1518,14 +2025,9 @@ static int xennet_set_skb_gso(struct sk_buff *skb,
 #if HAVE_TSO
 	skb_shinfo(skb)->gso_size = gso->u.gso.size;
 #if HAVE_GSO
-#ifndef OPENSUSE_1302
-	skb_shinfo(skb)->gso_type = SKB_GSO_TCPV4;
-#else
 	skb_shinfo(skb)->gso_type =
 		gso->u.gso.type == XEN_NETIF_GSO_TYPE_TCPV4
 		? SKB_GSO_TCPV4 : SKB_GSO_TCPV6;
-#endif
-
 
 	/* Header must be checked, and gso_segs computed. */
 	skb_shinfo(skb)->gso_type |= SKB_GSO_DODGY;
@@ -1540,9 +2042,14 @@ static int xennet_set_skb_gso(struct sk_buff *skb,
 #endif
 }
 
-static int netif_poll(struct napi_struct *napi, int budget)
-{
-	struct netfront_info *np = container_of(napi, struct netfront_info, napi);
+/*
+ * Consume up to @budget RX responses and refill the ring; rx_lock held.
+ * Shared by NAPI and by busy-polling sockets, which bypass GRO.
+ */
+static int xennet_rx_poll(struct netfront_queue *queue, int budget,
+			  bool busy_poll)
+{
+	struct netfront_info *np = queue->info;
 	struct netfront_stats *stats = this_cpu_ptr(np->stats);
 	struct net_device *dev = np->netdev;
 	struct sk_buff *skb;
@@ -1550,43 +2057,35 @@ static int netif_poll(struct napi_struct *napi, int budget)
 	struct netif_rx_response *rx = &rinfo.rx;
 	struct netif_extra_info *extras = rinfo.extras;
 	RING_IDX i, rp;
-	int work_done, more_to_do = 1, accel_more_to_do = 1;
+	int work_done;
 	struct sk_buff_head rxq;
 	struct sk_buff_head errq;
 	struct sk_buff_head tmpq;
-	unsigned long flags;
 	int pages_flipped = 0;
 	int err;
 
-	spin_lock(&np->rx_lock); /* no need for spin_lock_bh() in ->poll() */
-
-	if (unlikely(!netfront_carrier_ok(np))) {
-		spin_unlock(&np->rx_lock);
-		return 0;
-	}
-
 	skb_queue_head_init(&rxq);
 	skb_queue_head_init(&errq);
 	skb_queue_head_init(&tmpq);
 
-	rp = np->rx.sring->rsp_prod;
+	rp = queue->rx.sring->rsp_prod;
 	rmb(); /* Ensure we see queued responses up to 'rp'. */
 
-	i = np->rx.rsp_cons;
+	i = queue->rx.rsp_cons;
 	work_done = 0;
 	while ((i != rp) && (work_done < budget)) {
-		memcpy(rx, RING_GET_RESPONSE(&np->rx, i), sizeof(*rx));
+		memcpy(rx, RING_GET_RESPONSE(&queue->rx, i), sizeof(*rx));
 		memset(extras, 0, sizeof(rinfo.extras));
 
-		err = xennet_get_responses(np, &rinfo, rp, &tmpq,
+		err = xennet_get_responses(queue, &rinfo, rp, &tmpq,
 					   &pages_flipped);
 
 		if (unlikely(err)) {
 err:	
 			while ((skb = __skb_dequeue(&tmpq)))
 				__skb_queue_tail(&errq, skb);
-			dev->stats.rx_errors++;
-			i = np->rx.rsp_cons;
+			queue->rx_errors++;
+			i = queue->rx.rsp_cons;
 			continue;
 		}
 
@@ -1598,7 +2097,7 @@ err:
 
 			if (unlikely(xennet_set_skb_gso(skb, gso))) {
 				__skb_queue_head(&tmpq, skb);
-				np->rx.rsp_cons += skb_queue_len(&tmpq);
+				queue->rx.rsp_cons += skb_queue_len(&tmpq);
 				goto err;
 			}
 		}
@@ -1611,7 +2110,7 @@ err:
 		skb_frag_size_set(skb_shinfo(skb)->frags, rx->status);
 		skb->len += skb->data_len = rx->status;
 
-		i = xennet_fill_frags(np, skb, &tmpq);
+		i = xennet_fill_frags(queue, skb, &tmpq);
 
 		if (rx->flags & XEN_NETRXF_csum_blank)
 			skb->ip_summed = CHECKSUM_PARTIAL;
@@ -1622,7 +2121,7 @@ err:
 
 		__skb_queue_tail(&rxq, skb);
 
-		np->rx.rsp_cons = ++i;
+		queue->rx.rsp_cons = ++i;
 		work_done++;
 	}
 
@@ -1632,10 +2131,10 @@ err:
 
 		/* Do all the remapping work and M2P updates. */
 		if (!xen_feature(XENFEAT_auto_translated_physmap)) {
-			MULTI_mmu_update(np->rx_mcl + pages_flipped,
-					 np->rx_mmu, pages_flipped, 0,
+			MULTI_mmu_update(queue->rx_mcl + pages_flipped,
+					 queue->rx_mmu, pages_flipped, 0,
 					 DOMID_SELF);
-			err = HYPERVISOR_multicall_check(np->rx_mcl,
+			err = HYPERVISOR_multicall_check(queue->rx_mcl,
 							 pages_flipped + 1,
 							 NULL);
 			BUG_ON(err);
@@ -1647,18 +2146,27 @@ err:
 	while ((skb = __skb_dequeue(&rxq)) != NULL) {
 		unsigned int pull_to = NETFRONT_SKB_CB(skb)->pull_to;
 
+		if (np->copying_receiver) {
+			unsigned int f;
+
+			/* Before the pull below can drop the first page. */
+			for (f = 0; f < skb_shinfo(skb)->nr_frags; f++)
+				xennet_recycle_rx_page(queue,
+					skb_frag_page(&skb_shinfo(skb)->frags[f]));
+		}
+
 		if (pull_to > skb_headlen(skb))
 			__pskb_pull_tail(skb, pull_to - skb_headlen(skb));
 
 		/* Ethernet work: Delayed to here as it peeks the header. */
 		skb->protocol = eth_type_trans(skb, dev);
 #ifndef OPENSUSE_1302
-		if (skb_checksum_setup(skb, &np->rx_gso_csum_fixups)) {
+		if (skb_checksum_setup(skb, &queue->rx_gso_csum_fixups)) {
 #else
-		if (xennet_checksum_setup(skb, &np->rx_gso_csum_fixups)) {
+		if (xennet_checksum_setup(skb, &queue->rx_gso_csum_fixups)) {
 #endif
 			kfree_skb(skb);
-			dev->stats.rx_errors++;
+			queue->rx_errors++;
 			--work_done;
 			continue;
 		}
@@ -1668,20 +2176,68 @@ err:
 		stats->rx_bytes += skb->len;
 		u64_stats_update_end(&stats->syncp);
 
-		/* Pass it up. */
-		netif_receive_skb(skb);
+		skb_mark_napi_id(skb, &queue->napi);
+
+		/* A busy-polling socket wants its packet now, not via GRO. */
+		if (busy_poll) {
+			queue->rx_busy_poll_packets++;
+			netif_receive_skb(skb);
+			continue;
+		}
+
+		/* Pass it up, letting GRO coalesce TCP streams. */
+		queue->rx_irq_packets++;
+		switch (napi_gro_receive(&queue->napi, skb)) {
+		case GRO_MERGED:
+		case GRO_MERGED_FREE:
+			queue->rx_gro_merged++;
+			break;
+		default:
+			break;
+		}
 	}
 
 	/* If we get a callback with very few responses, reduce fill target. */
 	/* NB. Note exponential increase, linear decrease. */
-	if (((np->rx.req_prod_pvt - np->rx.sring->rsp_prod) >
-	     ((3*np->rx_target) / 4)) &&
-	    (--np->rx_target < np->rx_min_target))
-		np->rx_target = np->rx_min_target;
+	if (((queue->rx.req_prod_pvt - queue->rx.sring->rsp_prod) >
+	     ((3*queue->rx_target) / 4)) &&
+	    (--queue->rx_target < queue->rx_min_target))
+		queue->rx_target = queue->rx_min_target;
 
-	network_alloc_rx_buffers(dev);
+	network_alloc_rx_buffers(queue);
 
-	if (work_done < budget) {
+	return work_done;
+}
+
+static int netif_poll(struct napi_struct *napi, int budget)
+{
+	struct netfront_queue *queue =
+		container_of(napi, struct netfront_queue, napi);
+	struct netfront_info *np = queue->info;
+	struct net_device *dev = np->netdev;
+	int work_done, more_to_do = 1, accel_more_to_do = 1;
+	unsigned long flags;
+
+	spin_lock(&queue->rx_lock); /* no need for spin_lock_bh() in ->poll() */
+
+	if (unlikely(!netfront_carrier_ok(np))) {
+		spin_unlock(&queue->rx_lock);
+		return 0;
+	}
+
+	hrtimer_try_to_cancel(&queue->rx_coalesce_timer);
+
+	/* TX completions are reaped here, off the transmit path. */
+	spin_lock_irq(&queue->tx_lock);
+	network_tx_buf_gc(queue);
+	spin_unlock_irq(&queue->tx_lock);
+
+	work_done = xennet_rx_poll(queue, budget, false);
+
+	/* The accelerated path is only polled from the first queue. */
+	if (queue->id != 0)
+		accel_more_to_do = 0;
+	else if (work_done < budget) {
 		/* there's some spare capacity, try the accelerated path */
 		int accel_budget = budget - work_done;
 		int accel_budget_start = accel_budget;
@@ -1696,11 +2252,21 @@ err:
 	}
 
 	if (work_done < budget) {
+		/*
+		 * Push held GRO packets up before going idle; the stack
+		 * runs them with interrupts enabled.
+		 */
+		napi_gro_flush(napi, false);
+
 		local_irq_save(flags);
 
-		RING_FINAL_CHECK_FOR_RESPONSES(&np->rx, more_to_do);
+		xennet_rx_update_moderation(queue, work_done);
+		more_to_do = xennet_rx_final_check(queue);
+		/* network_tx_buf_gc() re-armed the TX event already. */
+		if (!more_to_do)
+			more_to_do = RING_HAS_UNCONSUMED_RESPONSES(&queue->tx);
 
-		if (!more_to_do && !accel_more_to_do && 
+		if (!more_to_do && !accel_more_to_do && queue->id == 0 &&
 		    np->accel_vif_state.hooks) {
 			/* 
 			 *  Slow path has nothing more to do, see if
@@ -1716,34 +2282,82 @@ err:
 		local_irq_restore(flags);
 	}
 
-	spin_unlock(&np->rx_lock);
+	spin_unlock(&queue->rx_lock);
 	
 	return work_done;
 }
 
-static void netif_release_tx_bufs(struct netfront_info *np)
+#ifdef CONFIG_NET_RX_BUSY_POLL
+/*
+ * Called by a socket spinning in SO_BUSY_POLL / busy_read: reap the RX
+ * ring from the application's CPU without waiting for an event.  If NAPI
+ * holds the ring, or is scheduled to, the socket is told to retry.
+ */
+static int xennet_busy_poll(struct napi_struct *napi)
+{
+	struct netfront_queue *queue =
+		container_of(napi, struct netfront_queue, napi);
+	struct netfront_info *np = queue->info;
+	int work_done;
+
+	if (!np->busy_poll)
+		return LL_FLUSH_FAILED;
+
+	if (!spin_trylock_bh(&queue->rx_lock))
+		return LL_FLUSH_BUSY;
+
+	/*
+	 * While NAPI is scheduled its GRO list may hold earlier segments,
+	 * which packets passed straight up from here would overtake.  Once
+	 * netif_poll() has completed NAPI under rx_lock the list is empty.
+	 */
+	if (test_bit(NAPI_STATE_SCHED, &napi->state)) {
+		spin_unlock_bh(&queue->rx_lock);
+		return LL_FLUSH_BUSY;
+	}
+
+	if (likely(netfront_carrier_ok(np)))
+		work_done = xennet_rx_poll(queue, XENNET_BUSY_POLL_BUDGET,
+					   true);
+	else
+		work_done = LL_FLUSH_FAILED;
+
+	spin_unlock_bh(&queue->rx_lock);
+
+	return work_done;
+}
+#endif
+
+static void netif_release_tx_bufs(struct netfront_queue *queue)
 {
 	struct sk_buff *skb;
 	int i;
 
-	for (i = 1; i <= NET_TX_RING_SIZE; i++) {
-		if ((unsigned long)np->tx_skbs[i] < PAGE_OFFSET)
+	for (i = 1; i <= queue->tx_ring_size; i++) {
+		if ((unsigned long)queue->tx_skbs[i] < PAGE_OFFSET)
 			continue;
 
-		skb = np->tx_skbs[i];
-		gnttab_end_foreign_access_ref(np->grant_tx_ref[i]);
-		gnttab_release_grant_reference(
-			&np->gref_tx_head, np->grant_tx_ref[i]);
-		np->grant_tx_ref[i] = GRANT_INVALID_REF;
-		add_id_to_freelist(np->tx_skbs, i);
+		skb = queue->tx_skbs[i];
+		if (queue->grant_tx_ref[i] != GRANT_INVALID_REF) {
+			gnttab_end_foreign_access_ref(queue->grant_tx_ref[i]);
+			gnttab_release_grant_reference(
+				&queue->gref_tx_head, queue->grant_tx_ref[i]);
+			queue->grant_tx_ref[i] = GRANT_INVALID_REF;
+		}
+		xennet_tx_unbounce(queue, i);
+		add_id_to_freelist(queue->tx_skbs, i);
 		dev_kfree_skb_irq(skb);
 	}
+
+	/* Nothing is in flight any more; restart BQL from scratch. */
+	netdev_tx_reset_queue(netdev_get_tx_queue(queue->info->netdev,
+						  queue->id));
 }
 
-static void netif_release_rx_bufs_flip(struct netfront_info *np)
+static void netif_release_rx_bufs_flip(struct netfront_queue *queue)
 {
-	struct mmu_update      *mmu = np->rx_mmu;
-	struct multicall_entry *mcl = np->rx_mcl;
+	struct mmu_update      *mmu = queue->rx_mmu;
+	struct multicall_entry *mcl = queue->rx_mcl;
 	struct sk_buff_head free_list;
 	struct sk_buff *skb;
 	unsigned long mfn;
@@ -1752,21 +2366,21 @@ static void netif_release_rx_bufs_flip(struct netfront_info *np)
 
 	skb_queue_head_init(&free_list);
 
-	spin_lock_bh(&np->rx_lock);
+	spin_lock_bh(&queue->rx_lock);
 
-	for (id = 0; id < NET_RX_RING_SIZE; id++) {
+	for (id = 0; id < queue->rx_ring_size; id++) {
 		struct page *page;
 
-		if ((ref = np->grant_rx_ref[id]) == GRANT_INVALID_REF) {
+		if ((ref = queue->grant_rx_ref[id]) == GRANT_INVALID_REF) {
 			unused++;
 			continue;
 		}
 
-		skb = np->rx_skbs[id];
+		skb = queue->rx_skbs[id];
 		mfn = gnttab_end_foreign_transfer_ref(ref);
-		gnttab_release_grant_reference(&np->gref_rx_head, ref);
-		np->grant_rx_ref[id] = GRANT_INVALID_REF;
-		add_id_to_freelist(np->rx_skbs, id);
+		gnttab_release_grant_reference(&queue->gref_rx_head, ref);
+		queue->grant_rx_ref[id] = GRANT_INVALID_REF;
+		add_id_to_freelist(queue->rx_skbs, id);
 
 		page = skb_frag_page(skb_shinfo(skb)->frags);
 
@@ -1807,62 +2421,71 @@ static void netif_release_rx_bufs_flip(struct netfront_info *np)
 
 		if (!xen_feature(XENFEAT_auto_translated_physmap)) {
 			/* Do all the remapping work and M2P updates. */
-			MULTI_mmu_update(mcl, np->rx_mmu, mmu - np->rx_mmu,
+			MULTI_mmu_update(mcl, queue->rx_mmu,
+					 mmu - queue->rx_mmu,
 					 0, DOMID_SELF);
 			rc = HYPERVISOR_multicall_check(
-				np->rx_mcl, mcl + 1 - np->rx_mcl, NULL);
+				queue->rx_mcl, mcl + 1 - queue->rx_mcl, NULL);
 			BUG_ON(rc);
 		}
 	}
 
 	__skb_queue_purge(&free_list);
 
-	spin_unlock_bh(&np->rx_lock);
+	spin_unlock_bh(&queue->rx_lock);
 }
 
-static void netif_release_rx_bufs_copy(struct netfront_info *np)
+static void netif_release_rx_bufs_copy(struct netfront_queue *queue)
 {
 	struct sk_buff *skb;
 	int i, ref;
 	int busy = 0, inuse = 0;
 
-	spin_lock_bh(&np->rx_lock);
+	spin_lock_bh(&queue->rx_lock);
 
-	for (i = 0; i < NET_RX_RING_SIZE; i++) {
-		ref = np->grant_rx_ref[i];
+	for (i = 0; i < queue->rx_ring_size; i++) {
+		ref = queue->grant_rx_ref[i];
 
 		if (ref == GRANT_INVALID_REF)
 			continue;
 
 		inuse++;
 
-		skb = np->rx_skbs[i];
+		skb = queue->rx_skbs[i];
 
-		if (!gnttab_end_foreign_access_ref(ref))
-		{
+		if (NETFRONT_SKB_CB(skb)->pgrant) {
+			list_add(&NETFRONT_SKB_CB(skb)->pgrant->node,
+				 &queue->rx_pgrant_free);
+			NETFRONT_SKB_CB(skb)->pgrant = NULL;
+		} else if (!gnttab_end_foreign_access_ref(ref)) {
 			busy++;
 			continue;
-		}
-
-		gnttab_release_grant_reference(&np->gref_rx_head, ref);
-		np->grant_rx_ref[i] = GRANT_INVALID_REF;
-		add_id_to_freelist(np->rx_skbs, i);
+		} else
+			gnttab_release_grant_reference(&queue->gref_rx_head,
+						       ref);
+		queue->grant_rx_ref[i] = GRANT_INVALID_REF;
+		add_id_to_freelist(queue->rx_skbs, i);
 
 		dev_kfree_skb(skb);
 	}
 
 	if (busy)
-		DPRINTK("%s: Unable to release %d of %d inuse grant references out of %ld total.\n",
-			__FUNCTION__, busy, inuse, NET_RX_RING_SIZE);
+		DPRINTK("%s: Unable to release %d of %d inuse grant references out of %u total.\n",
+			__FUNCTION__, busy, inuse, queue->rx_ring_size);
 
-	spin_unlock_bh(&np->rx_lock);
+	spin_unlock_bh(&queue->rx_lock);
 }
 
 static int network_close(struct net_device *dev)
 {
 	struct netfront_info *np = netdev_priv(dev);
-	netif_stop_queue(np->netdev);
-	napi_disable(&np->napi);
+	unsigned int i;
+
+	netif_tx_stop_all_queues(np->netdev);
+	for (i = 0; i < np->num_queues; i++) {
+		napi_disable(&np->queues[i].napi);
+		hrtimer_cancel(&np->queues[i].rx_coalesce_timer);
+	}
 	return 0;
 }
 
@@ -1899,6 +2522,7 @@ static struct rtnl_link_stats64 *xennet_get_stats64(struct net_device *dev,
 						    struct rtnl_link_stats64 *tot)
 {
 	struct netfront_info *np = netdev_priv(dev);
+	unsigned int q;
 	int cpu;
 
 	netfront_accelerator_call_get_stats(np, dev);
@@ -1929,7 +2553,10 @@ static struct rtnl_link_stats64 *xennet_get_stats64(struct net_device *dev,
 		tot->tx_bytes   += tx_bytes;
 	}
 
-	tot->rx_errors  = dev->stats.rx_errors;
+	/* Each queue counts its own RX errors from its NAPI context. */
+	tot->rx_errors = dev->stats.rx_errors;
+	for (q = 0; q < np->num_queues; q++)
+		tot->rx_errors += np->queues[q].rx_errors;
 	tot->tx_dropped = dev->stats.tx_dropped;
 
 	return tot;
@@ -1941,15 +2568,58 @@ static const struct xennet_stat {
 } xennet_stats[] = {
 	{
 		"rx_gso_csum_fixups",
-		offsetof(struct netfront_info, rx_gso_csum_fixups) / sizeof(long)
+		offsetof(struct netfront_queue, rx_gso_csum_fixups) / sizeof(long)
+	},
+	{
+		"rx_gro_merged",
+		offsetof(struct netfront_queue, rx_gro_merged) / sizeof(long)
+	},
+	{
+		"rx_recycle_hits",
+		offsetof(struct netfront_queue, rx_recycle_hits) / sizeof(long)
+	},
+	{
+		"rx_alloc_failures",
+		offsetof(struct netfront_queue, rx_alloc_failures) / sizeof(long)
+	},
+	{
+		"rx_refill_timeouts",
+		offsetof(struct netfront_queue, rx_refill_timeouts) / sizeof(long)
+	},
+	{
+		"rx_irq_packets",
+		offsetof(struct netfront_queue, rx_irq_packets) / sizeof(long)
+	},
+	{
+		"rx_busy_poll_packets",
+		offsetof(struct netfront_queue, rx_busy_poll_packets) / sizeof(long)
+	},
+	{
+		"tx_coalesced",
+		offsetof(struct netfront_queue, tx_coalesced) / sizeof(long)
+	},
+	{
+		"tx_linearized",
+		offsetof(struct netfront_queue, tx_linearized) / sizeof(long)
+	},
+};
+
+/* Reported once per queue, as "rx_queue_<n>_<name>". */
+static const struct xennet_stat xennet_queue_stats[] = {
+	{
+		"gro_merged",
+		offsetof(struct netfront_queue, rx_gro_merged) / sizeof(long)
 	},
 };
 
 static int xennet_get_sset_count(struct net_device *dev, int sset)
 {
+	struct netfront_info *np = netdev_priv(dev);
+
 	switch (sset) {
 	case ETH_SS_STATS:
-		return ARRAY_SIZE(xennet_stats);
+		return ARRAY_SIZE(xennet_stats) +
+			np->num_queues * ARRAY_SIZE(xennet_queue_stats);
 	}
 	return -EOPNOTSUPP;
 }
@@ -1957,22 +2627,43 @@ static int xennet_get_sset_count(struct net_device *dev, int sset)
 static void xennet_get_ethtool_stats(struct net_device *dev,
 				     struct ethtool_stats *stats, u64 *data)
 {
-	unsigned long *np = netdev_priv(dev);
-	unsigned int i;
+	struct netfront_info *np = netdev_priv(dev);
+	unsigned int i, q;
+
+	/* Counters are kept per queue; report the sum over all queues. */
+	for (i = 0; i < ARRAY_SIZE(xennet_stats); i++) {
+		data[i] = 0;
+		for (q = 0; q < np->num_queues; q++) {
+			unsigned long *queue = (void *)&np->queues[q];
+
+			data[i] += queue[xennet_stats[i].offset];
+		}
+	}
+
+	for (q = 0; q < np->num_queues; q++) {
+		unsigned long *queue = (void *)&np->queues[q];
+		unsigned int j;
 
-	for (i = 0; i < ARRAY_SIZE(xennet_stats); i++)
-		data[i] = np[xennet_stats[i].offset];
+		for (j = 0; j < ARRAY_SIZE(xennet_queue_stats); j++)
+			data[i++] = queue[xennet_queue_stats[j].offset];
+	}
 }
 
 static void xennet_get_strings(struct net_device *dev, u32 stringset, u8 *data)
 {
-	unsigned int i;
+	struct netfront_info *np = netdev_priv(dev);
+	unsigned int i, j, q;
 
 	switch (stringset) {
 	case ETH_SS_STATS:
 		for (i = 0; i < ARRAY_SIZE(xennet_stats); i++)
 			memcpy(data + i * ETH_GSTRING_LEN,
 			       xennet_stats[i].name, ETH_GSTRING_LEN);
+		for (q = 0; q < np->num_queues; q++)
+			for (j = 0; j < ARRAY_SIZE(xennet_queue_stats); j++)
+				snprintf(data + i++ * ETH_GSTRING_LEN,
+					 ETH_GSTRING_LEN, "rx_queue_%u_%s",
+					 q, xennet_queue_stats[j].name);
 		break;
 	}
 }
@@ -1985,14 +2676,342 @@ static void netfront_get_drvinfo(struct net_device *dev,
 		ARRAY_SIZE(info->bus_info));
 }
 
+static void xennet_free_queue_arrays(struct netfront_queue *queue)
+{
+	kfree(queue->tx_skbs);
+	kfree(queue->rx_skbs);
+	kfree(queue->grant_tx_ref);
+	kfree(queue->grant_rx_ref);
+	kfree(queue->tx_bounce_id);
+	queue->tx_bounce_id = NULL;
+	queue->tx_skbs = queue->rx_skbs = NULL;
+	queue->grant_tx_ref = queue->grant_rx_ref = NULL;
+}
+
+static int xennet_init_queue(struct netfront_queue *queue)
+{
+	unsigned int i, order = queue->info->ring_page_order;
+
+	spin_lock_init(&queue->tx_lock);
+	spin_lock_init(&queue->rx_lock);
+
+	queue->tx_ring_size = NET_TX_RING_SIZE(order);
+	queue->rx_ring_size = NET_RX_RING_SIZE(order);
+
+	queue->tx_skbs = kcalloc(queue->tx_ring_size + 1,
+				 sizeof(*queue->tx_skbs), GFP_KERNEL);
+	queue->grant_tx_ref = kcalloc(queue->tx_ring_size + 1,
+				      sizeof(*queue->grant_tx_ref), GFP_KERNEL);
+	queue->rx_skbs = kcalloc(queue->rx_ring_size,
+				 sizeof(*queue->rx_skbs), GFP_KERNEL);
+	queue->grant_rx_ref = kcalloc(queue->rx_ring_size,
+				      sizeof(*queue->grant_rx_ref), GFP_KERNEL);
+	queue->tx_bounce_id = kcalloc(queue->tx_ring_size + 1,
+				      sizeof(*queue->tx_bounce_id), GFP_KERNEL);
+	if (!queue->tx_skbs || !queue->grant_tx_ref ||
+	    !queue->rx_skbs || !queue->grant_rx_ref || !queue->tx_bounce_id) {
+		xennet_free_queue_arrays(queue);
+		return -ENOMEM;
+	}
+
+	skb_queue_head_init(&queue->rx_batch);
+	INIT_LIST_HEAD(&queue->rx_pgrant_free);
+	INIT_LIST_HEAD(&queue->tx_bounce_free);
+	queue->rx_target     = RX_DFL_MIN_TARGET;
+	queue->rx_min_target = RX_DFL_MIN_TARGET;
+	queue->rx_max_target = RX_MAX_TARGET(queue);
+	queue->tx_max_target = queue->tx_ring_size;
+
+	init_timer(&queue->rx_refill_timer);
+	queue->rx_refill_timer.data = (unsigned long)queue;
+	queue->rx_refill_timer.function = rx_refill_timeout;
+
+	hrtimer_init(&queue->rx_coalesce_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL);
+	queue->rx_coalesce_timer.function = xennet_rx_coalesce_timeout;
+	queue->rx_event_frames = 1;
+
+	snprintf(queue->name, sizeof(queue->name), "%s-q%u",
+		 queue->info->netdev->name, queue->id);
+
+	for (i = 0; i < XENNET_MAX_RING_PAGES; i++) {
+		queue->tx_ring_refs[i] = GRANT_INVALID_REF;
+		queue->rx_ring_refs[i] = GRANT_INVALID_REF;
+	}
+
+	/* Initialise {tx,rx}_skbs as a free chain containing every entry. */
+	for (i = 0; i <= queue->tx_ring_size; i++) {
+		queue->tx_skbs[i] = (void *)((unsigned long) i+1);
+		queue->grant_tx_ref[i] = GRANT_INVALID_REF;
+	}
+
+	for (i = 0; i < queue->rx_ring_size; i++) {
+		queue->rx_skbs[i] = NULL;
+		queue->grant_rx_ref[i] = GRANT_INVALID_REF;
+	}
+
+	/* A grant for every tx ring slot */
+	if (gnttab_alloc_grant_references(queue->tx_ring_size,
+					  &queue->gref_tx_head) < 0) {
+		pr_alert("#### netfront can't alloc tx grant refs\n");
+		xennet_free_queue_arrays(queue);
+		return -ENOMEM;
+	}
+	/* A grant for every rx ring slot */
+	if (gnttab_alloc_grant_references(queue->rx_ring_size,
+					  &queue->gref_rx_head) < 0) {
+		pr_alert("#### netfront can't alloc rx grant refs\n");
+		gnttab_free_grant_references(queue->gref_tx_head);
+		xennet_free_queue_arrays(queue);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Drop @queue's persistent grants.  RX buffers still posted with one get
+ * a grant reference of their own back, for network_connect() to grant.
+ */
+static void xennet_free_pgrants(struct netfront_queue *queue)
+{
+	struct netfront_pgrant *pgrants = queue->tx_pgrants;
+	struct sk_buff *skb;
+	grant_ref_t ref;
+	unsigned int i;
+
+	if (!pgrants)
+		return;
+
+	for (i = 0; i < queue->rx_ring_size; i++) {
+		skb = queue->rx_skbs[i];
+		if ((unsigned long)skb < PAGE_OFFSET ||
+		    !NETFRONT_SKB_CB(skb)->pgrant)
+			continue;
+		NETFRONT_SKB_CB(skb)->pgrant = NULL;
+		ref = gnttab_claim_grant_reference(&queue->gref_rx_head);
+		BUG_ON((signed short)ref < 0);
+		queue->grant_rx_ref[i] = ref;
+	}
+
+	/* TX ids start at 1: entry 0 is never used. */
+	for (i = 1; i < queue->tx_ring_size + 1 + queue->rx_ring_size; i++) {
+		if (pgrants[i].gref != GRANT_INVALID_REF)
+			gnttab_end_foreign_access(pgrants[i].gref,
+				(unsigned long)page_address(pgrants[i].page));
+		else if (pgrants[i].page)
+			__free_page(pgrants[i].page);
+	}
+
+	kfree(pgrants);
+	queue->tx_pgrants = NULL;
+	queue->rx_pgrants = NULL;
+	INIT_LIST_HEAD(&queue->rx_pgrant_free);
+}
+
+/* Grant a page per TX id and per RX slot to the backend, up front. */
+static int xennet_alloc_pgrants(struct netfront_queue *queue)
+{
+	domid_t otherend_id = queue->info->xbdev->otherend_id;
+	struct netfront_pgrant *pgrants, *pgrant;
+	unsigned int i, nr = queue->tx_ring_size + 1 + queue->rx_ring_size;
+	int ref;
+
+	/* Grants made to a previous backend are of no use any more. */
+	xennet_free_pgrants(queue);
+
+	pgrants = kcalloc(nr, sizeof(*pgrants), GFP_KERNEL);
+	if (!pgrants)
+		return -ENOMEM;
+	for (i = 0; i < nr; i++)
+		pgrants[i].gref = GRANT_INVALID_REF;
+	queue->tx_pgrants = pgrants;
+	queue->rx_pgrants = pgrants + queue->tx_ring_size + 1;
+
+	for (i = 1; i < nr; i++) {
+		pgrant = &pgrants[i];
+		pgrant->page = alloc_page(GFP_KERNEL);
+		if (!pgrant->page)
+			goto fail;
+		ref = gnttab_grant_foreign_access(otherend_id,
+			pfn_to_mfn(page_to_pfn(pgrant->page)),
+			pgrant < queue->rx_pgrants ? GTF_readonly : 0);
+		if (ref < 0)
+			goto fail;
+		pgrant->gref = ref;
+		if (pgrant >= queue->rx_pgrants)
+			list_add_tail(&pgrant->node, &queue->rx_pgrant_free);
+	}
+
+	return 0;
+
+ fail:
+	xennet_free_pgrants(queue);
+	return -ENOMEM;
+}
+
+/*
+ * Drop @queue's bounce pool.  Packets still holding a page must have
+ * been released, or be released later without one.
+ */
+static void xennet_free_tx_bounce(struct netfront_queue *queue)
+{
+	unsigned int i;
+
+	if (!queue->tx_bounce)
+		return;
+
+	memset(queue->tx_bounce_id, 0,
+	       (queue->tx_ring_size + 1) * sizeof(*queue->tx_bounce_id));
+
+	for (i = 0; i < XENNET_TX_BOUNCE_PAGES; i++) {
+		struct netfront_pgrant *pgrant = &queue->tx_bounce[i];
+
+		if (pgrant->gref != GRANT_INVALID_REF)
+			gnttab_end_foreign_access(pgrant->gref,
+				(unsigned long)page_address(pgrant->page));
+		else if (pgrant->page)
+			__free_page(pgrant->page);
+	}
+
+	kfree(queue->tx_bounce);
+	queue->tx_bounce = NULL;
+	INIT_LIST_HEAD(&queue->tx_bounce_free);
+	queue->tx_bounce_avail = 0;
+}
+
+/* Grant the bounce pool's pages read-only to the backend, up front. */
+static int xennet_alloc_tx_bounce(struct netfront_queue *queue)
+{
+	domid_t otherend_id = queue->info->xbdev->otherend_id;
+	struct netfront_pgrant *pgrant;
+	unsigned int i;
+	int ref;
+
+	xennet_free_tx_bounce(queue);
+
+	queue->tx_bounce = kcalloc(XENNET_TX_BOUNCE_PAGES,
+				   sizeof(*queue->tx_bounce), GFP_KERNEL);
+	if (!queue->tx_bounce)
+		return -ENOMEM;
+
+	for (i = 0; i < XENNET_TX_BOUNCE_PAGES; i++)
+		queue->tx_bounce[i].gref = GRANT_INVALID_REF;
+
+	for (i = 0; i < XENNET_TX_BOUNCE_PAGES; i++) {
+		pgrant = &queue->tx_bounce[i];
+		pgrant->page = alloc_page(GFP_KERNEL);
+		if (!pgrant->page)
+			goto fail;
+		ref = gnttab_grant_foreign_access(otherend_id,
+			pfn_to_mfn(page_to_pfn(pgrant->page)), GTF_readonly);
+		if (ref < 0)
+			goto fail;
+		pgrant->gref = ref;
+		list_add_tail(&pgrant->node, &queue->tx_bounce_free);
+		queue->tx_bounce_avail++;
+	}
+
+	return 0;
+
+ fail:
+	xennet_free_tx_bounce(queue);
+	return -ENOMEM;
+}
+
+static void xennet_release_queue(struct netfront_queue *queue)
+{
+	del_timer_sync(&queue->rx_refill_timer);
+	hrtimer_cancel(&queue->rx_coalesce_timer);
+
+	netif_release_tx_bufs(queue);
+	if (queue->info->copying_receiver)
+		netif_release_rx_bufs_copy(queue);
+	else
+		netif_release_rx_bufs_flip(queue);
+	xennet_drain_rx_recycle(queue);
+	xennet_free_pgrants(queue);
+	xennet_free_tx_bounce(queue);
+	gnttab_free_grant_references(queue->gref_tx_head);
+	gnttab_free_grant_references(queue->gref_rx_head);
+	xennet_free_queue_arrays(queue);
+}
+
+static int xennet_create_queues(struct netfront_info *info,
+				unsigned int num_queues)
+{
+	struct netfront_queue *queue;
+	unsigned int i;
+	int err;
+
+	info->queues = kcalloc(num_queues, sizeof(struct netfront_queue),
+			       GFP_KERNEL);
+	if (!info->queues)
+		return -ENOMEM;
+
+	for (i = 0; i < num_queues; i++) {
+		queue = &info->queues[i];
+		queue->id = i;
+		queue->info = info;
+
+		err = xennet_init_queue(queue);
+		if (err) {
+			while (i--)
+				xennet_release_queue(&info->queues[i]);
+			kfree(info->queues);
+			info->queues = NULL;
+			return err;
+		}
+	}
+
+	for (i = 0; i < num_queues; i++) {
+		queue = &info->queues[i];
+		netif_napi_add(info->netdev, &queue->napi, netif_poll, 64);
+		napi_hash_add(&queue->napi);
+		if (netif_running(info->netdev))
+			napi_enable(&queue->napi);
+	}
+
+	info->num_queues = num_queues;
+
+	return 0;
+}
+
+static void xennet_destroy_queues(struct netfront_info *info)
+{
+	struct netfront_queue *queue;
+	unsigned int i;
+
+	for (i = 0; i < info->num_queues; i++) {
+		queue = &info->queues[i];
+
+		if (netif_running(info->netdev))
+			napi_disable(&queue->napi);
+		napi_hash_del(&queue->napi);
+		netif_napi_del(&queue->napi);
+	}
+
+	/* Let busy-polling sockets that found a queue's NAPI move on. */
+	synchronize_net();
+
+	for (i = 0; i < info->num_queues; i++)
+		xennet_release_queue(&info->queues[i]);
+
+	kfree(info->queues);
+	info->queues = NULL;
+	info->num_queues = 0;
+}
+
 static int network_connect(struct net_device *dev)
 {
 	struct netfront_info *np = netdev_priv(dev);
+	struct netfront_queue *queue;
 	int i, requeue_idx, err;
 	struct sk_buff *skb;
 	grant_ref_t ref;
 	netif_rx_request_t *req;
-	unsigned int feature_rx_copy, feature_rx_flip;
+	unsigned int feature_rx_copy, feature_rx_flip, feature_persistent;
+	unsigned int max_queues, num_queues, max_order, order, j;
 
 	err = xenbus_scanf(XBT_NIL, np->xbdev->otherend,
 			   "feature-rx-copy", "%u", &feature_rx_copy);
@@ -2002,6 +3021,20 @@ static int network_connect(struct net_device *dev)
 			   "feature-rx-flip", "%u", &feature_rx_flip);
 	if (err != 1)
 		feature_rx_flip = 1;
+	err = xenbus_scanf(XBT_NIL, np->xbdev->otherend,
+			   "feature-persistent", "%u", &feature_persistent);
+	if (err != 1)
+		feature_persistent = 0;
+
+	/* Backends without multi-queue support get a single queue. */
+	err = xenbus_scanf(XBT_NIL, np->xbdev->otherend,
+			   "multi-queue-max-queues", "%u", &max_queues);
+	if (err != 1)
+		max_queues = 1;
+	num_queues = min(max_queues, xennet_max_queues);
+	num_queues = min(num_queues, dev->num_tx_queues);
+	if (!num_queues)
+		num_queues = 1;
 
 	/*
 	 * Copy packets on receive path if:
@@ -2011,58 +3044,132 @@ static int network_connect(struct net_device *dev)
 	np->copying_receiver = ((MODPARM_rx_copy && feature_rx_copy) ||
 				(MODPARM_rx_flip && !feature_rx_flip));
 
+	/*
+	 * Backends without multi-page ring support get single-page rings,
+	 * as does a flipping receiver, whose multicall arrays are sized for
+	 * one page.
+	 */
+	err = xenbus_scanf(XBT_NIL, np->xbdev->otherend,
+			   "max-ring-page-order", "%u", &max_order);
+	if (err != 1 || !np->copying_receiver)
+		max_order = 0;
+	order = min(max_order, xennet_max_ring_page_order);
+	order = min(order, XENNET_MAX_RING_PAGE_ORDER);
+
+	/*
+	 * The queue count and ring size can only change across a reconnect
+	 * (e.g. after migration to a host whose backend offers different
+	 * limits).  Pending buffers of the old queues are dropped.
+	 */
+	if (np->num_queues != num_queues || np->ring_page_order != order) {
+		if (np->num_queues)
+			xennet_destroy_queues(np);
+		np->ring_page_order = order;
+		err = xennet_create_queues(np, num_queues);
+		if (err) {
+			xenbus_dev_fatal(np->xbdev, err, "creating queues");
+			return err;
+		}
+	}
+
+	/* Persistent pages are copied through, so only for copying receivers. */
+	np->persistent_grants = (xennet_persistent_grants && feature_persistent &&
+				 np->copying_receiver);
+	for (j = 0; np->persistent_grants && j < np->num_queues; j++) {
+		if (xennet_alloc_pgrants(&np->queues[j])) {
+			/* Not fatal: fall back to granting per packet. */
+			while (j--)
+				xennet_free_pgrants(&np->queues[j]);
+			np->persistent_grants = 0;
+		}
+	}
+
+	/* Without persistent pages, keep a few for fragmented packets. */
+	for (j = 0; j < np->num_queues; j++) {
+		if (np->persistent_grants)
+			xennet_free_tx_bounce(&np->queues[j]);
+		else if (xennet_alloc_tx_bounce(&np->queues[j]))
+			netdev_warn(dev, "no TX bounce pages for queue %u\n", j);
+	}
+
 	err = talk_to_backend(np->xbdev, np);
 	if (err)
 		return err;
 
 	rtnl_lock();
+	netif_set_real_num_tx_queues(dev, np->num_queues);
+	netif_set_real_num_rx_queues(dev, np->num_queues);
 	netdev_update_features(dev);
 	rtnl_unlock();
 
-	DPRINTK("device %s has %sing receive path.\n",
-		dev->name, np->copying_receiver ? "copy" : "flipp");
+	DPRINTK("device %s has %sing receive path and %u queue(s) of order %u%s.\n",
+		dev->name, np->copying_receiver ? "copy" : "flipp",
+		np->num_queues, np->ring_page_order,
+		np->persistent_grants ? " with persistent grants" : "");
 
-	spin_lock_bh(&np->rx_lock);
-	spin_lock_irq(&np->tx_lock);
+	for (j = 0; j < np->num_queues; j++) {
+		queue = &np->queues[j];
 
-	/*
-	 * Recovery procedure:
-	 *  NB. Freelist index entries are always going to be less than
-	 *  PAGE_OFFSET, whereas pointers to skbs will always be equal or
-	 *  greater than PAGE_OFFSET: we use this property to distinguish
-	 *  them.
-	 */
+		spin_lock_bh(&queue->rx_lock);
+		spin_lock_irq(&queue->tx_lock);
+
+		/*
+		 * Recovery procedure:
+		 *  NB. Freelist index entries are always going to be less
+		 *  than PAGE_OFFSET, whereas pointers to skbs will always be
+		 *  equal or greater than PAGE_OFFSET: we use this property to
+		 *  distinguish them.
+		 */
 
-	/* Step 1: Discard all pending TX packet fragments. */
-	netif_release_tx_bufs(np);
+		/* Step 1: Discard all pending TX packet fragments. */
+		netif_release_tx_bufs(queue);
 
-	/* Step 2: Rebuild the RX buffer freelist and the RX ring itself. */
-	for (requeue_idx = 0, i = 0; i < NET_RX_RING_SIZE; i++) {
-		unsigned long pfn;
+		/* Step 2: Rebuild the RX buffer freelist and the RX ring. */
+		for (requeue_idx = 0, i = 0; i < queue->rx_ring_size; i++) {
+			unsigned long pfn;
 
-		if (!np->rx_skbs[i])
-			continue;
+			if (!queue->rx_skbs[i])
+				continue;
 
-		skb = np->rx_skbs[requeue_idx] = xennet_get_rx_skb(np, i);
-		ref = np->grant_rx_ref[requeue_idx] = xennet_get_rx_ref(np, i);
-		req = RING_GET_REQUEST(&np->rx, requeue_idx);
-		pfn = page_to_pfn(skb_frag_page(skb_shinfo(skb)->frags));
+			skb = queue->rx_skbs[requeue_idx] =
+				xennet_get_rx_skb(queue, i);
+			ref = queue->grant_rx_ref[requeue_idx] =
+				xennet_get_rx_ref(queue, i);
+			req = RING_GET_REQUEST(&queue->rx, requeue_idx);
+			pfn = page_to_pfn(
+				skb_frag_page(skb_shinfo(skb)->frags));
+
+			if (!np->copying_receiver) {
+				gnttab_grant_foreign_transfer_ref(
+					ref, np->xbdev->otherend_id, pfn);
+			} else if (queue->rx_pgrants) {
+				struct netfront_pgrant *pgrant =
+					list_first_entry(&queue->rx_pgrant_free,
+							 struct netfront_pgrant,
+							 node);
+
+				list_del(&pgrant->node);
+				NETFRONT_SKB_CB(skb)->pgrant = pgrant;
+				gnttab_release_grant_reference(
+					&queue->gref_rx_head, ref);
+				ref = queue->grant_rx_ref[requeue_idx] =
+					pgrant->gref;
+			} else {
+				gnttab_grant_foreign_access_ref(
+					ref, np->xbdev->otherend_id,
+					pfn_to_mfn(pfn), 0);
+			}
+			req->gref = ref;
+			req->id   = requeue_idx;
 
-		if (!np->copying_receiver) {
-			gnttab_grant_foreign_transfer_ref(
-				ref, np->xbdev->otherend_id, pfn);
-		} else {
-			gnttab_grant_foreign_access_ref(
-				ref, np->xbdev->otherend_id,
-				pfn_to_mfn(pfn), 0);
+			requeue_idx++;
 		}
-		req->gref = ref;
-		req->id   = requeue_idx;
 
-		requeue_idx++;
-	}
+		queue->rx.req_prod_pvt = requeue_idx;
 
-	np->rx.req_prod_pvt = requeue_idx;
+		spin_unlock_irq(&queue->tx_lock);
+		spin_unlock_bh(&queue->rx_lock);
+	}
 
 	/*
 	 * Step 3: All public and private state should now be sane.  Get
@@ -2071,12 +3178,19 @@ static int network_connect(struct net_device *dev)
 	 * packets.
 	 */
 	netfront_carrier_on(np);
-	notify_remote_via_irq(np->irq);
-	network_tx_buf_gc(dev);
-	network_alloc_rx_buffers(dev);
+	for (j = 0; j < np->num_queues; j++) {
+		queue = &np->queues[j];
+
+		spin_lock_bh(&queue->rx_lock);
+		spin_lock_irq(&queue->tx_lock);
+
+		notify_remote_via_irq(queue->irq);
+		network_tx_buf_gc(queue);
+		network_alloc_rx_buffers(queue);
 
-	spin_unlock_irq(&np->tx_lock);
-	spin_unlock_bh(&np->rx_lock);
+		spin_unlock_irq(&queue->tx_lock);
+		spin_unlock_bh(&queue->rx_lock);
+	}
 
 	return 0;
 }
@@ -2084,19 +3198,116 @@ static int network_connect(struct net_device *dev)
 static void netif_uninit(struct net_device *dev)
 {
 	struct netfront_info *np = netdev_priv(dev);
-	netif_release_tx_bufs(np);
-	if (np->copying_receiver)
-		netif_release_rx_bufs_copy(np);
-	else
-		netif_release_rx_bufs_flip(np);
-	gnttab_free_grant_references(np->gref_tx_head);
-	gnttab_free_grant_references(np->gref_rx_head);
+
+	xennet_destroy_queues(np);
+}
+
+static void xennet_get_ringparam(struct net_device *dev,
+				 struct ethtool_ringparam *ring)
+{
+	struct netfront_info *np = netdev_priv(dev);
+	struct netfront_queue *queue;
+
+	/* All queues share the same ring size and targets. */
+	if (!np->num_queues)
+		return;
+	queue = &np->queues[0];
+
+	ring->rx_max_pending = queue->rx_ring_size;
+	ring->tx_max_pending = queue->tx_ring_size;
+	ring->rx_pending = queue->rx_max_target;
+	ring->tx_pending = queue->tx_max_target;
+}
+
+/*
+ * The ring size is fixed by the page order negotiated at connect time;
+ * this only changes how much of it is used: the RX fill target and the
+ * number of TX slots in flight.
+ */
+static int xennet_set_ringparam(struct net_device *dev,
+				struct ethtool_ringparam *ring)
+{
+	struct netfront_info *np = netdev_priv(dev);
+	struct netfront_queue *queue;
+	unsigned int i;
+
+	if (ring->rx_mini_pending || ring->rx_jumbo_pending)
+		return -EINVAL;
+	if (!np->num_queues)
+		return -ENODEV;
+
+	queue = &np->queues[0];
+	if (ring->rx_pending < RX_MIN_TARGET ||
+	    ring->rx_pending > queue->rx_ring_size ||
+	    ring->tx_pending < TX_MIN_TARGET ||
+	    ring->tx_pending > queue->tx_ring_size)
+		return -EINVAL;
+
+	for (i = 0; i < np->num_queues; i++) {
+		queue = &np->queues[i];
+
+		spin_lock_bh(&queue->rx_lock);
+		spin_lock_irq(&queue->tx_lock);
+		queue->tx_max_target = ring->tx_pending;
+		queue->rx_max_target = ring->rx_pending;
+		if (queue->rx_min_target > queue->rx_max_target)
+			queue->rx_min_target = queue->rx_max_target;
+		if (queue->rx_target > queue->rx_max_target)
+			queue->rx_target = queue->rx_max_target;
+		if (queue->rx_target < queue->rx_min_target)
+			queue->rx_target = queue->rx_min_target;
+		spin_unlock_irq(&queue->tx_lock);
+
+		network_alloc_rx_buffers(queue);
+
+		spin_unlock_bh(&queue->rx_lock);
+	}
+
+	return 0;
+}
+
+static int xennet_get_coalesce(struct net_device *dev,
+			       struct ethtool_coalesce *ec)
+{
+	struct netfront_info *np = netdev_priv(dev);
+
+	ec->rx_coalesce_usecs = np->rx_coalesce_usecs;
+	ec->rx_max_coalesced_frames = np->rx_coalesce_frames;
+	ec->use_adaptive_rx_coalesce = np->rx_coalesce_adaptive;
+
+	return 0;
+}
+
+/*
+ * rx-usecs 0 or rx-frames 1 turns moderation off.  With adaptive-rx
+ * off every batch is rx-frames long, otherwise rx-frames is the cap.
+ */
+static int xennet_set_coalesce(struct net_device *dev,
+			       struct ethtool_coalesce *ec)
+{
+	struct netfront_info *np = netdev_priv(dev);
+
+	if (ec->rx_coalesce_usecs > XENNET_MAX_COALESCE_USECS ||
+	    ec->rx_max_coalesced_frames < 1 ||
+	    ec->rx_max_coalesced_frames > NET_RX_RING_SIZE(0) / 2)
+		return -EINVAL;
+
+	np->rx_coalesce_usecs = ec->rx_coalesce_usecs;
+	np->rx_coalesce_frames = ec->rx_max_coalesced_frames;
+	np->rx_coalesce_adaptive = !!ec->use_adaptive_rx_coalesce;
+
+	/* Queues pick the new limits up when they next re-arm. */
+	return 0;
 }
 
 static const struct ethtool_ops network_ethtool_ops =
 {
 	.get_drvinfo = netfront_get_drvinfo,
 	.get_link = ethtool_op_get_link,
+	.get_ringparam = xennet_get_ringparam,
+	.set_ringparam = xennet_set_ringparam,
+	.get_coalesce = xennet_get_coalesce,
+	.set_coalesce = xennet_set_coalesce,
 
 	.get_sset_count = xennet_get_sset_count,
 	.get_ethtool_stats = xennet_get_ethtool_stats,
@@ -2109,7 +3320,10 @@ static ssize_t show_rxbuf_min(struct device *dev,
 {
 	struct netfront_info *info = netdev_priv(to_net_dev(dev));
 
-	return sprintf(buf, "%u\n", info->rx_min_target);
+	/* All queues share the same targets; report the first one. */
+	if (!info->num_queues)
+		return sprintf(buf, "0\n");
+	return sprintf(buf, "%u\n", info->queues[0].rx_min_target);
 }
 
 static ssize_t store_rxbuf_min(struct device *dev,
@@ -2118,6 +3332,8 @@ static ssize_t store_rxbuf_min(struct device *dev,
 {
 	struct net_device *netdev = to_net_dev(dev);
 	struct netfront_info *np = netdev_priv(netdev);
+	struct netfront_queue *queue;
+	unsigned int i;
 	char *endp;
 	unsigned long target;
 
@@ -2130,19 +3346,24 @@ static ssize_t store_rxbuf_min(struct device *dev,
 
 	if (target < RX_MIN_TARGET)
 		target = RX_MIN_TARGET;
-	if (target > RX_MAX_TARGET)
-		target = RX_MAX_TARGET;
 
-	spin_lock_bh(&np->rx_lock);
-	if (target > np->rx_max_target)
-		np->rx_max_target = target;
-	np->rx_min_target = target;
-	if (target > np->rx_target)
-		np->rx_target = target;
+	for (i = 0; i < np->num_queues; i++) {
+		queue = &np->queues[i];
+
+		if (target > RX_MAX_TARGET(queue))
+			target = RX_MAX_TARGET(queue);
+
+		spin_lock_bh(&queue->rx_lock);
+		if (target > queue->rx_max_target)
+			queue->rx_max_target = target;
+		queue->rx_min_target = target;
+		if (target > queue->rx_target)
+			queue->rx_target = target;
 
-	network_alloc_rx_buffers(netdev);
+		network_alloc_rx_buffers(queue);
 
-	spin_unlock_bh(&np->rx_lock);
+		spin_unlock_bh(&queue->rx_lock);
+	}
 	return len;
 }
 
@@ -2151,7 +3372,10 @@ static ssize_t show_rxbuf_max(struct device *dev,
 {
 	struct netfront_info *info = netdev_priv(to_net_dev(dev));
 
-	return sprintf(buf, "%u\n", info->rx_max_target);
+	/* All queues share the same targets; report the first one. */
+	if (!info->num_queues)
+		return sprintf(buf, "0\n");
+	return sprintf(buf, "%u\n", info->queues[0].rx_max_target);
 }
 
 static ssize_t store_rxbuf_max(struct device *dev,
@@ -2160,6 +3384,8 @@ static ssize_t store_rxbuf_max(struct device *dev,
 {
 	struct net_device *netdev = to_net_dev(dev);
 	struct netfront_info *np = netdev_priv(netdev);
+	struct netfront_queue *queue;
+	unsigned int i;
 	char *endp;
 	unsigned long target;
 
@@ -2172,19 +3398,24 @@ static ssize_t store_rxbuf_max(struct device *dev,
 
 	if (target < RX_MIN_TARGET)
 		target = RX_MIN_TARGET;
-	if (target > RX_MAX_TARGET)
-		target = RX_MAX_TARGET;
 
-	spin_lock_bh(&np->rx_lock);
-	if (target < np->rx_min_target)
-		np->rx_min_target = target;
-	np->rx_max_target = target;
-	if (target < np->rx_target)
-		np->rx_target = target;
+	for (i = 0; i < np->num_queues; i++) {
+		queue = &np->queues[i];
+
+		if (target > RX_MAX_TARGET(queue))
+			target = RX_MAX_TARGET(queue);
 
-	network_alloc_rx_buffers(netdev);
+		spin_lock_bh(&queue->rx_lock);
+		if (target < queue->rx_min_target)
+			queue->rx_min_target = target;
+		queue->rx_max_target = target;
+		if (target < queue->rx_target)
+			queue->rx_target = target;
 
-	spin_unlock_bh(&np->rx_lock);
+		network_alloc_rx_buffers(queue);
+
+		spin_unlock_bh(&queue->rx_lock);
+	}
 	return len;
 }
 
@@ -2193,13 +3424,77 @@ static ssize_t show_rxbuf_cur(struct device *dev,
 {
 	struct netfront_info *info = netdev_priv(to_net_dev(dev));
 
-	return sprintf(buf, "%u\n", info->rx_target);
+	/* All queues share the same targets; report the first one. */
+	if (!info->num_queues)
+		return sprintf(buf, "0\n");
+	return sprintf(buf, "%u\n", info->queues[0].rx_target);
+}
+
+/*
+ * Per-queue Byte Queue Limits state, one "<queue> <limit> <inflight>
+ * <completed>" line per TX queue.  The same limits can be tuned under
+ * queues/tx-<n>/byte_queue_limits.
+ */
+static ssize_t show_tx_bql(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	struct net_device *netdev = to_net_dev(dev);
+	struct netfront_info *np = netdev_priv(netdev);
+	ssize_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < np->num_queues; i++) {
+#ifdef CONFIG_BQL
+		struct dql *dql = &netdev_get_tx_queue(netdev, i)->dql;
+
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%u %u %u %u\n",
+				 i, dql->limit,
+				 dql->num_queued - dql->num_completed,
+				 dql->num_completed);
+#else
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%u - - -\n", i);
+#endif
+	}
+	return len;
+}
+
+static ssize_t show_busy_poll(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct netfront_info *np = netdev_priv(to_net_dev(dev));
+
+	return sprintf(buf, "%u\n", np->busy_poll);
+}
+
+/*
+ * Whether sockets with SO_BUSY_POLL (or net.core.busy_read) may reap the
+ * RX rings directly.  Without CONFIG_NET_RX_BUSY_POLL this has no effect.
+ */
+static ssize_t store_busy_poll(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t len)
+{
+	struct netfront_info *np = netdev_priv(to_net_dev(dev));
+	char *endp;
+	unsigned long enable;
+
+	if (!capable(CAP_NET_ADMIN))
+		return -EPERM;
+
+	enable = simple_strtoul(buf, &endp, 0);
+	if (endp == buf)
+		return -EBADMSG;
+
+	np->busy_poll = !!enable;
+	return len;
 }
 
 static struct device_attribute xennet_attrs[] = {
 	__ATTR(rxbuf_min, S_IRUGO|S_IWUSR, show_rxbuf_min, store_rxbuf_min),
 	__ATTR(rxbuf_max, S_IRUGO|S_IWUSR, show_rxbuf_max, store_rxbuf_max),
 	__ATTR(rxbuf_cur, S_IRUGO, show_rxbuf_cur, NULL),
+	__ATTR(tx_bql, S_IRUGO, show_tx_bql, NULL),
+	__ATTR(busy_poll, S_IRUGO|S_IWUSR, show_busy_poll, store_busy_poll),
 };
 
 static int xennet_sysfs_addif(struct net_device *netdev)
@@ -2263,7 +3558,6 @@ static netdev_features_t xennet_fix_features(struct net_device *dev,
 		if (!val)
 			features &= ~NETIF_F_TSO;
 	}
-#ifdef OPENSUSE_1302
 	if (features & NETIF_F_IPV6_CSUM) {
 		if (xenbus_scanf(XBT_NIL, np->xbdev->otherend,
 				 "feature-ipv6-csum-offload", "%d", &val) < 0)
@@ -2282,8 +3576,6 @@ static netdev_features_t xennet_fix_features(struct net_device *dev,
 			features &= ~NETIF_F_TSO6;
 	}
 
-
-#endif
 	return features;
 }
 
@@ -2301,7 +3593,11 @@ static int xennet_set_features(struct net_device *dev,
 #ifdef CONFIG_NET_POLL_CONTROLLER
 static void xennet_poll_controller(struct net_device *dev)
 {
-	netif_int(0, dev);
+	struct netfront_info *np = netdev_priv(dev);
+	unsigned int i;
+
+	for (i = 0; i < np->num_queues; i++)
+		netif_int(0, &np->queues[i]);
 }
 #endif
 
@@ -2310,6 +3606,7 @@ static const struct net_device_ops xennet_netdev_ops = {
 	.ndo_open               = network_open,
 	.ndo_stop               = network_close,
 	.ndo_start_xmit         = network_start_xmit,
+	.ndo_select_queue       = xennet_select_queue,
 	.ndo_set_rx_mode        = network_set_multicast_list,
 	.ndo_set_mac_address    = xennet_set_mac_address,
 	.ndo_validate_addr      = eth_validate_addr,
@@ -2317,6 +3614,9 @@ static const struct net_device_ops xennet_netdev_ops = {
 	.ndo_set_features       = xennet_set_features,
 #ifdef CONFIG_NET_POLL_CONTROLLER
 	.ndo_poll_controller    = xennet_poll_controller,
+#endif
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	.ndo_busy_poll          = xennet_busy_poll,
 #endif
 	.ndo_change_mtu	        = xennet_change_mtu,
 	.ndo_get_stats64        = xennet_get_stats64,
@@ -2328,26 +3628,24 @@ static struct net_device *create_netdev(struct xenbus_device *dev)
 	struct net_device *netdev = NULL;
 	struct netfront_info *np = NULL;
 
-	netdev = alloc_etherdev(sizeof(struct netfront_info));
+	netdev = alloc_etherdev_mq(sizeof(struct netfront_info),
+				   xennet_max_queues);
 	if (!netdev)
 		return ERR_PTR(-ENOMEM);
 
 	np                   = netdev_priv(netdev);
 	np->xbdev            = dev;
 
-	spin_lock_init(&np->tx_lock);
-	spin_lock_init(&np->rx_lock);
+	/* Queues are set up once the backend's limit is known. */
+	np->queues           = NULL;
+	np->num_queues       = 0;
 
-	init_accelerator_vif(np, dev);
-
-	skb_queue_head_init(&np->rx_batch);
-	np->rx_target     = RX_DFL_MIN_TARGET;
-	np->rx_min_target = RX_DFL_MIN_TARGET;
-	np->rx_max_target = RX_MAX_TARGET;
+	np->rx_coalesce_usecs    = XENNET_COALESCE_USECS;
+	np->rx_coalesce_frames   = XENNET_COALESCE_FRAMES;
+	np->rx_coalesce_adaptive = true;
+	np->busy_poll            = true;
 
-	init_timer(&np->rx_refill_timer);
-	np->rx_refill_timer.data = (unsigned long)netdev;
-	np->rx_refill_timer.function = rx_refill_timeout;
+	init_accelerator_vif(np, dev);
 
 	err = -ENOMEM;
 #ifdef OPENSUSE_1302
@@ -2361,43 +3659,12 @@ static struct net_device *create_netdev(struct xenbus_device *dev)
 	for_each_possible_cpu(i)
 		u64_stats_init(&per_cpu_ptr(np->stats, i)->syncp);
 #endif
-	/* Initialise {tx,rx}_skbs as a free chain containing every entry. */
-	for (i = 0; i <= NET_TX_RING_SIZE; i++) {
-		np->tx_skbs[i] = (void *)((unsigned long) i+1);
-		np->grant_tx_ref[i] = GRANT_INVALID_REF;
-	}
-
-	for (i = 0; i < NET_RX_RING_SIZE; i++) {
-		np->rx_skbs[i] = NULL;
-		np->grant_rx_ref[i] = GRANT_INVALID_REF;
-	}
-
-	/* A grant for every tx ring slot */
-	if (gnttab_alloc_grant_references(TX_MAX_TARGET,
-					  &np->gref_tx_head) < 0) {
-		pr_alert("#### netfront can't alloc tx grant refs\n");
-		err = -ENOMEM;
-		goto exit_free_stats;
-	}
-	/* A grant for every rx ring slot */
-	if (gnttab_alloc_grant_references(RX_MAX_TARGET,
-					  &np->gref_rx_head) < 0) {
-		pr_alert("#### netfront can't alloc rx grant refs\n");
-		err = -ENOMEM;
-		goto exit_free_tx;
-	}
 
 	netdev->netdev_ops	= &xennet_netdev_ops;
-	netif_napi_add(netdev, &np->napi, netif_poll, 64);
-#ifdef OPENSUSE_1302
-	netdev->features        = NETIF_F_RXCSUM | NETIF_F_GSO_ROBUST;
+	netdev->features        = NETIF_F_RXCSUM | NETIF_F_GSO_ROBUST |
+				  NETIF_F_GRO;
 	netdev->hw_features	= NETIF_F_IP_CSUM | NETIF_F_IPV6_CSUM
 				  | NETIF_F_SG | NETIF_F_TSO | NETIF_F_TSO6;
-#else
-	netdev->features        = NETIF_F_IP_CSUM | NETIF_F_RXCSUM |
-				  NETIF_F_GSO_ROBUST;
-	netdev->hw_features	= NETIF_F_IP_CSUM | NETIF_F_SG | NETIF_F_TSO;
-#endif
 	/*
          * Assume that all hw features are available for now. This set
          * will be adjusted by the call to netdev_update_features() in
@@ -2422,46 +3689,57 @@ static struct net_device *create_netdev(struct xenbus_device *dev)
 
 	return netdev;
 
- exit_free_tx:
-	gnttab_free_grant_references(np->gref_tx_head);
- exit_free_stats:
-	free_percpu(np->stats);
  exit:
 	free_netdev(netdev);
 	return ERR_PTR(err);
 }
 
-static void netif_release_rings(struct netfront_info *info)
+static void netif_release_rings(struct netfront_queue *queue)
 {
-	end_access(info->tx_ring_ref, info->tx.sring);
-	end_access(info->rx_ring_ref, info->rx.sring);
-	info->tx_ring_ref = GRANT_INVALID_REF;
-	info->rx_ring_ref = GRANT_INVALID_REF;
-	info->tx.sring = NULL;
-	info->rx.sring = NULL;
+	if (queue->tx.sring)
+		vunmap(queue->tx.sring);
+	if (queue->rx.sring)
+		vunmap(queue->rx.sring);
+	gnttab_multi_end_foreign_access(XENNET_MAX_RING_PAGES,
+					queue->tx_ring_refs,
+					queue->tx_ring_pages);
+	gnttab_multi_end_foreign_access(XENNET_MAX_RING_PAGES,
+					queue->rx_ring_refs,
+					queue->rx_ring_pages);
+	queue->tx.sring = NULL;
+	queue->rx.sring = NULL;
 }
 
 static void netif_disconnect_backend(struct netfront_info *info)
 {
-	/* Stop old i/f to prevent errors whilst we rebuild the state. */
-	spin_lock_bh(&info->rx_lock);
-	spin_lock_irq(&info->tx_lock);
-	netfront_carrier_off(info);
-	spin_unlock_irq(&info->tx_lock);
-	spin_unlock_bh(&info->rx_lock);
+	struct netfront_queue *queue;
+	unsigned int i;
 
-	if (info->irq)
-		unbind_from_irqhandler(info->irq, info->netdev);
-	info->irq = 0;
+	/*
+	 * Stop old i/f to prevent errors whilst we rebuild the state.
+	 * Cycling each queue's locks waits for any poll or xmit that
+	 * still saw the carrier up.
+	 */
+	netfront_carrier_off(info);
+	for (i = 0; i < info->num_queues; i++) {
+		queue = &info->queues[i];
+		spin_lock_bh(&queue->rx_lock);
+		spin_lock_irq(&queue->tx_lock);
+		spin_unlock_irq(&queue->tx_lock);
+		spin_unlock_bh(&queue->rx_lock);
+	}
 
-	netif_release_rings(info);
-}
+	for (i = 0; i < info->num_queues; i++) {
+		queue = &info->queues[i];
 
+		if (queue->irq)
+			unbind_from_irqhandler(queue->irq, queue);
+		queue->irq = 0;
 
-static void end_access(int ref, void *page)
-{
-	if (ref != GRANT_INVALID_REF)
-		gnttab_end_foreign_access(ref, (unsigned long)page);
+		netif_release_rings(queue);
+		xennet_free_pgrants(queue);
+		xennet_free_tx_bounce(queue);
+	}
 }
 
 
@@ -2499,6 +3777,10 @@ static int __init netif_init(void)
 		MODPARM_rx_copy = true; /* Default is to copy. */
 #endif
 
+	/* Allow as many queues as there are CPUs, by default */
+	if (xennet_max_queues == 0)
+		xennet_max_queues = num_online_cpus();
+
 	netif_init_accel();
 
 	pr_info("Initialising virtual ethernet driver.\n");
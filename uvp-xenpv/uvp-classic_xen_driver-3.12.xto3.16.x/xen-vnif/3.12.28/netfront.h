@@ -39,9 +39,13 @@
 #include <linux/netdevice.h>
 #include <linux/skbuff.h>
 #include <linux/list.h>
+#include <linux/hrtimer.h>
 
-#define NET_TX_RING_SIZE __CONST_RING_SIZE(netif_tx, PAGE_SIZE)
-#define NET_RX_RING_SIZE __CONST_RING_SIZE(netif_rx, PAGE_SIZE)
+/* Shared rings span 1 << ring-page-order pages, see network_connect(). */
+#define XENNET_MAX_RING_PAGE_ORDER 4U
+#define XENNET_MAX_RING_PAGES (1U << XENNET_MAX_RING_PAGE_ORDER)
+#define NET_TX_RING_SIZE(order) __CONST_RING_SIZE(netif_tx, PAGE_SIZE << (order))
+#define NET_RX_RING_SIZE(order) __CONST_RING_SIZE(netif_rx, PAGE_SIZE << (order))
 
 #include <xen/xenbus.h>
 
@@ -156,9 +160,22 @@ struct netfront_accelerator {
 	spinlock_t vif_states_lock;
 };
 
-struct netfront_info {
-	struct list_head list;
-	struct net_device *netdev;
+/* A page granted to the backend for the lifetime of the connection. */
+struct netfront_pgrant {
+	struct list_head node;
+	struct page *page;
+	grant_ref_t gref;
+};
+
+/*
+ * Per-queue state.  Every queue owns its own TX/RX shared ring pair,
+ * grant references, event channel and NAPI context, so that queues
+ * can be serviced concurrently on different CPUs.
+ */
+struct netfront_queue {
+	unsigned int id; /* Queue ID, 0-based */
+	char name[IFNAMSIZ + 6]; /* DEVNAME-q99 */
+	struct netfront_info *info;
 
 	struct netif_tx_front_ring tx;
 	struct netif_rx_front_ring rx;
@@ -169,43 +186,117 @@ struct netfront_info {
 	struct napi_struct	napi;
 
 	unsigned int irq;
-	unsigned int copying_receiver;
-	unsigned int carrier;
+
+	/* Ring slots, fixed for the life of the queue. */
+	unsigned int tx_ring_size;
+	unsigned int rx_ring_size;
 
 	/* Receive-ring batched refills. */
 #define RX_MIN_TARGET 8
 #define RX_DFL_MIN_TARGET 64
-#define RX_MAX_TARGET min_t(int, NET_RX_RING_SIZE, 256)
+#define RX_MAX_TARGET(queue) ((queue)->rx_ring_size)
 	unsigned rx_min_target, rx_max_target, rx_target;
 	struct sk_buff_head rx_batch;
 
 	struct timer_list rx_refill_timer;
 
+	/* RX interrupt moderation, see xennet_rx_final_check(). */
+	struct hrtimer rx_coalesce_timer;
+	unsigned int rx_event_frames;
+	bool rx_coalesce_expired;
+
+	/*
+	 * RX pages passed up the stack, each with an extra reference held
+	 * here.  A page is reused for refill once that is the only one left.
+	 */
+#define XENNET_RX_RECYCLE 256
+	struct page *rx_recycle[XENNET_RX_RECYCLE];
+	unsigned int rx_recycle_prod, rx_recycle_cons;
+
 	/*
 	 * {tx,rx}_skbs store outstanding skbuffs. The first entry in tx_skbs
-	 * is an index into a chain of free entries.
+	 * is an index into a chain of free entries.  These and the grant
+	 * arrays have tx_ring_size + 1 and rx_ring_size entries.
 	 */
-	struct sk_buff *tx_skbs[NET_TX_RING_SIZE+1];
-	struct sk_buff *rx_skbs[NET_RX_RING_SIZE];
+	struct sk_buff **tx_skbs;
+	struct sk_buff **rx_skbs;
 
-#define TX_MAX_TARGET min_t(int, NET_TX_RING_SIZE, 256)
+	/* In-flight TX slots are capped at tx_max_target. */
+#define TX_MIN_TARGET (2 * (MAX_SKB_FRAGS + 2))
+	unsigned int tx_max_target;
 	grant_ref_t gref_tx_head;
-	grant_ref_t grant_tx_ref[NET_TX_RING_SIZE + 1];
+	grant_ref_t *grant_tx_ref;
 	grant_ref_t gref_rx_head;
-	grant_ref_t grant_rx_ref[NET_RX_RING_SIZE];
+	grant_ref_t *grant_rx_ref;
+
+	grant_ref_t tx_ring_refs[XENNET_MAX_RING_PAGES];
+	grant_ref_t rx_ring_refs[XENNET_MAX_RING_PAGES];
+	struct page *tx_ring_pages[XENNET_MAX_RING_PAGES];
+	struct page *rx_ring_pages[XENNET_MAX_RING_PAGES];
+
+	/*
+	 * Persistent grants, NULL unless negotiated: a page per TX id and
+	 * per RX buffer.  An RX buffer using one has it in its skb's cb.
+	 */
+	struct netfront_pgrant *tx_pgrants;	/* indexed by TX id */
+	struct netfront_pgrant *rx_pgrants;
+	struct list_head rx_pgrant_free;
+
+	/*
+	 * Pre-granted pages that badly fragmented packets are copied into
+	 * when there are no persistent grants, see xennet_tx_bounce().
+	 * tx_bounce_id[id] is the page TX id holds, if any.
+	 */
+#define XENNET_TX_BOUNCE_PAGES (2 * (MAX_SKB_FRAGS + 1))
+	struct netfront_pgrant *tx_bounce;
+	struct netfront_pgrant **tx_bounce_id;
+	struct list_head tx_bounce_free;
+	unsigned int tx_bounce_avail;
+
+	/* Page flipping is only done on single-page rings. */
+	unsigned long rx_pfn_array[NET_RX_RING_SIZE(0)];
+	struct multicall_entry rx_mcl[NET_RX_RING_SIZE(0)+1];
+	struct mmu_update rx_mmu[NET_RX_RING_SIZE(0)];
+
+	/* Statistics */
+	unsigned long rx_errors;
+	unsigned long rx_gso_csum_fixups;
+	unsigned long rx_gro_merged;
+	unsigned long rx_recycle_hits;
+	unsigned long rx_alloc_failures;
+	unsigned long rx_refill_timeouts;
+	unsigned long rx_irq_packets;
+	unsigned long rx_busy_poll_packets;
+	unsigned long tx_coalesced;
+	unsigned long tx_linearized;
+};
+
+struct netfront_info {
+	struct list_head list;
+	struct net_device *netdev;
+
+	unsigned int copying_receiver;
+	unsigned int persistent_grants;
+	unsigned int ring_page_order;
+	unsigned int carrier;
+
+	/* RX interrupt moderation limits, set with ethtool -C. */
+	unsigned int rx_coalesce_usecs;
+	unsigned int rx_coalesce_frames;
+	bool rx_coalesce_adaptive;
+
+	/* Allow sockets to busy-poll the RX rings, see xennet_busy_poll(). */
+	bool busy_poll;
+
+	/* Queues negotiated with the backend, see network_connect(). */
+	struct netfront_queue *queues;
+	unsigned int num_queues;
 
 	struct xenbus_device *xbdev;
-	int tx_ring_ref;
-	int rx_ring_ref;
 	u8 mac[ETH_ALEN];
 
-	unsigned long rx_pfn_array[NET_RX_RING_SIZE];
-	struct multicall_entry rx_mcl[NET_RX_RING_SIZE+1];
-	struct mmu_update rx_mmu[NET_RX_RING_SIZE];
-
 	/* Statistics */
 	struct netfront_stats __percpu *stats;
-	unsigned long rx_gso_csum_fixups;
 
 	/* Private pointer to state internal to accelerator module */
 	void *accel_priv;